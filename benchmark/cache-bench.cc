@@ -0,0 +1,116 @@
+/*
+ * cache-bench.cc
+ * Measure contention on the driver caches: a single mutex around an
+ * unordered_map, versus the lock-striped StripedMap.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * Usage: cache-bench [number-of-atoms]
+ *
+ * Each thread walks over the same set of Atoms, looking up the GUID
+ * of each, and computing and inserting it if missing, exactly as
+ * DHTAtomStorage::get_guid() does. The first pass over an empty
+ * cache is mostly misses; the second pass is all hits.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <opendht.h>
+
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/atom_types/atom_types.h>
+
+#include <opencog/persist/dht/StripedMap.h>
+
+using namespace opencog;
+
+/* ================================================================ */
+
+// The cache, as it was: one lock around everything.
+class LockedMap
+{
+	std::mutex _mtx;
+	std::unordered_map<Handle, dht::InfoHash> _map;
+
+	public:
+		bool get(const Handle& h, dht::InfoHash& val)
+		{
+			std::lock_guard<std::mutex> lck(_mtx);
+			const auto& it = _map.find(h);
+			if (_map.end() == it) return false;
+			val = it->second;
+			return true;
+		}
+		dht::InfoHash insert(const Handle& h, const dht::InfoHash& val)
+		{
+			std::lock_guard<std::mutex> lck(_mtx);
+			return _map.emplace(h, val).first->second;
+		}
+};
+
+template<typename MAP>
+static void walk(MAP& cache, const HandleSeq& atoms, size_t start)
+{
+	size_t n = atoms.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		// Threads start at different places, so that they are
+		// not all missing on the same Atom at the same time.
+		const Handle& h = atoms[(start + i) % n];
+		dht::InfoHash guid;
+		if (cache.get(h, guid)) continue;
+		guid = dht::InfoHash::get(h->to_short_string());
+		cache.insert(h, guid);
+	}
+}
+
+template<typename MAP>
+static void run(const char* name, const HandleSeq& atoms, size_t nthreads)
+{
+	MAP cache;
+	double secs[2];
+	for (int pass = 0; pass < 2; pass++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> pool;
+		for (size_t t = 0; t < nthreads; t++)
+			pool.emplace_back([&cache, &atoms, t, nthreads]()
+				{ walk(cache, atoms, t * atoms.size() / nthreads); });
+		for (std::thread& t : pool) t.join();
+		std::chrono::duration<double> dt =
+			std::chrono::steady_clock::now() - start;
+		secs[pass] = dt.count();
+	}
+
+	double lookups = (double) atoms.size() * nthreads;
+	printf("%-8s threads=%2zu  cold %10.0f lookups/s   warm %10.0f lookups/s\n",
+		name, nthreads, lookups / secs[0], lookups / secs[1]);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t natoms = 100000;
+	if (1 < argc) natoms = atoi(argv[1]);
+
+	HandleSeq atoms;
+	atoms.reserve(natoms);
+	for (size_t i = 0; i < natoms; i++)
+		atoms.emplace_back(createNode(CONCEPT_NODE,
+			"bench-" + std::to_string(i)));
+
+	for (size_t nthreads = 1; nthreads <= 64; nthreads *= 2)
+	{
+		run<LockedMap>("mutex", atoms, nthreads);
+		run<StripedMap<Handle, dht::InfoHash>>("striped", atoms, nthreads);
+	}
+	return 0;
+}
+
+/* ============================= END OF FILE ================= */
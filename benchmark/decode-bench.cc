@@ -0,0 +1,397 @@
+/*
+ * decode-bench.cc
+ * Compare the old find()-based s-expression decoder against the
+ * single-pass SexprReader.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * Usage: decode-bench [iterations]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/base/Link.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/atom_types/NameServer.h>
+#include <opencog/atoms/value/FloatValue.h>
+#include <opencog/atoms/value/LinkValue.h>
+#include <opencog/atoms/value/StringValue.h>
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+
+#include <opencog/persist/dht/SexprReader.h>
+
+using namespace opencog;
+
+/* ================================================================ */
+// The decoders as they were, before SexprReader; copied verbatim
+// except for the removal of the statistics counters.
+
+namespace legacy
+{
+
+Handle decodeStrAtom(std::string& scm, size_t& pos)
+{
+	size_t vos = scm.find('(', pos);
+	if (std::string::npos == vos)
+		throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
+			scm.substr(pos).c_str());
+
+	size_t post = scm.find(' ', vos+1);
+	if (post != std::string::npos)
+		scm[post] = 0;
+	else
+	{
+		post = scm.find(')', vos+1);
+		if (post == std::string::npos)
+			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
+				scm.substr(pos).c_str());
+		scm[post] = 0;
+	}
+
+	Type t = nameserver().getType(&scm[vos+1]);
+	if (nameserver().isNode(t))
+	{
+		size_t name_start = scm.find('"', post+1);
+		if (name_start == std::string::npos)
+			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
+				scm.substr(pos).c_str());
+		size_t name_end = scm.find('"', name_start+1);
+		if (name_end == std::string::npos)
+			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
+				scm.substr(pos).c_str());
+		scm[name_end] = 0; // Clobber the ending quote
+		size_t close = scm.find(')', name_end + 1);
+		if (close == std::string::npos)
+			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
+				scm.substr(pos).c_str());
+		pos = close + 1;
+		return createNode(t, &scm[name_start+1]);
+	}
+
+	if (not nameserver().isLink(t))
+		throw SyntaxException(TRACE_INFO, "Bad Atom string! %s\n",
+			scm.substr(pos).c_str());
+
+	HandleSeq oset;
+	size_t oset_start = scm.find('(', post+1);
+	size_t oset_end = scm.find(')', post+1);
+	if (std::string::npos == oset_end)
+		throw SyntaxException(TRACE_INFO, "Bad Atom string! %s\n",
+			scm.substr(pos).c_str());
+	while (oset_start != std::string::npos and oset_start < oset_end)
+	{
+		size_t vos = oset_start;
+		oset.push_back(decodeStrAtom(scm, vos));
+		oset_start = scm.find('(', vos);
+		oset_end = scm.find(')', vos);
+	}
+	if (oset_end == std::string::npos)
+		throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
+			scm.substr(pos).c_str());
+	pos = oset_end + 1;
+
+	return createLink(oset, t);
+}
+
+ValuePtr decodeStrValue(std::string& stv, size_t& pos)
+{
+	size_t totlen = stv.size();
+
+#define LV "(LinkValue"
+	if (0 == stv.compare(pos, sizeof(LV)-1, LV))
+	{
+		size_t vos = pos + sizeof(LV)-1;
+		std::vector<ValuePtr> vv;
+		vos = stv.find('(', vos);
+		size_t epos = vos;
+		size_t done = vos + 1;
+		while (vos != std::string::npos and vos < done)
+		{
+			epos = vos;
+			int pcnt = 1;
+			while (0 < pcnt and epos < totlen)
+			{
+				char c = stv[++epos];
+				if ('(' == c) pcnt ++;
+				else if (')' == c) pcnt--;
+			}
+			if (epos >= totlen)
+				throw SyntaxException(TRACE_INFO,
+					"Malformed LinkValue: %s", stv.substr(pos).c_str());
+
+			vv.push_back(decodeStrValue(stv, vos));
+			done = stv.find(')', epos+1);
+			vos = stv.find('(', epos+1);
+		}
+		if (std::string::npos == done)
+			throw SyntaxException(TRACE_INFO,
+				"Malformed LinkValue: %s", stv.substr(pos).c_str());
+		pos = done + 1;
+		return createLinkValue(vv);
+	}
+
+#define FV "(FloatValue"
+	if (0 == stv.compare(pos, sizeof(FV)-1, FV))
+	{
+		size_t vos = pos + sizeof(FV)-1;
+		std::vector<double> fv;
+		while (vos < totlen and stv[vos] != ')')
+		{
+			size_t epos;
+			fv.push_back(stod(stv.substr(vos), &epos));
+			vos += epos;
+		}
+		pos = vos + 1;
+		return createFloatValue(fv);
+	}
+
+#define TVL "(SimpleTruthValue "
+#define TVS "(stv "
+	size_t vos = std::string::npos;
+	if (0 == stv.compare(pos, sizeof(TVL)-1, TVL))
+		vos = pos + sizeof(TVL) - 1;
+	else
+	if (0 == stv.compare(pos, sizeof(TVS)-1, TVS))
+		vos = pos + sizeof(TVS) - 1;
+
+	if (std::string::npos != vos)
+	{
+		size_t elen;
+		double strength = stod(stv.substr(vos), &elen);
+		vos += elen;
+		double confidence = stod(stv.substr(vos), &elen);
+		vos += elen;
+		vos = stv.find(')', vos);
+		if (std::string::npos == vos)
+			throw SyntaxException(TRACE_INFO,
+				"Malformed SimpleTruthValue: %s", stv.substr(pos).c_str());
+		pos = vos + 1;
+		return ValueCast(createSimpleTruthValue(strength, confidence));
+	}
+
+#define CTV "(CountTruthValue "
+	if (0 == stv.compare(pos, sizeof(CTV)-1, CTV))
+	{
+		size_t vos = pos + sizeof(CTV) - 1;
+		size_t elen;
+		double strength = stod(stv.substr(vos), &elen);
+		vos += elen;
+		double confidence = stod(stv.substr(vos), &elen);
+		vos += elen;
+		double count = stod(stv.substr(vos), &elen);
+		vos += elen;
+		vos = stv.find(')', vos);
+		if (std::string::npos == vos)
+			throw SyntaxException(TRACE_INFO,
+				"Malformed CountTruthValue: %s", stv.substr(pos).c_str());
+		pos = vos + 1;
+		return ValueCast(createCountTruthValue(strength, confidence, count));
+	}
+
+#define SV "(StringValue"
+	if (0 == stv.compare(pos, sizeof(SV)-1, SV))
+	{
+		size_t vos = pos + sizeof(SV) - 1;
+		std::vector<std::string> sv;
+		size_t epos = stv.find(')', vos+1);
+		if (std::string::npos == epos)
+			throw SyntaxException(TRACE_INFO,
+				"Malformed StringValue: %s", stv.substr(pos).c_str());
+		while (vos < epos)
+		{
+			vos = stv.find('\"', vos);
+			if (std::string::npos == vos) break;
+			size_t evos = stv.find('\"', vos+1);
+			sv.push_back(stv.substr(vos+1, evos-vos-1));
+			vos = evos+1;
+		}
+		pos = epos + 1;
+		return createStringValue(sv);
+	}
+
+	throw SyntaxException(TRACE_INFO, "Unknown Value %s",
+		stv.substr(pos).c_str());
+}
+
+void decodeAlist(Handle& atom, std::string& alist)
+{
+	size_t pos = 1;
+	size_t totlen = alist.size();
+	pos = alist.find('(', pos);
+	while (std::string::npos != pos and pos < totlen)
+	{
+		++pos;
+		Handle key(decodeStrAtom(alist, pos));
+		pos = alist.find(" . ", pos);
+		pos += 3;
+		ValuePtr val(decodeStrValue(alist, pos));
+		atom->setValue(key, val);
+		pos = alist.find('(', pos);
+	}
+}
+
+} // namespace legacy
+
+/* ================================================================ */
+// Synthetic corpora
+
+static std::vector<std::string> make_nodes(size_t n)
+{
+	std::vector<std::string> corpus;
+	for (size_t i = 0; i < n; i++)
+		corpus.emplace_back(createNode(CONCEPT_NODE,
+			"node-" + std::to_string(i))->to_short_string());
+	return corpus;
+}
+
+static Handle make_tree(size_t depth, size_t& cnt)
+{
+	if (0 == depth)
+		return createNode(CONCEPT_NODE, "leaf-" + std::to_string(cnt++));
+	HandleSeq oset;
+	oset.push_back(make_tree(depth-1, cnt));
+	oset.push_back(make_tree(depth-1, cnt));
+	return createLink(oset, LIST_LINK);
+}
+
+static std::vector<std::string> make_links(size_t n, size_t depth)
+{
+	std::vector<std::string> corpus;
+	size_t cnt = 0;
+	for (size_t i = 0; i < n; i++)
+		corpus.emplace_back(make_tree(depth, cnt)->to_short_string());
+	return corpus;
+}
+
+static std::string value_str(const ValuePtr& v)
+{
+	// Same as DHTAtomStorage::encodeValueToStr()
+	if (nameserver().isA(v->get_type(), FLOAT_VALUE))
+		return FloatValueCast(v)->FloatValue::to_string();
+	return v->to_short_string();
+}
+
+static std::vector<std::string> make_alists(size_t n, size_t nest)
+{
+	std::vector<std::string> corpus;
+	Handle tvk(createNode(PREDICATE_NODE, "*-TruthValueKey-*"));
+	Handle fvk(createNode(PREDICATE_NODE, "float key"));
+	Handle lvk(createNode(PREDICATE_NODE, "link key"));
+	for (size_t i = 0; i < n; i++)
+	{
+		ValuePtr tv(ValueCast(createSimpleTruthValue(0.25 + i, 0.5)));
+		ValuePtr fv(createFloatValue(std::vector<double>({
+			1.0/3.0, 2.5e-8, (double) i, -7.0})));
+
+		// A LinkValue nested `nest` deep; this is the case that the
+		// old decoder handles in quadratic time.
+		ValuePtr lv(createStringValue(std::vector<std::string>({
+			"abc", "def " + std::to_string(i)})));
+		for (size_t j = 0; j < nest; j++)
+			lv = createLinkValue(std::vector<ValuePtr>({fv, lv}));
+
+		std::string alist = "(";
+		alist += "(" + tvk->to_short_string() + " . " + value_str(tv) + ")";
+		alist += "(" + fvk->to_short_string() + " . " + value_str(fv) + ")";
+		alist += "(" + lvk->to_short_string() + " . " + value_str(lv) + ")";
+		alist += ")";
+		corpus.emplace_back(alist);
+	}
+	return corpus;
+}
+
+/* ================================================================ */
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed(Clock::time_point start)
+{
+	std::chrono::duration<double> dt = Clock::now() - start;
+	return dt.count();
+}
+
+static void report(const char* name, size_t nbytes, size_t iters,
+                   double told, double tnew)
+{
+	double mb = ((double) nbytes * iters) / (1024.0 * 1024.0);
+	printf("%-14s legacy %8.2f MB/s   sexpr %8.2f MB/s   speedup %5.2fx\n",
+		name, mb / told, mb / tnew, told / tnew);
+}
+
+static size_t total_size(const std::vector<std::string>& corpus)
+{
+	size_t sz = 0;
+	for (const std::string& s : corpus) sz += s.size();
+	return sz;
+}
+
+static void bench_atoms(const char* name,
+                        const std::vector<std::string>& corpus, size_t iters)
+{
+	Clock::time_point start = Clock::now();
+	for (size_t n = 0; n < iters; n++)
+		for (const std::string& s : corpus)
+		{
+			// The legacy decoder clobbers its input.
+			std::string scm(s);
+			size_t pos = 0;
+			legacy::decodeStrAtom(scm, pos);
+		}
+	double told = elapsed(start);
+
+	start = Clock::now();
+	for (size_t n = 0; n < iters; n++)
+		for (const std::string& s : corpus)
+			SexprReader(s).read_atom();
+	double tnew = elapsed(start);
+
+	report(name, total_size(corpus), iters, told, tnew);
+}
+
+static void bench_alists(const char* name,
+                         const std::vector<std::string>& corpus, size_t iters)
+{
+	Handle h(createNode(CONCEPT_NODE, "holder"));
+
+	Clock::time_point start = Clock::now();
+	for (size_t n = 0; n < iters; n++)
+		for (const std::string& s : corpus)
+		{
+			std::string alist(s);
+			legacy::decodeAlist(h, alist);
+		}
+	double told = elapsed(start);
+
+	start = Clock::now();
+	for (size_t n = 0; n < iters; n++)
+		for (const std::string& s : corpus)
+			SexprReader(s).read_alist(h);
+	double tnew = elapsed(start);
+
+	report(name, total_size(corpus), iters, told, tnew);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t iters = 20;
+	if (1 < argc) iters = atoi(argv[1]);
+
+	bench_atoms("nodes", make_nodes(10000), iters);
+	bench_atoms("links d=3", make_links(2000, 3), iters);
+	bench_atoms("links d=6", make_links(200, 6), iters);
+	bench_alists("alist n=1", make_alists(2000, 1), iters);
+	bench_alists("alist n=8", make_alists(500, 8), iters);
+	bench_alists("alist n=32", make_alists(100, 32), iters);
+
+	return 0;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,514 @@
+/*
+ * dht-bench.cc
+ * Throughput and latency of the DHT driver, on the LargeFlatUTest and
+ * LargeZipfUTest datasets, swept over the dataset size, the number of
+ * local DHT nodes, and the number of client threads.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * Usage: dht-bench [-d flat|zipf|both] [-s sizes] [-n nodes]
+ *                  [-t threads] [-L bits] [-p port] [-l label]
+ *                  [-o file.json]
+ *
+ * The sizes, nodes, threads and bits are comma-separated lists; every
+ * combination is run. The bits are the `locality=` of the AtomSpace;
+ * zero, the default, is random placement. For the flat dataset, the size is the number of
+ * copies (seven Atoms each); for the Zipf dataset, it is the number
+ * of words, with up to nine times as many pairs. The nodes are DHT
+ * nodes in this process, on consecutive ports, bootstrapped to one
+ * another; the client talks to the first one.
+ *
+ * For each combination, this measures:
+ *  store     storeAtom() of every Atom, and then a barrier.
+ *  update    a new TruthValue on every Atom, storeAtom(), barrier.
+ *  load      loadAtomSpace() of all of it, into an empty AtomSpace.
+ *  loadType  loadType() of the ListLinks, into an empty AtomSpace.
+ *  incoming  getIncomingSet() of every Node, into an empty AtomSpace.
+ *  walk      random walks over the graph, from a sample of the Nodes,
+ *            into an empty AtomSpace. Each hop is getIncomingSet() of
+ *            where the walk is, and getLink() of one of the Links
+ *            found, picked at random; the latencies are per hop.
+ *
+ * storeAtom() only queues; the barrier is included in the total time,
+ * but not in the per-call latencies. The results are printed, and, if
+ * asked for, written as JSON, one object per combination and op.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencog/atoms/atom_types/atom_types.h>
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/base/Link.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include <opencog/persist/dht/DHTAtomStorage.h>
+#include <opencog/persist/dht/LatencyHistogram.h>
+
+using namespace opencog;
+
+/* ================================================================ */
+// The datasets. These are the same as in LargeFlatUTest and
+// LargeZipfUTest, less the bookkeeping needed for checking.
+
+static void add_flat(AtomSpace* as, int idx, const std::string& id)
+{
+	Handle h1(as->add_node(SCHEMA_NODE, id + "fromNode"));
+	h1->setTruthValue(SimpleTruthValue::createTV(0.11, 100+idx));
+	Handle h2(as->add_node(SCHEMA_NODE, id + "toNode"));
+	h2->setTruthValue(SimpleTruthValue::createTV(0.22, 200+idx));
+	Handle h3(as->add_node(SCHEMA_NODE, id + "third wheel"));
+	h3->setTruthValue(SimpleTruthValue::createTV(0.33, 300+idx));
+
+	char buf[40]; snprintf(buf, sizeof(buf), "%f", idx+0.14159265358979);
+	Handle h4(as->add_node(NUMBER_NODE, buf));
+	h4->setTruthValue(SimpleTruthValue::createTV(0.44, 400+idx));
+
+	Handle hl(as->add_link(SET_LINK, HandleSeq({h1, h2, h3, h4})));
+	Handle hl2(as->add_link(LIST_LINK, hl, h2));
+	as->add_link(EVALUATION_LINK, HandleSeq({h1, hl2, h3}));
+}
+
+static void fill_flat(AtomSpace* as, int ncopies)
+{
+	int idx = 0;
+	while (idx < ncopies)
+	{
+		std::string lbl = std::to_string(idx);
+		add_flat(as, idx++, "AA-aa-wow " + lbl);
+		add_flat(as, idx++, "BB-bb-wow " + lbl);
+		add_flat(as, idx++, "CC-cc-wow " + lbl);
+		add_flat(as, idx++, "DD-dd-wow " + lbl);
+		add_flat(as, idx++, "EE-ee-wow " + lbl);
+		add_flat(as, idx++, "Попытка выбраться вызвала слабый стон " + lbl);
+		add_flat(as, idx++, "はにがうりだそうであってるのかはち " + lbl);
+		add_flat(as, idx++, "係拉丁字母" + lbl);
+	}
+}
+
+static void fill_zipf(AtomSpace* as, int nwords)
+{
+	int npairs = 9 * nwords;
+	HandleSeq hword(nwords);
+	std::string wrd = "Word-ishy ";
+	for (int w=0; w<nwords; w++)
+	{
+		hword[w] = as->add_node(CONCEPT_NODE, wrd + std::to_string(w));
+		hword[w]->setTruthValue(CountTruthValue::createTV(1, 0,
+			((int) nwords/(w+1))));
+	}
+
+	// Half of the words are linked once, a quarter twice, an eighth
+	// four times, and so on.
+	int w1 = 0;
+	int w2 = 0;
+	int wmax = nwords;
+	int rpt = 1;
+	int again = 0;
+	int p = 0;
+	while (p<npairs)
+	{
+		Handle hp(as->add_link(LIST_LINK, hword[w1], hword[w2]));
+		hp->setTruthValue(CountTruthValue::createTV(1, 0, wmax));
+
+		w2++;
+		p++;
+		if (wmax <= w2)
+		{
+			w2=0;
+			w1++;
+			again ++;
+			if (rpt <= again)
+			{
+				again = 0;
+				rpt *= 2;
+			}
+			wmax = nwords / (double) (w1 + 1);
+			if (nwords <= w1) break;
+		}
+	}
+}
+
+/* ================================================================ */
+
+struct Result
+{
+	std::string op;
+	size_t calls;
+	size_t items;
+	double secs;
+	LatencyHistogram::Snapshot snap;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double since(const Clock::time_point& start)
+{
+	std::chrono::duration<double> dt = Clock::now() - start;
+	return dt.count();
+}
+
+/// Run `fn` on every element of `hs`, timing each call, split over
+/// `nthreads` threads.
+template<typename FN>
+static double timed_walk(const HandleSeq& hs, size_t nthreads,
+                         LatencyHistogram& hist, FN fn)
+{
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < nthreads; t++)
+		pool.emplace_back([&hs, &hist, &fn, t, nthreads]()
+		{
+			for (size_t i = t; i < hs.size(); i += nthreads)
+			{
+				Clock::time_point cstart = Clock::now();
+				fn(hs[i]);
+				hist.record(Clock::now() - cstart);
+			}
+		});
+	for (std::thread& t : pool) t.join();
+	return since(start);
+}
+
+static Result run_store(DHTAtomStorage* store, const HandleSeq& atoms,
+                        size_t nthreads)
+{
+	LatencyHistogram hist;
+	Clock::time_point start = Clock::now();
+	timed_walk(atoms, nthreads, hist,
+		[store](const Handle& h) { store->storeAtom(h); });
+	store->barrier();
+	return Result{"store", atoms.size(), atoms.size(), since(start),
+		hist.snapshot()};
+}
+
+static Result run_update(DHTAtomStorage* store, const HandleSeq& atoms,
+                         size_t nthreads)
+{
+	LatencyHistogram hist;
+	Clock::time_point start = Clock::now();
+	timed_walk(atoms, nthreads, hist,
+		[store](const Handle& h)
+		{
+			h->setTruthValue(SimpleTruthValue::createTV(0.5, 0.5));
+			store->storeAtom(h);
+		});
+	store->barrier();
+	return Result{"update", atoms.size(), atoms.size(), since(start),
+		hist.snapshot()};
+}
+
+static Result run_load(DHTAtomStorage* store)
+{
+	AtomSpace as;
+	store->registerWith(&as);
+	LatencyHistogram hist;
+	Clock::time_point start = Clock::now();
+	store->loadAtomSpace(as.get_atomtable());
+	hist.record(Clock::now() - start);
+	double secs = since(start);
+	store->unregisterWith(&as);
+	return Result{"load", 1, as.get_size(), secs, hist.snapshot()};
+}
+
+static Result run_load_type(DHTAtomStorage* store)
+{
+	AtomSpace as;
+	store->registerWith(&as);
+	LatencyHistogram hist;
+	Clock::time_point start = Clock::now();
+	store->loadType(as.get_atomtable(), LIST_LINK);
+	hist.record(Clock::now() - start);
+	double secs = since(start);
+	store->unregisterWith(&as);
+	return Result{"loadType", 1, as.get_size(), secs, hist.snapshot()};
+}
+
+static Result run_incoming(DHTAtomStorage* store, const HandleSeq& nodes,
+                           size_t nthreads)
+{
+	AtomSpace as;
+	store->registerWith(&as);
+	LatencyHistogram hist;
+	AtomTable& table = as.get_atomtable();
+	double secs = timed_walk(nodes, nthreads, hist,
+		[store, &table](const Handle& h)
+		{ store->getIncomingSet(table, h); });
+	store->unregisterWith(&as);
+	return Result{"incoming", nodes.size(), as.get_size(), secs,
+		hist.snapshot()};
+}
+
+// How many walks, and how long each one is.
+#define WALK_STARTS 200
+#define WALK_HOPS 8
+
+/// Random walks; the next Atom is picked from the source AtomSpace,
+/// which already has the whole graph, and so the DHT is asked for
+/// just what the walk needs.
+static Result run_graph_walk(DHTAtomStorage* store, const HandleSeq& nodes,
+                             size_t nthreads)
+{
+	AtomSpace as;
+	store->registerWith(&as);
+	AtomTable& table = as.get_atomtable();
+
+	std::mt19937 rng(42);
+	HandleSeq starts(nodes);
+	std::shuffle(starts.begin(), starts.end(), rng);
+	if (WALK_STARTS < starts.size()) starts.resize(WALK_STARTS);
+
+	LatencyHistogram hist;
+	LatencyHistogram walks;
+	std::atomic<size_t> hops(0);
+	double secs = timed_walk(starts, nthreads, walks,
+		[store, &table, &hist, &hops](const Handle& start)
+		{
+			std::mt19937 wrng(start->get_hash());
+			Handle here(start);
+			for (size_t i = 0; i < WALK_HOPS; i++)
+			{
+				IncomingSet iset(here->getIncomingSet());
+				if (0 == iset.size()) break;
+				Handle link(iset[wrng() % iset.size()]);
+
+				Clock::time_point hstart = Clock::now();
+				store->getIncomingSet(table, here);
+				store->getLink(link->get_type(), link->getOutgoingSet());
+				hist.record(Clock::now() - hstart);
+				hops++;
+
+				// Onwards, to another Atom in the Link, or up.
+				const HandleSeq& oset = link->getOutgoingSet();
+				here = (0 == wrng() % 4) ? link : oset[wrng() % oset.size()];
+			}
+		});
+	store->unregisterWith(&as);
+	return Result{"walk", starts.size(), hops.load(), secs, hist.snapshot()};
+}
+
+/* ================================================================ */
+
+struct Options
+{
+	std::vector<std::string> datasets;
+	std::vector<size_t> sizes;
+	std::vector<size_t> nodes;
+	std::vector<size_t> threads;
+	std::vector<size_t> localities;
+	int port;
+	std::string label;
+	std::string outfile;
+};
+
+static std::vector<size_t> parse_list(const char* arg, bool zero_ok = false)
+{
+	std::vector<size_t> vals;
+	const char* p = arg;
+	while (*p)
+	{
+		char* end;
+		size_t v = strtoul(p, &end, 10);
+		if (end == p or (0 == v and not zero_ok))
+		{
+			fprintf(stderr, "Bad list: %s\n", arg);
+			exit(1);
+		}
+		vals.push_back(v);
+		p = end;
+		if (',' == *p) p++;
+	}
+	return vals;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-d flat|zipf|both] [-s sizes] [-n nodes]\n"
+		"\t[-t threads] [-L bits] [-p port] [-l label] [-o file.json]\n",
+		prog);
+	exit(1);
+}
+
+static FILE* _json = nullptr;
+static bool _first = true;
+
+static void report(const std::string& dataset,
+                   size_t size, size_t natoms, size_t nnodes,
+                   size_t nthreads, size_t bits, const Result& r)
+{
+	double rate = (0.0 < r.secs) ? r.items / r.secs : 0.0;
+	double p50 = r.snap.percentile(0.5) / 1000.0;
+	double p99 = r.snap.percentile(0.99) / 1000.0;
+	double max = r.snap.max_us / 1000.0;
+
+	printf("%-4s size=%-7zu nodes=%-2zu threads=%-2zu bits=%-2zu %-8s "
+	       "%8zu items in %7.2f secs = %9.1f/sec  "
+	       "p50 = %.3f p99 = %.3f max = %.3f msecs\n",
+	       dataset.c_str(), size, nnodes, nthreads, bits, r.op.c_str(),
+	       r.items, r.secs, rate, p50, p99, max);
+	fflush(stdout);
+
+	if (nullptr == _json) return;
+	fprintf(_json, "%s\n    {\"dataset\": \"%s\", \"size\": %zu, "
+	        "\"atoms\": %zu, \"nodes\": %zu, \"threads\": %zu, "
+	        "\"locality\": %zu, "
+	        "\"op\": \"%s\", \"calls\": %zu, \"items\": %zu, "
+	        "\"secs\": %.6f, \"items_per_sec\": %.3f, "
+	        "\"p50_ms\": %.6f, \"p99_ms\": %.6f, \"max_ms\": %.6f}",
+	        _first ? "" : ",", dataset.c_str(), size, natoms, nnodes,
+	        nthreads, bits, r.op.c_str(), r.calls, r.items, r.secs, rate,
+	        p50, p99, max);
+	_first = false;
+}
+
+/// Start `nnodes` DHT nodes; the first is the one that the clients
+/// bootstrap to.
+static std::vector<DHTAtomStorage*> start_nodes(int port, size_t nnodes)
+{
+	std::vector<DHTAtomStorage*> nodes;
+	for (size_t i = 0; i < nnodes; i++)
+	{
+		DHTAtomStorage* node = new DHTAtomStorage(
+			"dht://:" + std::to_string(port + i) + "/");
+		if (not node->connected())
+		{
+			fprintf(stderr, "Cannot start a DHT node on port %d\n",
+				(int) (port + i));
+			exit(1);
+		}
+		if (0 < i)
+			node->dht_bootstrap("dht://localhost:" + std::to_string(port) + "/");
+		nodes.push_back(node);
+	}
+	return nodes;
+}
+
+static void run_one(const Options& opts, const std::string& dataset,
+                    size_t size, size_t nnodes, size_t nthreads,
+                    size_t bits, size_t& run)
+{
+	AtomSpace src;
+	if (dataset == "flat")
+		fill_flat(&src, size);
+	else
+		fill_zipf(&src, size);
+
+	HandleSeq atoms;
+	HandleSeq nodes;
+	src.get_atomtable().foreachHandleByType(
+		[&atoms, &nodes](const Handle& h)
+		{
+			atoms.push_back(h);
+			if (h->is_node()) nodes.push_back(h);
+		}, ATOM, true);
+
+	// A fresh AtomSpace name for each run, so that runs do not see
+	// one another's data.
+	int port = opts.port;
+	std::vector<DHTAtomStorage*> peers(start_nodes(port, nnodes));
+	DHTAtomStorage* store = new DHTAtomStorage("dht:///dht-bench-"
+		+ std::to_string(getpid()) + "-" + std::to_string(run++)
+		+ "?locality=" + std::to_string(bits));
+	store->dht_bootstrap("dht://localhost:" + std::to_string(port) + "/");
+
+	// Give the routing tables a moment to fill in.
+	std::this_thread::sleep_for(std::chrono::seconds(nnodes));
+
+	store->registerWith(&src);
+	std::vector<Result> results;
+	results.push_back(run_store(store, atoms, nthreads));
+	results.push_back(run_update(store, atoms, nthreads));
+	store->unregisterWith(&src);
+
+	results.push_back(run_load(store));
+	results.push_back(run_load_type(store));
+	results.push_back(run_incoming(store, nodes, nthreads));
+	results.push_back(run_graph_walk(store, nodes, nthreads));
+
+	for (const Result& r : results)
+		report(dataset, size, atoms.size(), nnodes, nthreads, bits, r);
+
+	delete store;
+	for (DHTAtomStorage* peer : peers) delete peer;
+}
+
+int main(int argc, char* argv[])
+{
+	Options opts;
+	opts.sizes = {1000};
+	opts.nodes = {1, 4};
+	opts.threads = {1, 4, 16};
+	opts.localities = {0};
+	opts.port = 4600;
+	std::string datasets = "both";
+
+	int c;
+	while (-1 != (c = getopt(argc, argv, "d:s:n:t:L:p:l:o:h")))
+	{
+		switch (c)
+		{
+			case 'd': datasets = optarg; break;
+			case 's': opts.sizes = parse_list(optarg); break;
+			case 'n': opts.nodes = parse_list(optarg); break;
+			case 't': opts.threads = parse_list(optarg); break;
+			case 'L': opts.localities = parse_list(optarg, true); break;
+			case 'p': opts.port = atoi(optarg); break;
+			case 'l': opts.label = optarg; break;
+			case 'o': opts.outfile = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (datasets == "flat" or datasets == "both")
+		opts.datasets.push_back("flat");
+	if (datasets == "zipf" or datasets == "both")
+		opts.datasets.push_back("zipf");
+	if (0 == opts.datasets.size()) usage(argv[0]);
+
+	if (0 < opts.outfile.size())
+	{
+		_json = fopen(opts.outfile.c_str(), "w");
+		if (nullptr == _json)
+		{
+			perror(opts.outfile.c_str());
+			exit(1);
+		}
+		char buf[40];
+		time_t now = time(nullptr);
+		strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&now));
+		fprintf(_json, "{\n  \"label\": \"%s\",\n  \"started\": \"%s\",\n"
+			"  \"results\": [", opts.label.c_str(), buf);
+	}
+
+	size_t run = 0;
+	for (const std::string& dataset : opts.datasets)
+		for (size_t size : opts.sizes)
+			for (size_t nnodes : opts.nodes)
+				for (size_t nthreads : opts.threads)
+					for (size_t bits : opts.localities)
+						run_one(opts, dataset, size, nnodes, nthreads,
+						        bits, run);
+
+	if (_json)
+	{
+		fprintf(_json, "\n  ]\n}\n");
+		fclose(_json);
+	}
+	return 0;
+}
+
+/* ============================= END OF FILE ================= */
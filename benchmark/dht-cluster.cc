@@ -0,0 +1,444 @@
+/*
+ * dht-cluster.cc
+ * Start a cluster of DHT nodes, one per process, and measure how a
+ * read/write mix scales with the number of nodes.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * Usage: dht-cluster [-k nodes] [-p port] [-c clients] [-a atoms]
+ *                    [-n ops] [-w write-fraction] [-e prefix]
+ *                    [-H host] [-S] [-l label] [-o file.json]
+ *        dht-cluster -N port [-B host:port]
+ *
+ * For each number of nodes K in the comma-separated list (default
+ * 1,2,4,8,16), this starts K node processes, on consecutive ports,
+ * each bootstrapped to the first. It then runs `clients` clients in
+ * this process, each on its own thread and its own DHTAtomStorage,
+ * bootstrapped to a different node. The first client stores `atoms`
+ * ConceptNodes; then each client does `ops` operations on randomly
+ * chosen ones, the fraction `write-fraction` being a new TruthValue
+ * and a synchronous storeAtom(), the rest being getNode().
+ *
+ * The node processes are started with `sh -c`; if a prefix is given,
+ * it is put in front of the command, with %d replaced by the node
+ * number. Thus, for example,
+ *
+ *    dht-cluster -k 4 -e "ip netns exec dht%d" -H 10.0.0.1
+ *
+ * puts each node in its own network namespace, bootstrapping to the
+ * first at 10.0.0.1. (Setting up the namespaces is up to you.)
+ *
+ * With -S, the nodes are started, and left running until interrupted;
+ * this is what `examples/dht-cluster.scm` expects. With -N, this is
+ * one node, on the given port; the harness runs itself this way.
+ *
+ * OpenDHT does not report the hops a lookup took. Reported instead is
+ * the depth of the clients' routing tables, which a lookup descends
+ * about one level per hop, along with the number of good nodes in them.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencog/atoms/atom_types/atom_types.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include <opencog/persist/dht/DHTAtomStorage.h>
+#include <opencog/persist/dht/LatencyHistogram.h>
+
+using namespace opencog;
+
+/* ================================================================ */
+// One node.
+
+static std::atomic<bool> _stop(false);
+
+static void stop_node(int) { _stop = true; }
+
+static int run_node(int port, const std::string& boot)
+{
+	signal(SIGTERM, stop_node);
+	signal(SIGINT, stop_node);
+
+	DHTAtomStorage* node = new DHTAtomStorage(
+		"dht://:" + std::to_string(port) + "/");
+	if (not node->connected())
+	{
+		fprintf(stderr, "Cannot start a DHT node on port %d\n", port);
+		return 1;
+	}
+	if (0 < boot.size())
+		node->dht_bootstrap("dht://" + boot + "/");
+
+	while (not _stop)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	delete node;
+	return 0;
+}
+
+/* ================================================================ */
+// The cluster.
+
+struct Options
+{
+	std::vector<size_t> nodes;
+	int port;
+	size_t clients;
+	size_t atoms;
+	size_t ops;
+	double write_fraction;
+	std::string prefix;
+	std::string host;
+	bool serve;
+	std::string label;
+	std::string outfile;
+};
+
+static std::string self_path(void)
+{
+	char buf[4096];
+	ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+	if (len <= 0)
+	{
+		perror("readlink");
+		exit(1);
+	}
+	buf[len] = 0;
+	return buf;
+}
+
+/// Replace the first %d in the prefix by the node number.
+static std::string node_prefix(const std::string& prefix, size_t i)
+{
+	std::string pfx(prefix);
+	size_t pos = pfx.find("%d");
+	if (std::string::npos != pos)
+		pfx.replace(pos, 2, std::to_string(i));
+	return pfx;
+}
+
+static std::vector<pid_t> start_nodes(const Options& opts, size_t nnodes)
+{
+	std::string self(self_path());
+	std::string boot = opts.host + ":" + std::to_string(opts.port);
+
+	std::vector<pid_t> pids;
+	for (size_t i = 0; i < nnodes; i++)
+	{
+		std::string cmd = node_prefix(opts.prefix, i) + " " + self
+			+ " -N " + std::to_string(opts.port + i);
+		if (0 < i) cmd += " -B " + boot;
+
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork");
+			exit(1);
+		}
+		if (0 == pid)
+		{
+			// The shell execs the last command, so that the signal
+			// goes to the node, and not just to the shell.
+			execl("/bin/sh", "sh", "-c", ("exec " + cmd).c_str(),
+				(char*) nullptr);
+			_exit(127);
+		}
+		pids.push_back(pid);
+	}
+
+	// Give the nodes time to start, and to find one another.
+	std::this_thread::sleep_for(std::chrono::seconds(1 + nnodes / 4));
+	return pids;
+}
+
+static void stop_nodes(const std::vector<pid_t>& pids)
+{
+	for (pid_t pid : pids) kill(pid, SIGTERM);
+	for (pid_t pid : pids) waitpid(pid, nullptr, 0);
+}
+
+/* ================================================================ */
+// The clients.
+
+typedef std::chrono::steady_clock Clock;
+
+struct Client
+{
+	AtomSpace as;
+	DHTAtomStorage* store;
+	LatencyHistogram reads;
+	LatencyHistogram writes;
+	DHTAtomStorage::Gauges gauges;
+};
+
+static std::string atom_name(size_t i)
+{
+	return "cluster-atom-" + std::to_string(i);
+}
+
+static void run_mix(const Options& opts, Client* cl, unsigned int seed)
+{
+	for (size_t n = 0; n < opts.ops; n++)
+	{
+		size_t i = rand_r(&seed) % opts.atoms;
+		bool write = (rand_r(&seed) / (double) RAND_MAX) < opts.write_fraction;
+
+		Clock::time_point start = Clock::now();
+		if (write)
+		{
+			Handle h(cl->as.add_node(CONCEPT_NODE, atom_name(i)));
+			h->setTruthValue(CountTruthValue::createTV(1, 0, n));
+			cl->store->storeAtom(h, true);
+			cl->writes.record(Clock::now() - start);
+		}
+		else
+		{
+			cl->store->getNode(CONCEPT_NODE, atom_name(i).c_str());
+			cl->reads.record(Clock::now() - start);
+		}
+	}
+}
+
+static FILE* _json = nullptr;
+static bool _first = true;
+
+static void report(const Options& opts, size_t nnodes, double secs,
+                   const std::vector<Client*>& clients)
+{
+	LatencyHistogram::Snapshot rd;
+	LatencyHistogram::Snapshot wr;
+	double depth = 0.0;
+	double good = 0.0;
+	for (Client* cl : clients)
+	{
+		LatencyHistogram::Snapshot r(cl->reads.snapshot());
+		LatencyHistogram::Snapshot w(cl->writes.snapshot());
+		if (0 == rd.buckets.size())
+		{
+			rd = r;
+			wr = w;
+		}
+		else
+		{
+			for (size_t b = 0; b < rd.buckets.size(); b++)
+			{
+				rd.buckets[b] += r.buckets[b];
+				wr.buckets[b] += w.buckets[b];
+			}
+			rd.count += r.count; rd.sum_us += r.sum_us;
+			wr.count += w.count; wr.sum_us += w.sum_us;
+			if (rd.max_us < r.max_us) rd.max_us = r.max_us;
+			if (wr.max_us < w.max_us) wr.max_us = w.max_us;
+		}
+		depth += cl->gauges.table_depth;
+		good += cl->gauges.nodes_good;
+	}
+	depth /= clients.size();
+	good /= clients.size();
+
+	size_t nops = rd.count + wr.count;
+	double rate = (0.0 < secs) ? nops / secs : 0.0;
+	printf("nodes=%-3zu clients=%-3zu %8zu ops in %7.2f secs = %8.1f/sec  "
+	       "read p50 = %.3f p99 = %.3f  write p50 = %.3f p99 = %.3f msecs  "
+	       "table depth = %.1f good nodes = %.1f\n",
+	       nnodes, clients.size(), nops, secs, rate,
+	       rd.percentile(0.5) / 1000.0, rd.percentile(0.99) / 1000.0,
+	       wr.percentile(0.5) / 1000.0, wr.percentile(0.99) / 1000.0,
+	       depth, good);
+	fflush(stdout);
+
+	if (nullptr == _json) return;
+	fprintf(_json, "%s\n    {\"nodes\": %zu, \"clients\": %zu, "
+	        "\"atoms\": %zu, \"write_fraction\": %.3f, "
+	        "\"reads\": %zu, \"writes\": %zu, \"secs\": %.6f, "
+	        "\"ops_per_sec\": %.3f, "
+	        "\"read_p50_ms\": %.6f, \"read_p99_ms\": %.6f, "
+	        "\"write_p50_ms\": %.6f, \"write_p99_ms\": %.6f, "
+	        "\"table_depth\": %.3f, \"nodes_good\": %.3f}",
+	        _first ? "" : ",", nnodes, clients.size(), opts.atoms,
+	        opts.write_fraction, (size_t) rd.count, (size_t) wr.count,
+	        secs, rate,
+	        rd.percentile(0.5) / 1000.0, rd.percentile(0.99) / 1000.0,
+	        wr.percentile(0.5) / 1000.0, wr.percentile(0.99) / 1000.0,
+	        depth, good);
+	_first = false;
+}
+
+static void run_cluster(const Options& opts, size_t nnodes)
+{
+	std::vector<pid_t> pids(start_nodes(opts, nnodes));
+
+	std::string uri = "dht:///dht-cluster-" + std::to_string(getpid())
+		+ "-" + std::to_string(nnodes);
+	std::vector<Client*> clients;
+	for (size_t c = 0; c < opts.clients; c++)
+	{
+		Client* cl = new Client;
+		cl->store = new DHTAtomStorage(uri);
+		cl->store->dht_bootstrap("dht://" + opts.host + ":"
+			+ std::to_string(opts.port + c % nnodes) + "/");
+		cl->store->registerWith(&cl->as);
+		clients.push_back(cl);
+	}
+
+	// The first client writes everything, so that reads find it.
+	Client* seeder = clients[0];
+	for (size_t i = 0; i < opts.atoms; i++)
+	{
+		Handle h(seeder->as.add_node(CONCEPT_NODE, atom_name(i)));
+		h->setTruthValue(CountTruthValue::createTV(1, 0, i));
+		seeder->store->storeAtom(h);
+	}
+	seeder->store->barrier();
+
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> pool;
+	for (size_t c = 0; c < clients.size(); c++)
+		pool.emplace_back(run_mix, std::cref(opts), clients[c], c + 1);
+	for (std::thread& t : pool) t.join();
+	std::chrono::duration<double> secs = Clock::now() - start;
+
+	for (Client* cl : clients)
+		cl->gauges = cl->store->get_gauges();
+	report(opts, nnodes, secs.count(), clients);
+
+	for (Client* cl : clients)
+	{
+		cl->store->unregisterWith(&cl->as);
+		delete cl->store;
+		delete cl;
+	}
+	stop_nodes(pids);
+}
+
+/* ================================================================ */
+
+static std::vector<size_t> parse_list(const char* arg)
+{
+	std::vector<size_t> vals;
+	const char* p = arg;
+	while (*p)
+	{
+		char* end;
+		size_t v = strtoul(p, &end, 10);
+		if (end == p or 0 == v)
+		{
+			fprintf(stderr, "Bad list: %s\n", arg);
+			exit(1);
+		}
+		vals.push_back(v);
+		p = end;
+		if (',' == *p) p++;
+	}
+	return vals;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-k nodes] [-p port] [-c clients] [-a atoms]\n"
+		"\t[-n ops] [-w write-fraction] [-e prefix] [-H host] [-S]\n"
+		"\t[-l label] [-o file.json]\n"
+		"       %s -N port [-B host:port]\n", prog, prog);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	Options opts;
+	opts.nodes = {1, 2, 4, 8, 16};
+	opts.port = 4700;
+	opts.clients = 4;
+	opts.atoms = 1000;
+	opts.ops = 2000;
+	opts.write_fraction = 0.2;
+	opts.host = "localhost";
+	opts.serve = false;
+
+	int node_port = 0;
+	std::string boot;
+
+	int c;
+	while (-1 != (c = getopt(argc, argv, "k:p:c:a:n:w:e:H:Sl:o:N:B:h")))
+	{
+		switch (c)
+		{
+			case 'k': opts.nodes = parse_list(optarg); break;
+			case 'p': opts.port = atoi(optarg); break;
+			case 'c': opts.clients = atoi(optarg); break;
+			case 'a': opts.atoms = atoi(optarg); break;
+			case 'n': opts.ops = atoi(optarg); break;
+			case 'w': opts.write_fraction = atof(optarg); break;
+			case 'e': opts.prefix = optarg; break;
+			case 'H': opts.host = optarg; break;
+			case 'S': opts.serve = true; break;
+			case 'l': opts.label = optarg; break;
+			case 'o': opts.outfile = optarg; break;
+			case 'N': node_port = atoi(optarg); break;
+			case 'B': boot = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (0 < node_port) return run_node(node_port, boot);
+	if (0 == opts.clients or 0 == opts.atoms) usage(argv[0]);
+
+	if (opts.serve)
+	{
+		size_t nnodes = opts.nodes.back();
+		std::vector<pid_t> pids(start_nodes(opts, nnodes));
+		printf("Started %zu nodes on ports %d to %d; bootstrap with "
+		       "dht://%s:%d/\n", nnodes, opts.port,
+		       (int) (opts.port + nnodes - 1), opts.host.c_str(), opts.port);
+		fflush(stdout);
+
+		signal(SIGTERM, stop_node);
+		signal(SIGINT, stop_node);
+		while (not _stop)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		stop_nodes(pids);
+		return 0;
+	}
+
+	if (0 < opts.outfile.size())
+	{
+		_json = fopen(opts.outfile.c_str(), "w");
+		if (nullptr == _json)
+		{
+			perror(opts.outfile.c_str());
+			exit(1);
+		}
+		char buf[40];
+		time_t now = time(nullptr);
+		strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&now));
+		fprintf(_json, "{\n  \"label\": \"%s\",\n  \"started\": \"%s\",\n"
+			"  \"results\": [", opts.label.c_str(), buf);
+	}
+
+	for (size_t nnodes : opts.nodes)
+		run_cluster(opts, nnodes);
+
+	if (_json)
+	{
+		fprintf(_json, "\n  ]\n}\n");
+		fclose(_json);
+	}
+	return 0;
+}
+
+/* ============================= END OF FILE ================= */
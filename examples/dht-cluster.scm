@@ -0,0 +1,72 @@
+;
+; dht-cluster.scm
+;
+; Run a read/write mix against a cluster of DHT nodes.
+;
+; First, start the cluster. The `dht-cluster` program is in the
+; `benchmark` directory; build it with `make benchmarks`. At a bash
+; prompt, say
+;
+;     $ dht-cluster -S -k 8 -p 4700
+;
+; This starts eight DHT nodes, each in its own process, on ports 4700
+; to 4707, all bootstrapped to the first. They keep running until
+; interrupted with ctrl-C. Without the -S, `dht-cluster` runs its own
+; mix, for one, two, four ... nodes; see the comments at the top of
+; `dht-cluster.cc`.
+;
+; Then, in one or more guile shells, run the mix below. Each shell is
+; one client; give each a different node to bootstrap to, to spread
+; the load.
+;
+(use-modules (srfi srfi-1))
+(use-modules (opencog))
+(use-modules (opencog persist))
+(use-modules (opencog persist-dht))
+
+(dht-open "dht:///cluster-atomspace")
+(dht-bootstrap "dht://localhost:4700/")
+
+; --------------------------------------------------------------------
+; The mix: NOPS operations on NATOMS ConceptNodes, the fraction WFRAC
+; of them being a store of a new TruthValue, the rest being a fetch.
+; Returns the number of operations per second.
+
+(define (cluster-atom i) (Concept (format #f "cluster-atom-~A" i)))
+
+(define (dht-cluster-seed NATOMS)
+	(for-each
+		(lambda (i)
+			(cog-set-tv! (cluster-atom i) (CountTruthValue 1 0 i))
+			(store-atom (cluster-atom i)))
+		(iota NATOMS))
+	(barrier))
+
+(define (dht-cluster-mix NATOMS NOPS WFRAC)
+	(define start (get-internal-real-time))
+	(for-each
+		(lambda (n)
+			(define atom (cluster-atom (random NATOMS)))
+			(if (< (random 1.0) WFRAC)
+				(begin
+					(cog-set-tv! atom (CountTruthValue 1 0 n))
+					(store-atom atom)
+					(barrier))
+				(fetch-atom atom)))
+		(iota NOPS))
+	(/ (* 1.0 NOPS internal-time-units-per-second)
+		(- (get-internal-real-time) start)))
+
+; Seed the AtomSpace, just once, from any one of the clients.
+(dht-cluster-seed 1000)
+
+; Run the mix, and show how fast it went.
+(format #t "Operations per second: ~A\n" (dht-cluster-mix 1000 2000 0.2))
+
+; The latency histograms, and the routing table of this client. The
+; routing table depth (`table-depth`, under `gauges`) is about the
+; number of hops that a lookup takes.
+(display (dht-metrics))
+(newline)
+
+(dht-close)
@@ -0,0 +1,154 @@
+/*
+ * FILE:
+ * opencog/persist/dht/BloomFilter.h
+
+ * FUNCTION:
+ * Bloom filters over DHT keys, for the membership summaries.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_BLOOM_FILTER_H
+#define _OPENCOG_BLOOM_FILTER_H
+
+#include <math.h>
+#include <string.h>
+
+#include <cstdint>
+#include <vector>
+
+#include <opendht.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A plain Bloom filter, over 160-bit DHT keys. The keys are already
+/// uniformly random, and so the bit positions are taken from the key
+/// itself, by double hashing, without hashing it again. Filters with
+/// the same geometry (number of bits and of hashes) can be merged by
+/// OR'ing them; this is commutative and idempotent, so the filter in
+/// the DHT is a grow-only set, that any number of writers can add to.
+///
+/// This is not thread-safe; the caller must lock.
+class BloomFilter
+{
+	public:
+		enum
+		{
+			MIN_BITS = 1024,
+			MAX_BITS = 256 * 1024, // 32 KBytes; OpenDHT allows 64
+			MAX_HASHES = 16,
+		};
+
+		BloomFilter(void) : _nhashes(0) {}
+		BloomFilter(size_t nbits, size_t nhashes) :
+			_bits((nbits + 7) / 8, 0), _nhashes(nhashes) {}
+		BloomFilter(std::vector<uint8_t>&& bits, size_t nhashes) :
+			_bits(std::move(bits)), _nhashes(nhashes) {}
+
+		/// The number of hashes that gives the false-positive rate,
+		/// once the filter is as full as it should be.
+		static size_t hashes_for(double fpr)
+		{
+			size_t k = (size_t) ceil(-log2(fpr));
+			if (k < 1) k = 1;
+			if (MAX_HASHES < k) k = MAX_HASHES;
+			return k;
+		}
+
+		/// The number of bits needed to hold `n` keys, at the given
+		/// false-positive rate; a multiple of 64.
+		static size_t bits_for(size_t n, double fpr)
+		{
+			double m = - (double) n * log(fpr) / (M_LN2 * M_LN2);
+			size_t nbits = 64 * (size_t) ceil(m / 64.0);
+			if (nbits < MIN_BITS) nbits = MIN_BITS;
+			if (MAX_BITS < nbits) nbits = MAX_BITS;
+			return nbits;
+		}
+
+		size_t nbits(void) const { return 8 * _bits.size(); }
+		size_t nhashes(void) const { return _nhashes; }
+		bool empty(void) const { return 0 == _nhashes; }
+		const std::vector<uint8_t>& bits(void) const { return _bits; }
+
+		bool same_geometry(const BloomFilter& other) const
+		{
+			return _nhashes == other._nhashes and
+				_bits.size() == other._bits.size();
+		}
+
+		void add(const dht::InfoHash& key)
+		{
+			uint64_t h1, h2;
+			split(key, h1, h2);
+			size_t m = nbits();
+			for (size_t i = 0; i < _nhashes; i++)
+			{
+				size_t bit = (h1 + i * h2) % m;
+				_bits[bit / 8] |= 1 << (bit % 8);
+			}
+		}
+
+		/// False means that the key was never added. True means that
+		/// it probably was. An empty filter knows nothing, and so
+		/// says true.
+		bool maybe_contains(const dht::InfoHash& key) const
+		{
+			if (empty()) return true;
+			uint64_t h1, h2;
+			split(key, h1, h2);
+			size_t m = nbits();
+			for (size_t i = 0; i < _nhashes; i++)
+			{
+				size_t bit = (h1 + i * h2) % m;
+				if (0 == (_bits[bit / 8] & (1 << (bit % 8)))) return false;
+			}
+			return true;
+		}
+
+		/// Add everything in the other filter to this one. Returns
+		/// false, and does nothing, if they are not alike.
+		bool merge(const BloomFilter& other)
+		{
+			if (not same_geometry(other)) return false;
+			for (size_t i = 0; i < _bits.size(); i++)
+				_bits[i] |= other._bits[i];
+			return true;
+		}
+
+		/// The fraction of the bits that are set. The false-positive
+		/// rate is about this, to the power of the number of hashes.
+		double fill(void) const
+		{
+			if (_bits.empty()) return 0.0;
+			size_t set = 0;
+			for (uint8_t byte : _bits) set += __builtin_popcount(byte);
+			return ((double) set) / nbits();
+		}
+
+	private:
+		std::vector<uint8_t> _bits;
+		size_t _nhashes;
+
+		// The second hash must be odd, so that it is never zero, and
+		// so that, for power-of-two sizes, it visits every bit.
+		static void split(const dht::InfoHash& key, uint64_t& h1, uint64_t& h2)
+		{
+			memcpy(&h1, key.data(), sizeof(h1));
+			memcpy(&h2, key.data() + sizeof(h1), sizeof(h2));
+			h2 |= 1;
+		}
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_BLOOM_FILTER_H
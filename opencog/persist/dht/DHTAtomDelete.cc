@@ -30,24 +30,19 @@ void DHTAtomStorage::removeAtom(const Handle& atom, bool recursive)
 	barrier();
 
 	// First, check to see if there's an incoming set, or not.
-	dht::InfoHash mhash = get_membership(atom);
-	auto dinset = get_stuff(mhash, _incoming_filter);
-
-	// Fail if not recursive and have a non-trivial incoming set.
 	// Note that this is racey: the incoming set can change,
 	// even as we are checking it. Right now, this is not
 	// controlled, and might maybe lead to inconsistent state.
-	for (const auto& dinc : dinset)
+	std::vector<dht::InfoHash> inguids(get_incoming_guids(atom));
+	if (0 < inguids.size())
 	{
-		dht::InfoHash inhash = dinc->unpack<dht::InfoHash>();
-		if (inhash == zerohash) continue;
-
-		// Fail if not recursive.
+		// Fail if not recursive and have a non-trivial incoming set.
 		if (not recursive) return;
 
-		// We're recursive; so recurse.
-		Handle hin(fetch_atom(inhash));
-		removeAtom(hin, true);
+		// We're recursive; so recurse. All of the holders are
+		// fetched at once.
+		for (const Handle& hin : fetch_atoms(inguids))
+			removeAtom(hin, true);
 	}
 
 	// Remove this atom from the incoming sets of those that
@@ -57,8 +52,7 @@ void DHTAtomStorage::removeAtom(const Handle& atom, bool recursive)
 		for (const Handle& held: atom->getOutgoingSet())
 		{
 			dht::InfoHash memuid = get_membership(held);
-			_runner.put(memuid,
-				dht::Value(_incoming_policy, zerohash, atom->get_hash()));
+			queue_put(memuid, incoming_value(zerohash, atom));
 		}
 	}
 
@@ -68,26 +62,34 @@ void DHTAtomStorage::removeAtom(const Handle& atom, bool recursive)
 	// small chance that two different Atoms will collide. In this
 	// case, we want to broadcast the string, to disambiguate
 	// which one is to be removed.
+	//
+	// The drop goes to the shard that holds the add. It is also sent
+	// to the AtomSpace key itself, in case the Atom was added before
+	// the membership was sharded.
 	std::string gstr = "drop " + std::to_string(now())
 		+ " " + encodeAtomToStr(atom);
-	_runner.put(_atomspace_hash,
-	            dht::Value(_space_policy, gstr, atom->get_hash()));
+	dht::Value dval(_space_policy, gstr, atom->get_hash());
+	dht::InfoHash shard = get_shard(atom);
+	touch_key(shard, true);
+	queue_put(shard, dht::Value(dval));
+	if (_type_index)
+	{
+		dht::InfoHash tshard = get_type_shard(atom);
+		touch_key(tshard, true);
+		queue_put(tshard, dht::Value(dval));
+	}
+	queue_put(_atomspace_hash, std::move(dval));
 
 	// Trash the values, too
 	delete_atom_values(atom);
 
 	// Update the index, so that if the Atom is recreated later,
 	// it appears to be brand-new.
-	{
-		std::unique_lock<std::mutex> lck(_publish_mutex);
-		_published.erase(atom);
-	}
+	_published.erase(atom);
+	_values_state.erase(atom);
 
 	// Drop the atom from out caches
-	{
-		std::lock_guard<std::mutex> lck(_membership_mutex);
-		_membership_map.erase(atom);
-	}
+	_membership_map.erase(atom);
 
 	// Bug with stats: should not increment on recursion.
 	_num_atom_deletes++;
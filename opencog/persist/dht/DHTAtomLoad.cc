@@ -16,6 +16,7 @@
 #include <opencog/atomspace/AtomSpace.h>
 
 #include "DHTAtomStorage.h"
+#include "SexprReader.h"
 
 using namespace opencog;
 
@@ -25,82 +26,30 @@ using namespace opencog;
 /// Convert a scheme expression into a C++ Atom.
 /// For example: `(Concept "foobar")`  or
 /// `(Evaluation (Predicate "blort") (List (Concept "foo") (Concept "bar")))`
-/// will return the corresponding atoms.
+/// will return the corresponding atoms. On return, `pos` is just past
+/// the closing paren.
 ///
-Handle DHTAtomStorage::decodeStrAtom(std::string& scm, size_t& pos)
+Handle DHTAtomStorage::decodeStrAtom(std::string_view scm, size_t& pos)
 {
-	size_t vos = scm.find('(', pos);
-	if (std::string::npos == vos)
-		throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
-			scm.substr(pos).c_str());
-
-	size_t post = scm.find(' ', vos+1);
-	if (post != std::string::npos)
-		scm[post] = 0;
-	else
-	{
-		post = scm.find(')', vos+1);
-		if (post == std::string::npos)
-			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
-				scm.substr(pos).c_str());
-		scm[post] = 0;
-	}
-
-	Type t = nameserver().getType(&scm[vos+1]);
-	if (nameserver().isNode(t))
-	{
-		size_t name_start = scm.find('"', post+1);
-		if (name_start == std::string::npos)
-			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
-				scm.substr(pos).c_str());
-		size_t name_end = scm.find('"', name_start+1);
-		if (name_end == std::string::npos)
-			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
-				scm.substr(pos).c_str());
-		scm[name_end] = 0; // Clobber the ending quote
-		size_t close = scm.find(')', name_end + 1);
-		if (close == std::string::npos)
-			throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
-				scm.substr(pos).c_str());
-		pos = close + 1;
-		_num_got_nodes ++;
-		return createNode(t, &scm[name_start+1]);
-	}
-
-	if (not nameserver().isLink(t))
-		throw SyntaxException(TRACE_INFO, "Bad Atom string! %s\n",
-			scm.substr(pos).c_str());
-
-	// If we are here, its a Link.
-	HandleSeq oset;
-	size_t oset_start = scm.find('(', post+1);
-	size_t oset_end = scm.find(')', post+1);
-	if (std::string::npos == oset_end)
-		throw SyntaxException(TRACE_INFO, "Bad Atom string! %s\n",
-			scm.substr(pos).c_str());
-	while (oset_start != std::string::npos and oset_start < oset_end)
-	{
-		size_t vos = oset_start;
-		oset.push_back(decodeStrAtom(scm, vos));
-		oset_start = scm.find('(', vos);
-		oset_end = scm.find(')', vos);
-	}
-	if (oset_end == std::string::npos)
-		throw RuntimeException(TRACE_INFO, "Bad Atom string! %s\n",
-			scm.substr(pos).c_str());
-	pos = oset_end + 1;
-
-	_num_got_links ++;
-	return createLink(oset, t);
+	SexprReader rdr(scm, pos);
+	Handle h(rdr.read_atom());
+	pos = rdr.pos();
+	_num_got_nodes += rdr.nodes();
+	_num_got_links += rdr.links();
+	return h;
 }
 
 /* ================================================================ */
 
 /**
- * Given a guid, obtain and return the corresponding Atom for it.
- * This does NOT fetch the values on this Atom!
+ * Given a guid, obtain the corresponding Atom for it, and pass it to
+ * the callback. This does NOT fetch the values on this Atom! If the
+ * Atom can't be found, this throws, unless `missing_ok` is set; then
+ * the callback gets Handle::UNDEFINED.
  */
-Handle DHTAtomStorage::fetch_atom(const dht::InfoHash& guid)
+void DHTAtomStorage::async_fetch_atom(const FetchBatchPtr& batch,
+                                      const dht::InfoHash& guid,
+                                      AtomCallback&& cb, bool missing_ok)
 {
 	// Try to find what atom this is from our local cache.
 	// XXX Investigate.  This map presumes that it is somehow
@@ -109,31 +58,111 @@ Handle DHTAtomStorage::fetch_atom(const dht::InfoHash& guid)
 	// it be more space-efficient to never use this map, and to
 	// always got straight to the DHT library? How slow would
 	// that be? How much of a diffrence does it make?
-	std::unique_lock<std::mutex> lck(_decode_mutex);
-	const auto& da = _decode_map.find(guid);
-	if (_decode_map.end() != da) return da->second;
-	lck.unlock();
-
-	// Not found. Ask the DHT for it. Get a future for the atom,
-	// and wait on it. We cannot do an async wait here; we MUST
-	// get something back, before we return to the caller.
-	auto gvals = get_stuff(guid);
-
-	// Yikes! Fatal error! We're asked to process a GUID and we
-	// have no clue what Atom it corresponds to!
-	if (0 == gvals.size())
-		throw RuntimeException(TRACE_INFO, "Can't find Atom!");
-
-	// There may be more than one value, but they should all be
-	// one and the same.
-	std::string satom = gvals[0]->unpack<std::string>();
-	Handle h(decodeStrAtom(satom));
-
-	lck.lock();
-	_decode_map.emplace(std::make_pair(guid, h));
+	touch_key(guid);
+
+	Handle h;
+	if (_decode_map.get(guid, h))
+	{
+		cb(h);
+		return;
+	}
+
+	// The Atom records never change, so, if there's a copy on disk,
+	// there's no need to ask the network.
+	auto decode = [this, batch, guid, cb, missing_ok](const ValueVec& gvals)
+	{
+		auto cache = [this, guid, cb](const Handle& h)
+		{
+			if (nullptr == h) { cb(h); return; }
+			cb(_decode_map.insert(guid, h));
+		};
+
+		// There may be more than one value, but they should all
+		// be one and the same. They might differ in encoding,
+		// if an older text record is still around. Prefer the
+		// binary encoding.
+		for (const auto& gval : gvals)
+		{
+			if (ATOM_BIN_ID != gval->type) continue;
+			async_decode_atom(batch, gval->unpack<AtomRecord>(), cache,
+				missing_ok);
+			return;
+		}
+
+		std::string satom = gvals[0]->unpack<std::string>();
+		cache(decodeStrAtom(satom));
+	};
+
+	ValueVec dvals;
+	if (disk_cache_get(guid, dvals))
+	{
+		decode(dvals);
+		return;
+	}
+
+	// Not found. Ask the DHT for it.
+	async_get(batch, guid, {},
+		[this, guid, decode, cb, missing_ok](ValueVec&& gvals)
+		{
+			// Yikes! Fatal error! We're asked to process a GUID and
+			// we have no clue what Atom it corresponds to! It may
+			// have expired; ask the seeder to put it back.
+			if (0 == gvals.size())
+			{
+				want(guid);
+				if (missing_ok)
+				{
+					cb(Handle::UNDEFINED);
+					return;
+				}
+				throw RuntimeException(TRACE_INFO, "Can't find Atom!");
+			}
+
+			disk_cache_put(guid, gvals);
+			decode(gvals);
+		});
+}
+
+/**
+ * Given a guid, obtain and return the corresponding Atom for it.
+ * This does NOT fetch the values on this Atom! This blocks until
+ * the Atom is available.
+ */
+Handle DHTAtomStorage::fetch_atom(const dht::InfoHash& guid)
+{
+	// The callbacks need to know the GUID scheme; find out now,
+	// as they cannot wait on the DHT.
+	merkle_guids();
+
+	Handle h;
+	FetchBatchPtr batch(new_batch());
+	async_fetch_atom(batch, guid, [&h](const Handle& got) { h = got; });
+	wait_batch(batch);
 	return h;
 }
 
+/**
+ * Given a list of guids, return the corresponding list of Atoms,
+ * in the same order. All of the lookups are issued at once, so
+ * that this costs about one network round-trip, instead of N.
+ * This does NOT fetch the values on these Atoms!
+ */
+HandleSeq DHTAtomStorage::fetch_atoms(const std::vector<dht::InfoHash>& guids)
+{
+	merkle_guids();
+
+	HandleSeq hs(guids.size());
+	FetchBatchPtr batch(new_batch());
+	for (size_t i = 0; i < guids.size(); i++)
+	{
+		Handle& slot = hs[i];
+		async_fetch_atom(batch, guids[i],
+			[&slot](const Handle& got) { slot = got; });
+	}
+	wait_batch(batch);
+	return hs;
+}
+
 /* ================================================================ */
 
 Handle DHTAtomStorage::getNode(Type t, const char * str)
@@ -7,16 +7,20 @@
  * Copyright (c) 2008,2009,2013,2015,2017 Linas Vepstas <linas@linas.org>
  * SPDX-License-Identifier: AGPL-3.0-or-later
  */
+#include <math.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <random>
 #include <thread>
 
 #include <opendht/log.h>
 
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/atomspaceutils/TLB.h>
+#include <opencog/util/Logger.h>
 
 #include "DHTAtomStorage.h"
 
@@ -66,8 +70,17 @@ void DHTAtomStorage::init(const char * uri)
 	else
 		throw IOException(TRACE_INFO, "Bad URI '%s'\n", uri);
 
+	// Split off the query parameters, if any. These have the form
+	//    dht:///atomspace-name?key=value&key2=value2
+	size_t pos = _atomspace_name.find('?');
+	if (pos != std::string::npos)
+	{
+		parse_params(_atomspace_name.substr(pos+1));
+		_atomspace_name.resize(pos);
+	}
+
 	// Strip out and replace trailing slash.
-	size_t pos = _atomspace_name.find('/');
+	pos = _atomspace_name.find('/');
 	if (pos != std::string::npos) _atomspace_name.resize(pos);
 	_atomspace_name += '/';
 
@@ -77,36 +90,262 @@ void DHTAtomStorage::init(const char * uri)
 		_observing_only = false;
 	}
 
+	// Overlay on a read-only base AtomSpace, given by name, as in
+	//    dht:///my-changes?base=shared-dataset
+	// Writes go to this AtomSpace; reads fall through to the base.
+	_base_name = get_param("base", "");
+	_base_known = false;
+	_base_shards = 0;
+	_base_typed = false;
+	_base_merkle = false;
+	_base_locality = 0;
+	if (0 < _base_name.size())
+	{
+		if (_observing_only)
+			throw IOException(TRACE_INFO,
+				"An overlay needs an AtomSpace name: '%s'\n", uri);
+		_base_name += '/';
+		if (_base_name == _atomspace_name)
+			throw IOException(TRACE_INFO,
+				"An AtomSpace cannot be its own base: '%s'\n", uri);
+		_base_hash = dht::InfoHash::get(_base_name);
+	}
+
+	// How Values are stored: all of them, every time, the last writer
+	// winning; or, with `values=merge`, only the ones that changed,
+	// with CountTruthValue counts added up over writers. See
+	// DHTMerge.cc. Each writer needs an id of its own, for the counts.
+	std::string values = get_param("values", "");
+	if (0 < values.size() and values != "merge")
+		throw IOException(TRACE_INFO, "Unknown values policy in URI '%s'\n", uri);
+	_merge_values = (values == "merge");
+	_writer_id = std::mt19937_64(std::random_device{}())();
+	_count_seq = 0;
+
 	clear_stats();
 
 	// --------------------------------------------------------------
 	// Network configuration
-	// How long to wait for an answer
-	_wait_time = std::chrono::milliseconds(4000);
+	// How long a lookup may go without any answer, in milliseconds.
+	// Lookups that OpenDHT reports as failed are sent again; see
+	// DHTFetch.cc. The retransmit timeout adapts to the measured
+	// round-trip times, but is never less than `min_timeout`. Each
+	// lookup is sent at most `get_tries` times; one means that it is
+	// never sent again.
+	// With `partial=1`, bulk loads go on without the lookups that
+	// time out, instead of failing.
+#define DEFAULT_TIMEOUT 4000
+#define DEFAULT_MIN_TIMEOUT 20
+#define DEFAULT_GET_TRIES 3
+	_wait_time = std::chrono::milliseconds(
+		get_param("timeout", (size_t) DEFAULT_TIMEOUT));
+	_min_rto = std::chrono::milliseconds(
+		get_param("min_timeout", (size_t) DEFAULT_MIN_TIMEOUT));
+	if (0 == _wait_time.count() or _wait_time < _min_rto)
+		throw IOException(TRACE_INFO, "Bad timeout in URI '%s'\n", uri);
+	_get_tries = get_param("get_tries", (size_t) DEFAULT_GET_TRIES);
+	if (0 == _get_tries) _get_tries = 1;
+	_partial_loads = (0 != get_param("partial", (size_t) 0));
+	_watch_stop = false;
+
+	// How many lookups to hand to OpenDHT at the same time.
+#define DEFAULT_INFLIGHT 64
+	_max_inflight = get_param("inflight", DEFAULT_INFLIGHT);
+	if (0 == _max_inflight) _max_inflight = 1;
+	_inflight = 0;
+	_dispatch_stop = false;
+
+	// How many of those one fetch_neighborhood() may have.
+#define DEFAULT_PREFETCH_INFLIGHT 32
+	_prefetch_inflight = get_param("prefetch_inflight",
+		(size_t) DEFAULT_PREFETCH_INFLIGHT);
+	if (0 == _prefetch_inflight) _prefetch_inflight = 1;
+
+	// How many keys to spread the AtomSpace membership over. This is
+	// used only when creating a new AtomSpace; otherwise, whatever
+	// was recorded in the DHT by the creator is used.
+#define DEFAULT_SHARDS 16
+	_want_shards = get_param("shards", DEFAULT_SHARDS);
+	if (0 == _want_shards or MAX_SHARDS < _want_shards)
+		throw IOException(TRACE_INFO, "Bad shard count in URI '%s'\n", uri);
+	_num_shards = 0;
+
+	// Graph-local placement of the per-Atom keys, as in
+	//    dht:///atomspace-name?locality=16
+	// Also used only when creating a new AtomSpace. See place_near().
+	_want_locality = get_param("locality", (size_t) 0);
+	if (MAX_LOCALITY < _want_locality)
+		throw IOException(TRACE_INFO, "Bad locality in URI '%s'\n", uri);
+	_locality = 0;
+
+	// Bloom-filter summaries of the membership shards, with the given
+	// false-positive rate, as in
+	//    dht:///atomspace-name?bloom=0.01&bloom_atoms=1000000
+	// The filters are sized for `bloom_atoms` Atoms in all; zero (the
+	// default) means no filters. Also used only when creating a new
+	// AtomSpace. Readers refresh the filters this often. See DHTBloom.cc
+#define DEFAULT_BLOOM_ATOMS 100000
+#define DEFAULT_BLOOM_REFRESH 60
+	std::string bloom = get_param("bloom", "");
+	_want_bloom_fpr = 0.0;
+	if (0 < bloom.size())
+	{
+		char* end = nullptr;
+		_want_bloom_fpr = strtod(bloom.c_str(), &end);
+		if (*end or _want_bloom_fpr < 0.0 or 1.0 <= _want_bloom_fpr)
+			throw IOException(TRACE_INFO,
+				"Bad Bloom false-positive rate in URI '%s'\n", uri);
+	}
+	_want_bloom_atoms = get_param("bloom_atoms", (size_t) DEFAULT_BLOOM_ATOMS);
+	if (0 == _want_bloom_atoms) _want_bloom_atoms = 1;
+	_bloom_refresh = get_param("bloom_refresh", (size_t) DEFAULT_BLOOM_REFRESH);
+	_bloom_published = 0;
+
+	// Write-behind queue. Writers block when this many puts are
+	// waiting; the window starts out modest, and adapts.
+	_max_queued = 64*1024;
+	_put_window = 64;
+	_puts_outstanding = 0;
+	_acks_since_cut = 0;
+	_put_rtt_min = std::chrono::steady_clock::duration::max();
+
+	// Puts that are not answered in this many milliseconds are taken
+	// as a sign of congestion. They stay counted against the window
+	// until OpenDHT gives up on them; failed puts are sent again, up
+	// to `put_tries` times in all. This must be shorter than
+	// `_wait_time`, so that barrier() does not give up before the
+	// retries are made; if not given, it is made so.
+#define DEFAULT_PUT_TIMEOUT 3000
+#define DEFAULT_PUT_TRIES 5
+	size_t put_ms = get_param("put_timeout", (size_t) 0);
+	if (0 == put_ms)
+		put_ms = std::max((size_t) 1, std::min((size_t) DEFAULT_PUT_TIMEOUT,
+			(size_t) (3 * _wait_time.count() / 4)));
+	else if ((size_t) _wait_time.count() <= put_ms)
+		throw IOException(TRACE_INFO,
+			"The put_timeout must be shorter than the timeout in URI '%s'\n",
+			uri);
+	_put_timeout = std::chrono::milliseconds(put_ms);
+	_max_put_tries = get_param("put_tries", (size_t) DEFAULT_PUT_TRIES);
+	if (0 == _max_put_tries) _max_put_tries = 1;
+	_put_ids.seed(std::random_device{}());
+	_flush_stop = false;
+	_type_index = false;
+
+	// An observer has no AtomSpace, and so no shard descriptor to say
+	// which GUIDs are in use. It computes the Merkle ones, as new
+	// AtomSpaces do, unless told otherwise: `dht://:4555/?guids=sexpr`
+	// selects the older ones, for looking at older data. AtomSpaces
+	// go by their descriptor.
+	std::string guids = get_param("guids", "merkle");
+	if (guids != "merkle" and guids != "sexpr")
+		throw IOException(TRACE_INFO, "Unknown GUIDs in URI '%s'\n", uri);
+	_merkle_guids = _observing_only and (guids == "merkle");
+
+	// Memory budgets for the per-Atom caches, in megabytes. The
+	// `cache_mb` budget is split evenly across all of the caches;
+	// each may also be set on its own. Zero means unbounded, which
+	// is the default. Evicted entries are recomputed, or refetched
+	// from the DHT, when next needed. The hot keys are the exception:
+	// they are always bounded, as every key ever put or fetched goes
+	// there. Evicted hot keys are no longer refreshed; the pinned
+	// ones are never evicted.
+#define NUM_CACHES 7
+#define MB (1024*1024)
+#define DEFAULT_HOT_CACHE_MB 64
+	size_t cache_mb = get_param("cache_mb", (size_t) 0);
+	size_t each_mb = (cache_mb + NUM_CACHES - 1) / NUM_CACHES;
+	_guid_map.set_budget(MB * get_param("guid_cache_mb", each_mb));
+	_decode_map.set_budget(MB * get_param("decode_cache_mb", each_mb));
+	_membership_map.set_budget(MB * get_param("membership_cache_mb", each_mb));
+	_published.set_budget(MB * get_param("published_cache_mb", each_mb));
+	_values_state.set_budget(MB * get_param("values_cache_mb", each_mb));
+	_member_ts.set_budget(MB * get_param("member_cache_mb", each_mb));
+	size_t hot_mb = get_param("hot_cache_mb", each_mb);
+	if (0 == hot_mb) hot_mb = DEFAULT_HOT_CACHE_MB;
+	_hot_keys.set_budget(MB * hot_mb);
+
+	// Local on-disk cache, one file per AtomSpace, in the directory
+	// given by `cache=`. A cache that cannot be opened (most often,
+	// because another process has it) is not fatal; we run without.
+	std::string cache_dir = get_param("cache", "");
+	if (0 < cache_dir.size() and not _observing_only)
+	{
+		std::string path = cache_dir + "/" + _atomspace_hash.toString() + ".seg";
+		try
+		{
+			_disk_cache.reset(new SegmentCache(path));
+		}
+		catch (const IOException& ex)
+		{
+			logger().warn("DHT: running without a disk cache: %s", ex.what());
+		}
+	}
 
 	// Policies for storing atoms
 
-	// For now, hardcode to one week. In fact, atoms should probably be
-	// permanent, and the rest should be configureable on a per-atomspace
-	// basis. Which means that we may need to adjust these dynamically...
+	// One week, by default. This can be a lot shorter, if the data
+	// is kept alive by refreshing it, or by a seeder. The URI
+	// parameter `lifetime` gives it in minutes; each policy can also
+	// be set on its own, e.g. with `values_lifetime`, as Values churn
+	// much faster than Atoms. See also set_lifetime().
 #define DATA_LIFETIME 24*7
-	std::chrono::hours lifetime(DATA_LIFETIME);
+	size_t lifetime = get_param("lifetime", (size_t) 60*DATA_LIFETIME);
+	std::chrono::minutes atom_life(get_param("atom_lifetime", lifetime));
+	std::chrono::minutes space_life(get_param("space_lifetime", lifetime));
+	std::chrono::minutes values_life(get_param("values_lifetime", lifetime));
+	std::chrono::minutes incoming_life(get_param("incoming_lifetime", lifetime));
+	if (0 == atom_life.count() or 0 == space_life.count() or
+	    0 == values_life.count() or 0 == incoming_life.count())
+		throw IOException(TRACE_INFO, "Bad lifetime in URI '%s'\n", uri);
+
+	// The refresh period, in seconds, or "off"; see below.
+	_refresh_param = get_param("refresh", "");
+	if (0 < _refresh_param.size() and _refresh_param.compare("off"))
+	{
+		char* end = nullptr;
+		unsigned long secs = strtoul(_refresh_param.c_str(), &end, 10);
+		if (*end or 0 == secs)
+			throw IOException(TRACE_INFO,
+				"Bad refresh period in URI '%s'\n", uri);
+	}
 
 	_atom_policy = dht::ValueType(ATOM_ID, "atom policy",
-		lifetime, cy_store_atom, cy_edit_atom);
+		atom_life, cy_store_atom, cy_edit_atom);
 
 	_space_policy = dht::ValueType(SPACE_ID, "space policy",
-		lifetime, cy_store_space, cy_edit_space);
+		space_life, cy_store_space, cy_edit_space);
 
 	_values_policy = dht::ValueType(VALUES_ID, "values policy",
-		lifetime, cy_store_values, cy_edit_values);
+		values_life, cy_store_values, cy_edit_values);
 
 	_incoming_policy = dht::ValueType(INCOMING_ID, "incoming policy",
-		lifetime, cy_store_incoming, cy_edit_incoming);
+		incoming_life, cy_store_incoming, cy_edit_incoming);
+
+	// The binary encodings are stored under the same keys, and with
+	// the same value->id's as the text encodings, and so will
+	// replace them, as the old text records get re-written.
+	_atom_bin_policy = dht::ValueType(ATOM_BIN_ID, "binary atom policy",
+		atom_life, cy_store_atom, cy_edit_atom);
+
+	_values_bin_policy = dht::ValueType(VALUES_BIN_ID, "binary values policy",
+		values_life, cy_store_values, cy_edit_values);
+
+	// Want requests are only of use until a seeder has answered.
+#define WANT_LIFETIME 10
+	_want_policy = dht::ValueType(WANT_ID, "want policy",
+		std::chrono::minutes(WANT_LIFETIME));
+	_want_key = dht::InfoHash::get(_atomspace_name + "want");
+
+	// The filters are kept as long as the membership that they
+	// summarize.
+	_bloom_policy = dht::ValueType(BLOOM_ID, "bloom policy",
+		space_life, cy_store_bloom, cy_edit_bloom);
 
 	// Use filters, because the same membership hash gets used
 	// for both values and for incoming sets.
-	_values_filter = dht::Value::TypeFilter(_values_policy);
+	_values_filter = [](const dht::Value& v)
+		{ return VALUES_ID == v.type or VALUES_BIN_ID == v.type; };
 	_incoming_filter = dht::Value::TypeFilter(_incoming_policy);
 
 	// Run a private NetID only for AtomSpace data!
@@ -171,6 +410,40 @@ void DHTAtomStorage::init(const char * uri)
 	_runner.registerType(_space_policy);
 	_runner.registerType(_values_policy);
 	_runner.registerType(_incoming_policy);
+	_runner.registerType(_atom_bin_policy);
+	_runner.registerType(_values_bin_policy);
+	_runner.registerType(_want_policy);
+	_runner.registerType(_bloom_policy);
+
+	// Lookup results are processed on these threads.
+	size_t ndispatch = get_param("dispatch_threads",
+		(size_t) std::max(1U, std::thread::hardware_concurrency()));
+	if (0 == ndispatch) ndispatch = 1;
+	for (size_t i = 0; i < ndispatch; i++)
+		_dispatch_threads.emplace_back(&DHTAtomStorage::dispatch_loop, this);
+
+	// Puts are handed to OpenDHT on this thread.
+	_flush_thread = std::thread(&DHTAtomStorage::flush_loop, this);
+
+	// Slow lookups are sent again, or given up on, by this one.
+	_watch_thread = std::thread(&DHTAtomStorage::watch_loop, this);
+
+	// Keep what's in use from expiring. The `refresh` parameter is
+	// the period, in seconds, or "off"; by default, it is half of the
+	// shortest lifetime. Keys stay in use for `hot` seconds after
+	// they were last touched, and at most `refresh_rate` of them are
+	// refreshed per second.
+#define DEFAULT_HOT (24*3600)
+#define DEFAULT_REFRESH_RATE 1000
+	_hot_window = std::chrono::seconds(get_param("hot", (size_t) DEFAULT_HOT));
+	_refresh_rate = get_param("refresh_rate", (size_t) DEFAULT_REFRESH_RATE);
+	_refresh_stop = false;
+
+	_as = nullptr;
+	_next_listen = 0;
+	if (not _observing_only and _refresh_param.compare("off"))
+		_refresh_thread = std::thread(&DHTAtomStorage::refresh_loop, this,
+			std::cref(_refresh_stop), FetchBatchPtr());
 
 	// Do NOT fiddle with atomspace contents, if nothing is open!
 	if (not _observing_only)
@@ -180,6 +453,41 @@ void DHTAtomStorage::init(const char * uri)
 	}
 }
 
+/// Parse URI query parameters, of the form `key=value&key2=value2`
+void DHTAtomStorage::parse_params(const std::string& query)
+{
+	size_t start = 0;
+	while (start < query.size())
+	{
+		size_t end = query.find('&', start);
+		if (std::string::npos == end) end = query.size();
+
+		std::string kv = query.substr(start, end - start);
+		size_t eq = kv.find('=');
+		if (std::string::npos == eq or 0 == eq)
+			throw IOException(TRACE_INFO, "Bad URI parameter '%s'\n",
+				kv.c_str());
+		_params[kv.substr(0, eq)] = kv.substr(eq+1);
+		start = end + 1;
+	}
+}
+
+/// Return the named URI parameter, or the default, if absent.
+std::string DHTAtomStorage::get_param(const std::string& key,
+                                      const std::string& dflt)
+{
+	const auto& it = _params.find(key);
+	if (_params.end() == it) return dflt;
+	return it->second;
+}
+
+size_t DHTAtomStorage::get_param(const std::string& key, size_t dflt)
+{
+	const auto& it = _params.find(key);
+	if (_params.end() == it) return dflt;
+	return strtoul(it->second.c_str(), nullptr, 10);
+}
+
 void DHTAtomStorage::dht_bootstrap(const std::string& uri)
 {
 #define URIX_LEN (sizeof("dht://") - 1)  // Should be 6
@@ -215,10 +523,47 @@ DHTAtomStorage::DHTAtomStorage(std::string uri)
 
 DHTAtomStorage::~DHTAtomStorage()
 {
-	// Calling the loop manually causes pending message queues to drain.
-	// Once for the high-priority queue, and once for the regular queue,
-	_runner.loop();
-	_runner.loop();
+	unlisten_all();
+	_refresh_stop = true;
+	if (_refresh_thread.joinable()) _refresh_thread.join();
+
+	// Send everything that is still in the store queue. This also
+	// drains the pending message queues in OpenDHT.
+	barrier();
+
+	// Nothing waits for the Bloom filter refreshes, except this.
+	FetchBatchPtr bloom;
+	{
+		std::lock_guard<std::mutex> blck(_bloom_mutex);
+		bloom.swap(_bloom_batch);
+	}
+	if (bloom)
+	{
+		try
+		{
+			wait_batch_until(bloom, std::chrono::steady_clock::now() + _wait_time);
+		}
+		catch (const std::exception& ex)
+		{
+			logger().warn("DHT: Bloom filter refresh failed: %s", ex.what());
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> plck(_put_mutex);
+		_flush_stop = true;
+	}
+	_put_cv.notify_all();
+	_drain_cv.notify_all();
+	_flush_thread.join();
+
+	// Nothing more is sent.
+	{
+		std::lock_guard<std::mutex> wlck(_lookup_mutex);
+		_watch_stop = true;
+	}
+	_watch_cv.notify_all();
+	_watch_thread.join();
 
 	// The condition variable attempts to halt progress
 	// until the shutdown callback is called...
@@ -248,6 +593,14 @@ DHTAtomStorage::~DHTAtomStorage()
 
 	// Wait for dht threads to end.
 	_runner.join();
+
+	// No more lookups can complete; stop the dispatcher.
+	{
+		std::lock_guard<std::mutex> dlck(_lookup_mutex);
+		_dispatch_stop = true;
+	}
+	_dispatch_cv.notify_all();
+	for (std::thread& t : _dispatch_threads) t.join();
 }
 
 /**
@@ -316,20 +669,6 @@ std::string DHTAtomStorage::dht_searches_log(void)
 
 /* ================================================================== */
 
-std::vector<std::shared_ptr<dht::Value>>
-DHTAtomStorage::get_stuff(const dht::InfoHash& ihash,
-                          const dht::Value::Filter& filter)
-{
-	auto ifut = _runner.get(ihash, filter);
-	std::future_status status = ifut.wait_for(_wait_time);
-	if (std::future_status::ready != status)
-		throw IOException(TRACE_INFO, "DHT is not responding!");
-
-	return ifut.get();
-}
-
-/* ================================================================== */
-
 /**
  * Get the values attached to a key, decode and pretty-print them.
  */
@@ -373,7 +712,16 @@ std::string DHTAtomStorage::prt_dht_value(
 			break;
 		case INCOMING_ID:
 			ss << "Incoming: "
-			   << ival->unpack<dht::InfoHash>().toString() << std::endl;
+			   << ival->unpack<dht::InfoHash>().toString()
+			   << " " << ival->user_type << std::endl;
+			break;
+		case ATOM_BIN_ID:
+			ss << "Atom seq=" << std::to_string(ival->seq) << " "
+			   << prt_atom_record(ival->unpack<AtomRecord>()) << std::endl;
+			break;
+		case VALUES_BIN_ID:
+			ss << "Value: "
+			   << prt_values_record(ival->unpack<ValuesRecord>()) << std::endl;
 			break;
 		default:
 			ss << "Raw: " << ival->toString() << std::endl;
@@ -401,34 +749,60 @@ std::string DHTAtomStorage::dht_atom_hash(const Handle& atom)
 	return get_membership(atom).toString();
 }
 
-/* ================================================================== */
-/// Drain the pending store queue. This is a fencing operation; the
-/// goal is to make sure that all writes that occurred before the
-/// barrier really are performed before before all the writes after
-/// the barrier.
-///
-void DHTAtomStorage::barrier()
-{
-	// Calling this twice seems to cause all queues to be drained:
-	// The first time, its the high-priority queue, and the second
-	// time, the regular queue.
-	_runner.loop();
-	_runner.loop();
-	// Not sure... How do we do this?
-}
-
 /* ================================================================ */
 
 void DHTAtomStorage::registerWith(AtomSpace* as)
 {
 	BackingStore::registerWith(as);
+	_as = as;
+	_extract_sig = as->get_atomtable().removeAtomSignal().connect(
+		std::bind(&DHTAtomStorage::extract_callback, this,
+			std::placeholders::_1));
 }
 
 void DHTAtomStorage::unregisterWith(AtomSpace* as)
 {
+	// Stop applying changes first; the AtomSpace may be going away.
+	unlisten_all();
+	_as = nullptr;
+
+	as->get_atomtable().removeAtomSignal().disconnect(_extract_sig);
 	BackingStore::unregisterWith(as);
 }
 
+/// Called when an Atom is extracted from the AtomSpace. Drop it from
+/// all of the caches; otherwise, the cached Handles would keep it
+/// from ever being freed. The Atom stays in the DHT; if it is ever
+/// stored or fetched again, the caches get re-populated.
+void DHTAtomStorage::extract_callback(const AtomPtr& atom)
+{
+	Handle h(atom->get_handle());
+
+	// The decode cache is keyed by GUID. That may have been evicted
+	// from the GUID cache, in which case it has to be recomputed.
+	// The outgoing set is still in the AtomSpace, so, for Merkle
+	// GUIDs, this is cheap.
+	dht::InfoHash guid;
+	if (_guid_map.get(h, guid))
+		_guid_map.erase(h);
+	else
+		guid = compute_guid(h);
+
+	Handle cached;
+	if (_decode_map.get(guid, cached) and cached == h)
+		_decode_map.erase(guid);
+
+	_membership_map.erase(h);
+	_published.erase(h);
+	_values_state.erase(h);
+	_values_seen.erase(h);
+
+	// A drop being applied by a listener is kept; see apply_member().
+	MemberSeen seen;
+	if (_member_ts.get(guid, seen) and seen.added)
+		_member_ts.erase(guid);
+}
+
 /* ================================================================ */
 
 /**
@@ -466,6 +840,29 @@ void DHTAtomStorage::clear_stats(void)
 	_value_updates = 0;
 	_value_deletes = 0;
 	_value_fetches = 0;
+	_listen_events = 0;
+	_num_puts_queued = 0;
+	_num_puts_coalesced = 0;
+	_num_puts_sent = 0;
+	_num_puts_failed = 0;
+	_num_put_retries = 0;
+	_num_puts_lost = 0;
+	_num_bloom_checks = 0;
+	_num_bloom_absent = 0;
+	_num_bloom_fetches = 0;
+	_num_wants_sent = 0;
+	_num_wants_seen = 0;
+	_num_wants_answered = 0;
+	_num_gets_failed = 0;
+	_num_timeouts = 0;
+	_num_barrier_timeouts = 0;
+	_num_gets_retried = 0;
+	_num_gets_expired = 0;
+	for (size_t i = 0; i < NUM_METRICS; i++)
+	{
+		_get_latency[i].clear();
+		_put_latency[i].clear();
+	}
 
 	_immutable_stores = 0;
 	_immutable_edits = 0;
@@ -475,12 +872,38 @@ void DHTAtomStorage::clear_stats(void)
 	_value_edits = 0;
 	_incoming_stores = 0;
 	_incoming_edits = 0;
+
+	_guid_map.clear_stats();
+	_decode_map.clear_stats();
+	_membership_map.clear_stats();
+	_published.clear_stats();
+	_values_state.clear_stats();
+	_member_ts.clear_stats();
+	_hot_keys.clear_stats();
+}
+
+template<typename STATS>
+static void prt_cache_stats(const char* name, const STATS& st, size_t budget)
+{
+	size_t lookups = st.hits + st.misses;
+	double rate = (0 < lookups) ? st.hits / ((double) lookups) : 0.0;
+	printf("%-10s cache: entries = %zu KBytes = %zu", name,
+	       st.entries, st.bytes / 1024);
+	if (0 < budget)
+		printf(" of %zu", budget / 1024);
+	printf(" hits = %zu misses = %zu (%.1f%%) evicted = %zu\n",
+	       st.hits, st.misses, 100.0 * rate, st.evictions);
 }
 
 void DHTAtomStorage::print_stats(void)
 {
 	printf("dht-stats: Currently open URI: %s\n", _uri.c_str());
 	printf("dht-stats: AtomSpace hash: %s\n", _atomspace_hash.to_c_str());
+	printf("dht-stats: AtomSpace membership shards: %zu\n", (size_t) _num_shards);
+	if (0 < _base_name.size())
+		printf("dht-stats: Base AtomSpace: %s hash: %s\n",
+			_base_name.c_str(), _base_hash.to_c_str());
+	printf("dht-stats: Lifetimes (minutes): %s\n", get_lifetimes().c_str());
 	time_t now = time(0);
 	// ctime returns string with newline at end of it.
 	printf("dht-stats: Time since stats reset=%lu secs, at %s",
@@ -540,6 +963,113 @@ void DHTAtomStorage::print_stats(void)
 	printf("dht value stores     = %zu edits = %zu\n", value_stores, value_edits);
 	printf("dht incoming stores  = %zu edits = %zu\n", incoming_stores, incoming_edits);
 
+	size_t puts_queued = _num_puts_queued;
+	size_t puts_coalesced = _num_puts_coalesced;
+	size_t puts_sent = _num_puts_sent;
+	size_t puts_failed = _num_puts_failed;
+	size_t put_retries = _num_put_retries;
+	size_t puts_lost = _num_puts_lost;
+	size_t put_window;
+	size_t puts_waiting;
+	{
+		std::lock_guard<std::mutex> lck(_put_mutex);
+		put_window = _put_window;
+		puts_waiting = _put_queue.size();
+	}
+	printf("\n");
+	printf("put queue: queued = %zu coalesced = %zu sent = %zu failed = %zu\n",
+	       puts_queued, puts_coalesced, puts_sent, puts_failed);
+	printf("put queue: waiting = %zu window = %zu\n", puts_waiting, put_window);
+	printf("put queue: retries = %zu unanswered = %zu\n", put_retries, puts_lost);
+
+	size_t wants_sent = _num_wants_sent;
+	size_t wants_seen = _num_wants_seen;
+	size_t wants_answered = _num_wants_answered;
+	printf("wants: sent = %zu seen = %zu answered = %zu\n",
+	       wants_sent, wants_seen, wants_answered);
+
+	size_t bloom_checks = _num_bloom_checks;
+	if (0 < bloom_checks)
+	{
+		size_t bloom_absent = _num_bloom_absent;
+		size_t bloom_fetches = _num_bloom_fetches;
+		double fill = 0.0;
+		size_t nhashes = 0;
+		{
+			std::lock_guard<std::mutex> lck(_bloom_mutex);
+			for (const BloomShard& bs : _bloom_shards)
+				fill += bs.remote.empty() ? bs.local.fill() : bs.remote.fill();
+			if (not _bloom_shards.empty())
+			{
+				fill /= _bloom_shards.size();
+				nhashes = _bloom_shards[0].local.nhashes();
+			}
+		}
+		printf("bloom filters: checks = %zu absent = %zu (%.1f%%) fetches = %zu\n",
+		       bloom_checks, bloom_absent,
+		       100.0 * bloom_absent / ((double) bloom_checks), bloom_fetches);
+		printf("bloom filters: fill = %.1f%% est. false-positive rate = %.3g%%\n",
+		       100.0 * fill, 100.0 * pow(fill, nhashes));
+	}
+
+	size_t gets_failed = _num_gets_failed;
+	size_t timeouts = _num_timeouts;
+	size_t barrier_timeouts = _num_barrier_timeouts;
+	printf("gets failed = %zu timeouts = %zu barrier timeouts = %zu\n",
+	       gets_failed, timeouts, barrier_timeouts);
+
+	size_t gets_retried = _num_gets_retried;
+	size_t gets_expired = _num_gets_expired;
+	double srtt, rttvar, rto;
+	{
+		std::lock_guard<std::mutex> lck(_lookup_mutex);
+		srtt = _rtt.srtt_us() / 1000.0;
+		rttvar = _rtt.rttvar_us() / 1000.0;
+		rto = get_rto().count() / 1000.0;
+	}
+	printf("gets retried = %zu gets expired = %zu\n",
+	       gets_retried, gets_expired);
+	printf("get msecs: srtt = %.2f rttvar = %.2f rto = %.2f\n",
+	       srtt, rttvar, rto);
+	for (size_t i = 0; i < NUM_METRICS; i++)
+		prt_latency("get", i, _get_latency[i]);
+	for (size_t i = 0; i < NUM_METRICS; i++)
+		prt_latency("put", i, _put_latency[i]);
+
+	size_t nlistens;
+	{
+		std::lock_guard<std::mutex> lck(_listen_mutex);
+		nlistens = _listens.size();
+	}
+	size_t listen_events = _listen_events;
+	printf("subscriptions = %zu changes received = %zu\n",
+	       nlistens, listen_events);
+
+	printf("\n");
+	prt_cache_stats("guid", _guid_map.stats(), _guid_map.get_budget());
+	prt_cache_stats("decode", _decode_map.stats(), _decode_map.get_budget());
+	prt_cache_stats("membership", _membership_map.stats(),
+	                _membership_map.get_budget());
+	prt_cache_stats("published", _published.stats(), _published.get_budget());
+	prt_cache_stats("values", _values_state.stats(),
+	                _values_state.get_budget());
+	prt_cache_stats("member", _member_ts.stats(), _member_ts.get_budget());
+	prt_cache_stats("hot", _hot_keys.stats(), _hot_keys.get_budget());
+
+	if (_disk_cache)
+	{
+		size_t hits = _disk_cache->hits();
+		size_t misses = _disk_cache->misses();
+		size_t lookups = hits + misses;
+		double rate = (0 < lookups) ? hits / ((double) lookups) : 0.0;
+		printf("disk       cache: records = %zu KBytes = %zu of %zu",
+		       _disk_cache->size(), _disk_cache->live_bytes() / 1024,
+		       _disk_cache->file_bytes() / 1024);
+		printf(" hits = %zu misses = %zu (%.1f%%)\n", hits, misses,
+		       100.0 * rate);
+		printf("disk       cache: %s\n", _disk_cache->path().c_str());
+	}
+
 	printf("\n");
 }
 
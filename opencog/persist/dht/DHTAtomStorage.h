@@ -17,8 +17,17 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <set>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include <opendht.h>
@@ -35,6 +44,14 @@
 #include <opencog/atomspace/AtomTable.h>
 #include <opencog/atomspace/BackingStore.h>
 
+#include <opencog/persist/dht/BloomFilter.h>
+#include <opencog/persist/dht/DHTRecords.h>
+#include <opencog/persist/dht/LatencyHistogram.h>
+#include <opencog/persist/dht/Placement.h>
+#include <opencog/persist/dht/RttEstimator.h>
+#include <opencog/persist/dht/SegmentCache.h>
+#include <opencog/persist/dht/StripedMap.h>
+
 namespace opencog
 {
 /** \addtogroup grp_persist
@@ -45,6 +62,10 @@ class DHTAtomStorage : public BackingStore
 {
 	private:
 		void init(const char *);
+		void parse_params(const std::string&);
+		std::string get_param(const std::string&, const std::string&);
+		size_t get_param(const std::string&, size_t);
+		std::map<std::string, std::string> _params;
 		std::string _uri;
 		int _port;
 		bool _observing_only;
@@ -63,6 +84,18 @@ class DHTAtomStorage : public BackingStore
 		dht::ValueType _values_policy;
 		dht::ValueType _incoming_policy;
 
+		// Binary (msgpack) encodings of atoms and values. Readers
+		// accept both these and the older text encodings above.
+		dht::ValueType _atom_bin_policy;
+		dht::ValueType _values_bin_policy;
+
+		// Requests for a seeder to re-publish a key that has
+		// expired from the DHT. See DHTSeeder.cc
+		dht::ValueType _want_policy;
+		dht::InfoHash _want_key;
+		void want(const dht::InfoHash&, bool base = false);
+
+
 		dht::Value::Filter _values_filter;
 		dht::Value::Filter _incoming_filter;
 		enum
@@ -71,7 +104,15 @@ class DHTAtomStorage : public BackingStore
 			SPACE_ID = 4098,
 			VALUES_ID = 4099,
 			INCOMING_ID = 4100,
+			ATOM_BIN_ID = 4101,
+			VALUES_BIN_ID = 4102,
+			WANT_ID = 4103,
+			BLOOM_ID = 4104,
 		};
+
+		// The value->id of the shard descriptor, kept on the
+		// AtomSpace key, next to the (legacy) "add" records.
+		enum { SHARDS_VID = 1, MAX_SHARDS = 4096 };
 		static bool cy_store_atom(dht::InfoHash key,
 		                std::shared_ptr<dht::Value>& value,
 		                const dht::InfoHash& from,
@@ -116,6 +157,17 @@ class DHTAtomStorage : public BackingStore
 		               const dht::InfoHash& from,
 		               const dht::SockAddr& addr);
 
+		static bool cy_store_bloom(dht::InfoHash key,
+		                std::shared_ptr<dht::Value>& value,
+		                const dht::InfoHash& from,
+		                const dht::SockAddr& addr);
+
+		static bool cy_edit_bloom(dht::InfoHash key,
+		               const std::shared_ptr<dht::Value>& old_val,
+		               std::shared_ptr<dht::Value>& new_val,
+		               const dht::InfoHash& from,
+		               const dht::SockAddr& addr);
+
 		static std::string prt_dht_value(const std::shared_ptr<dht::Value>&);
 		double now(void);
 		// --------------------------
@@ -125,45 +177,517 @@ class DHTAtomStorage : public BackingStore
 		static std::string encodeValuesToAlist(const Handle&);
 		static std::string encodeAtomToStr(const Handle& h) {
 			return h->to_short_string(); }
-		Handle decodeStrAtom(std::string& s) {
+		Handle decodeStrAtom(std::string_view s) {
 			size_t junk = 0;
 			return decodeStrAtom(s, junk);
 		}
-		Handle decodeStrAtom(std::string&, size_t&);
+		Handle decodeStrAtom(std::string_view, size_t&);
 
-		std::mutex _guid_mutex;
-		std::unordered_map<Handle, dht::InfoHash> _guid_map;
+		// These caches are hit from every thread that stores or
+		// fetches, and so are lock-striped. Each may have a memory
+		// budget; see init(). Entries for Atoms extracted from the
+		// AtomSpace are dropped by extract_callback().
+		StripedMap<Handle, dht::InfoHash> _guid_map;
 		dht::InfoHash get_guid(const Handle&);
 
 		Handle fetch_atom(const dht::InfoHash&);
-		std::mutex _decode_mutex;
-		std::map<dht::InfoHash, Handle> _decode_map;
+		HandleSeq fetch_atoms(const std::vector<dht::InfoHash>&);
+		StripedMap<dht::InfoHash, Handle> _decode_map;
 
-		std::mutex _membership_mutex;
-		std::unordered_map<Handle, dht::InfoHash> _membership_map;
+		StripedMap<Handle, dht::InfoHash> _membership_map;
 		dht::InfoHash get_membership(const Handle&);
 
-		std::mutex _publish_mutex;
-		std::unordered_set<Handle> _published;
-		void publish_to_atomspace(const Handle&);
+		StripedMap<Handle, bool> _published;
+
+		// Optional local, on-disk copy of what we've put into, and
+		// gotten from the DHT; it survives restarts. Set up by the
+		// `cache=` URI parameter; see init().
+		std::unique_ptr<SegmentCache> _disk_cache;
+		void disk_cache_put(const dht::InfoHash&, const dht::Value&);
+		void disk_cache_put(const dht::InfoHash&, const SegmentCache::ValueVec&);
+		bool disk_cache_get(const dht::InfoHash&, SegmentCache::ValueVec&);
+
+		bool publish_to_atomspace(const Handle&);
 		void store_recursive(const Handle&);
+		void store_single(const Handle&);
+		static bool held_before(const HandleSeq&, size_t);
+
+		// Bulk stores; see DHTBulk.cc. The incoming-set records of a
+		// level are gathered by the Atom that they go on, and queued
+		// together.
+		typedef std::unordered_map<Handle, std::vector<dht::Value>> IncomingPuts;
+		void store_level(const HandleSeq&, size_t nthreads,
+		                 const std::function<bool(const Handle&)>& with_values,
+		                 bool publish, std::vector<size_t>& wcount,
+		                 std::vector<double>& wsecs);
+		void store_incoming(IncomingPuts&&, size_t nthreads);
+		static std::vector<HandleSeq> sort_levels(const HandleSeq&,
+		                 const std::function<bool(const Handle&)>&);
+
+		// --------------------------
+		// Incoming sets
+		std::vector<dht::InfoHash> get_incoming_guids(const Handle&);
+		std::vector<dht::InfoHash> get_incoming_guids(const Handle&, Type);
+		std::vector<dht::InfoHash> get_incoming_guids(const Handle&,
+		                                       const dht::Value::Filter&);
+		static std::vector<dht::InfoHash> incoming_guids(
+		              const std::vector<std::shared_ptr<dht::Value>>&);
+		dht::Value::Filter incoming_filter(Type);
+		dht::Value incoming_value(const dht::InfoHash&, const Handle&);
 
 		// --------------------------
 		// Values
+		// What the DHT holds for the values on an Atom, as far as we
+		// know. Atoms that are not in the map have never been seen.
+		enum ValuesState
+		{
+			VALUES_CHECKING, // a get is in progress
+			VALUES_PRESENT,
+			VALUES_ABSENT,
+		};
+		StripedMap<Handle, ValuesState> _values_state;
+		void set_values_state(const Handle&, ValuesState);
 		void store_atom_values(const Handle &);
 		Handle fetch_values(Handle&&);
+		HandleSeq fetch_values_batch(HandleSeq&&);
 		void delete_atom_values(const Handle&);
 
-		ValuePtr decodeStrValue(std::string&, size_t&);
-		void decodeAlist(Handle&, std::string&);
+		ValuePtr decodeStrValue(std::string_view, size_t&);
+		void decodeAlist(Handle&, std::string_view);
+
+		// The "merge" values policy: only the keys that changed are
+		// sent, and the counts on CountTruthValues are CRDT counters.
+		// The driver remembers what it last stored or fetched, to
+		// know what changed, and what this writer's share is.
+		// See DHTMerge.cc
+		struct CountState
+		{
+			double base;   // the count, when last stored or fetched
+			double mine;   // this writer's share of it
+			uint64_t seq;
+		};
+		struct ValuesSeen
+		{
+			std::map<Handle, ValuePtr> vals;
+			std::map<Handle, CountState> counts;
+			uint64_t seq = 0;  // the newer one wins
+		};
+		bool _merge_values;
+		uint64_t _writer_id;
+		std::atomic<uint64_t> _count_seq;
+		StripedMap<Handle, ValuesSeen> _values_seen;
+		ValuesRecord encodeValuesDelta(const Handle&, ValuesRecord&,
+		                               ValuesSeen&);
+		void set_values_seen(const Handle&, const ValuesSeen&);
+		void seen_values(const Handle&, const HandleSeq&,
+		                 const std::vector<ValuePtr>&,
+		                 const std::vector<std::vector<CountRecord>>&);
+		static std::shared_ptr<dht::Value> merge_values(
+		              const std::vector<std::shared_ptr<dht::Value>>&);
+		static void merge_queued_values(const dht::Value&, dht::Value&);
+		static bool rebase_values(dht::Value&, const dht::Value&);
 
 		// --------------------------
 		// Network configuration
 		using Timeout = std::chrono::milliseconds;
-		Timeout _wait_time;
+		Timeout _wait_time;     // longest a lookup may go unanswered
+		bool _partial_loads;    // bulk loads skip lookups that time out
+
+		typedef std::vector<std::shared_ptr<dht::Value>> ValueVec;
+		ValueVec get_stuff(const dht::InfoHash&,
+		                   const dht::Value::Filter& = {});
+
+		// --------------------------
+		// Asynchronous fetch engine. Lookups are issued with the
+		// callback flavor of DhtRunner::get(), and the results are
+		// handed to a dispatcher thread. Thus, follow-on lookups
+		// (for Values, IncomingSets, ...) are never issued from,
+		// nor block, the OpenDHT thread.
+		typedef std::function<void(ValueVec&&)> GotCallback;
+		typedef std::function<void(const Handle&)> AtomCallback;
+
+		// A batch tracks a tree of dependent lookups. It is complete
+		// when all lookups, including those issued by callbacks, are
+		// done. Callbacks are not run after a batch is abandoned.
+		struct FetchBatch
+		{
+			std::mutex mtx;
+			std::condition_variable cv;
+			size_t pending = 0;     // lookups not yet completed
+			size_t running = 0;     // callbacks currently running
+			bool cancelled = false; // waiter gave up
+			bool partial = false;   // lookups that time out are skipped
+			bool timed_out = false; // a lookup timed out, and not partial
+			size_t incomplete = 0;  // lookups that timed out
+			std::string error;      // first failure, if any
+			std::chrono::steady_clock::time_point progress;
+		};
+		typedef std::shared_ptr<FetchBatch> FetchBatchPtr;
 
-		std::vector<std::shared_ptr<dht::Value>>
-		get_stuff(const dht::InfoHash&, const dht::Value::Filter& = {});
+		struct Lookup
+		{
+			FetchBatchPtr batch;
+			dht::InfoHash key;
+			dht::Value::Filter filter;
+			GotCallback cb;
+			ValueVec vals;
+			bool local = false; // from async_run(); not a DHT lookup
+			bool stream = false; // from async_stream()
+			std::chrono::steady_clock::time_point started;
+			dht::ValueType::Id vtype = 0; // of the first value found
+
+			// A lookup may be sent more than once; see DHTFetch.cc
+			// Each attempt collects its own values. All of these are
+			// guarded by the mutex.
+			std::mutex mtx;
+			std::vector<ValueVec> tries;
+			size_t outstanding = 0; // attempts not yet done
+			std::chrono::steady_clock::time_point sent;  // last attempt
+			std::chrono::steady_clock::time_point alive; // last heard from
+			bool retry = false;     // the last attempt failed
+			std::chrono::steady_clock::time_point retry_at;
+			std::atomic<bool> finished{false}; // on the done-queue
+			bool expired = false;   // no answer in time
+		};
+		typedef std::shared_ptr<Lookup> LookupPtr;
+
+		// Lookups handed to OpenDHT, and the round-trip estimates that
+		// decide when a failed one is sent again, guarded by the lookup
+		// mutex.
+		std::vector<LookupPtr> _watched;
+		size_t _get_tries;      // most times a lookup is sent
+		Timeout _min_rto;
+		RttEstimator _rtt;
+		std::condition_variable _watch_cv;
+		bool _watch_stop;
+		std::thread _watch_thread;
+		std::chrono::microseconds get_rto(void);
+		void watch_loop(void);
+		void start_attempt(const LookupPtr&);
+		void attempt_done(const LookupPtr&, size_t, bool);
+		void expire_lookup(const LookupPtr&);
+		void lookup_done(const LookupPtr&);
+
+		size_t _max_inflight;
+		size_t _inflight;
+		std::mutex _lookup_mutex;
+		std::deque<LookupPtr> _lookup_queue; // waiting to be issued
+		std::deque<LookupPtr> _done_queue;   // waiting to be dispatched
+		std::condition_variable _dispatch_cv;
+		bool _dispatch_stop;
+		std::vector<std::thread> _dispatch_threads;
+
+		FetchBatchPtr new_batch(void);
+		void wait_batch(const FetchBatchPtr&);
+		bool wait_batch_until(const FetchBatchPtr&,
+		                      std::chrono::steady_clock::time_point);
+		void async_run(const FetchBatchPtr&, std::function<void()>&&);
+		void async_get(const FetchBatchPtr&, const dht::InfoHash&,
+		               const dht::Value::Filter&, GotCallback&&,
+		               bool stream = false);
+		void async_stream(const FetchBatchPtr&, const dht::InfoHash&,
+		                  const dht::Value::Filter&, GotCallback&&);
+		void async_fetch_atom(const FetchBatchPtr&, const dht::InfoHash&,
+		                      AtomCallback&&, bool missing_ok = false);
+		void async_fetch_values(const FetchBatchPtr&, const Handle&,
+		                        AtomCallback&&);
+		void got_values(const FetchBatchPtr&, const Handle&,
+		                const ValueVec&, AtomCallback&&,
+		                bool remember = true);
+		typedef std::function<void(std::vector<dht::InfoHash>&&)> GuidsCallback;
+		void async_fetch_incoming(const FetchBatchPtr&, const Handle&,
+		                          const dht::Value::Filter&, GuidsCallback&&);
+		void start_lookup(const LookupPtr&);
+		void finish_lookup(const LookupPtr&);
+		void run_callback(const FetchBatchPtr&, const std::function<void()>&);
+		void dispatch_loop(void);
+
+		// --------------------------
+		// Neighborhood prefetch; see DHTNeighborhood.cc. At most
+		// `_prefetch_inflight` of the requests for one neighborhood
+		// are outstanding at a time; the others wait their turn.
+		struct Neighborhood
+		{
+			FetchBatchPtr batch;
+			AtomTable* table;
+			dht::Value::Filter filter; // on the holders
+			Type type;
+			size_t depth;
+			std::mutex mtx;
+			size_t outstanding = 0;
+			std::deque<std::function<void()>> waiting;
+			HandleSet seen;
+		};
+		typedef std::shared_ptr<Neighborhood> NeighborhoodPtr;
+		size_t _prefetch_inflight;
+		void nb_issue(const NeighborhoodPtr&, std::function<void()>&&);
+		void nb_done(const NeighborhoodPtr&);
+		void nb_visit(const NeighborhoodPtr&, const Handle&, size_t);
+		void nb_holder(const NeighborhoodPtr&, const dht::InfoHash&, size_t);
+
+		// --------------------------
+		// Binary wire format
+		AtomRecord encodeAtomToRecord(const Handle&);
+		ValuesRecord encodeValuesToRecord(const Handle&);
+		static ValueRecord encodeValueToRecord(const ValuePtr&);
+		static ValuePtr decodeValueRecord(const ValueRecord&);
+		void async_decode_atom(const FetchBatchPtr&, const AtomRecord&,
+		                       AtomCallback&&, bool missing_ok = false);
+		void async_decode_values(const FetchBatchPtr&, const Handle&,
+		                         const ValuesRecord&, AtomCallback&&);
+		static std::string prt_atom_record(const AtomRecord&);
+		static std::string prt_values_record(const ValuesRecord&);
+
+		// --------------------------
+		// Sharded AtomSpace membership. The "add" and "drop" records
+		// are spread over several keys, so that no single key runs
+		// into the OpenDHT MAX_VALUES limit, and no single DHT node
+		// sees all of the writes. The shard count is fixed when the
+		// AtomSpace is first written to, and is recorded in the DHT.
+		size_t _want_shards;
+		std::atomic<size_t> _num_shards; // zero until looked up
+		std::mutex _shard_mutex;
+		std::vector<dht::InfoHash> _shard_keys;
+		size_t get_num_shards(void);
+
+		// What the shard descriptor says; see fetch_num_shards().
+		struct Layout
+		{
+			bool typed = false;
+			bool merkle = false;
+			size_t local = 0;
+			size_t bloom_hashes = 0; // zero, if there are no filters
+			size_t bloom_bits = 0;
+		};
+		size_t fetch_num_shards(const dht::InfoHash&, Layout* = nullptr);
+		static std::vector<dht::InfoHash> get_shard_keys(const std::string&,
+		                                                 size_t);
+		dht::InfoHash get_shard(const Handle&);
+
+		// Per-type membership, sharded the same way. AtomSpaces
+		// created before the type index existed do not have one;
+		// the descriptor records whether it is present.
+		bool _type_index;
+		static std::vector<dht::InfoHash> get_type_shard_keys(
+		                                   const std::string&, Type, size_t);
+		dht::InfoHash get_type_shard(const Handle&);
+
+		// Called with the Atom, true if added (false if dropped), and
+		// the timestamp of the record.
+		typedef std::function<void(const Handle&, bool, double)> MemberCallback;
+		void foreach_member(const FetchBatchPtr&, const dht::InfoHash&,
+		                    const MemberCallback&);
+		void foreach_member(const std::vector<dht::InfoHash>&,
+		                    const MemberCallback&);
+		void decode_members(const ValueVec&, size_t, size_t,
+		                    const MemberCallback&);
+		static bool parse_member(const std::string&, bool&, double&, size_t&);
+		size_t load_members(const std::vector<dht::InfoHash>&, Type,
+		                    const std::function<void(const HandleSeq&)>&,
+		                    const std::function<void(const HandleSeq&)>&);
+
+		// Merkle GUIDs; see compute_guid(). AtomSpaces created before
+		// these existed use the older GUIDs, and the descriptor
+		// records which kind is in use.
+		bool _merkle_guids;
+		bool merkle_guids(void);
+		dht::InfoHash compute_guid(const Handle&);
+
+		// Graph-local placement; see Placement.h. The MUID of a Link
+		// shares this many leading bits with the MUID of its first
+		// outgoing Atom; zero means that MUIDs are placed at random.
+		// Like the shard count, it is fixed when the AtomSpace is
+		// created, and recorded in the descriptor.
+		enum { MAX_LOCALITY = 64 };
+		size_t _want_locality;
+		size_t _locality;
+
+		// Bloom-filter summaries of the membership shards; see
+		// DHTBloom.cc. The writers OR the MUIDs of what they publish
+		// into the filter of the shard; readers cache the filters, and
+		// skip the lookups for Atoms that were never published. Also
+		// fixed when the AtomSpace is created. There are no filters,
+		// if the shards are empty.
+		dht::ValueType _bloom_policy;
+		double _want_bloom_fpr;   // zero, if there are to be no filters
+		size_t _want_bloom_atoms; // how many the filters are sized for
+		time_t _bloom_refresh;    // seconds between reader refreshes
+		struct BloomShard
+		{
+			dht::InfoHash key;
+			BloomFilter local;    // what was published from here
+			BloomFilter remote;   // what the DHT had; empty if nothing
+			bool dirty = false;   // local has not been put since added to
+			time_t fetched = 0;   // when remote was last asked for
+		};
+		std::mutex _bloom_mutex;
+		std::vector<BloomShard> _bloom_shards;
+		time_t _bloom_published;
+		FetchBatchPtr _bloom_batch;
+		void init_bloom(const Layout&, size_t);
+		void bloom_add(const Handle&);
+		bool bloom_absent(const Handle&);
+		void bloom_fetch(size_t);
+		void bloom_publish(void);
+
+		// Read-only base AtomSpace, below this one; see DHTOverlay.cc
+		// The base name is empty, if this is not an overlay.
+		std::string _base_name;
+		dht::InfoHash _base_hash;
+		std::mutex _base_mutex;
+		std::atomic<bool> _base_known;
+		size_t _base_shards;
+		bool _base_typed;
+		bool _base_merkle;
+		size_t _base_locality;
+		size_t get_base_shards(void);
+		dht::InfoHash get_base_membership(const Handle&);
+		std::vector<dht::InfoHash> get_base_keys(Type);
+		ValueVec get_overlay(const dht::InfoHash&, const dht::InfoHash&,
+		                     const dht::Value::Filter&);
+		static void overlay_merge(ValueVec&, ValueVec&&);
+		void async_fetch_base_values(const FetchBatchPtr&, const Handle&,
+		                             AtomCallback&&);
+
+		// --------------------------
+		// Write-behind store queue. All puts go through here. A put
+		// that is still in the queue is replaced by any later put
+		// to the same (key, value type, value id). The number of
+		// puts handed to OpenDHT, but not yet answered, is limited
+		// by a window that adapts to the measured put latency. Puts
+		// that fail are sent again, after an exponentially growing
+		// delay, a few times.
+		typedef std::function<void(void)> PutAcked;
+		struct QueuedPut
+		{
+			dht::InfoHash key;
+			std::shared_ptr<dht::Value> val;
+			size_t tries = 0;  // how many times it was sent
+			std::chrono::steady_clock::time_point sent;
+			bool late = false; // not answered within `_put_timeout`
+			bool slotted = true; // came with an id; may be replaced
+			PutAcked acked;    // called when OpenDHT has stored it
+		};
+		typedef std::shared_ptr<QueuedPut> QueuedPutPtr;
+		typedef std::tuple<dht::InfoHash, dht::ValueType::Id,
+		                   dht::Value::Id> PutSlot;
+
+		std::mutex _put_mutex;
+		std::condition_variable _put_cv;   // wakes the flusher
+		std::condition_variable _drain_cv; // wakes barrier() and writers
+		std::deque<QueuedPutPtr> _put_queue;
+		std::map<PutSlot, QueuedPutPtr> _put_slots;
+		size_t _max_queued;
+		size_t _put_window;
+		size_t _puts_outstanding;
+		size_t _acks_since_cut;
+		std::chrono::steady_clock::duration _put_rtt_min;
+		std::chrono::steady_clock::time_point _put_progress;
+		std::set<QueuedPutPtr> _put_inflight;
+		std::multimap<std::chrono::steady_clock::time_point,
+		              QueuedPutPtr> _put_retries;
+		std::map<PutSlot, QueuedPutPtr> _put_latest; // most recently sent
+		std::chrono::steady_clock::duration _put_timeout;
+		size_t _max_put_tries;
+		std::mt19937_64 _put_ids;  // for values put without an id
+		bool _flush_stop;
+		std::thread _flush_thread;
+
+		void queue_put(const dht::InfoHash&, dht::Value&&, bool touch = true,
+		               PutAcked&& = nullptr);
+		void queue_puts(const dht::InfoHash&, std::vector<dht::Value>&&);
+		void queue_refresh(const dht::InfoHash&, const ValueVec&);
+		bool enqueue_put(std::unique_lock<std::mutex>&, const dht::InfoHash&,
+		                 dht::Value&&, PutAcked&& = nullptr);
+
+		// Lookups issued by store_atom_values(), to find out if there
+		// are values in the DHT that need to be clobbered. barrier()
+		// waits for these.
+		std::mutex _check_mutex;
+		FetchBatchPtr _check_batch;
+		static bool has_values(const ValueVec&);
+		void flush_loop(void);
+		void put_done(const QueuedPutPtr&, size_t, bool,
+		              std::chrono::steady_clock::time_point,
+		              dht::ValueType::Id);
+		void put_failed(const QueuedPutPtr&,
+		                std::chrono::steady_clock::time_point);
+		bool put_is_stale(const QueuedPutPtr&);
+		void forget_put(const QueuedPutPtr&);
+		void cut_put_window(void);
+		void put_lost(void);
+		void expire_puts(std::chrono::steady_clock::time_point);
+		void requeue_puts(std::chrono::steady_clock::time_point);
+		std::chrono::steady_clock::time_point next_put_wake(
+		              std::chrono::steady_clock::time_point);
+
+		// --------------------------
+		// Refresh, so that what is in use does not expire. Keys are
+		// touched when put or fetched; those touched in the last
+		// `_hot_window` are re-put every refresh period. Pinned keys
+		// (the membership shards) are always re-put. See DHTRefresh.cc
+		StripedMap<dht::InfoHash, time_t> _hot_keys;
+		void touch_key(const dht::InfoHash&, bool pin = false);
+		std::vector<dht::InfoHash> get_hot_keys(time_t);
+		std::string _refresh_param;   // seconds, or "off" or "" (auto)
+		std::chrono::seconds _hot_window;
+		size_t _refresh_rate;         // keys per second; zero is no limit
+		std::atomic<bool> _refresh_stop;
+		std::thread _refresh_thread;
+		std::chrono::seconds refresh_period(void);
+		void refresh_loop(const std::atomic<bool>&, const FetchBatchPtr&);
+		void refresh_keys(const std::atomic<bool>&);
+
+		// Per-policy lifetimes may be changed while running.
+		std::mutex _policy_mutex;
+		void set_expiration(dht::ValueType&, std::chrono::minutes);
+
+		// Subscriptions; see DHTListen.cc. Each subscription is
+		// one or more OpenDHT listens; changes are applied to the
+		// AtomSpace that we're registered with.
+		struct Listen
+		{
+			dht::InfoHash key;
+			std::shared_future<size_t> token;
+		};
+		AtomSpace* _as;
+		std::mutex _listen_mutex;
+		size_t _next_listen;
+		std::map<size_t, std::vector<Listen>> _listens;
+		FetchBatchPtr _listen_batch;
+		std::atomic<size_t> _listen_events;
+
+		// The newest membership record applied, for each Atom, so
+		// that late records don't undo newer ones. Keyed by GUID, so
+		// that no Handle is kept alive. Atoms that were added are
+		// forgotten when they are extracted; the drops are kept, so
+		// that an older add cannot bring the Atom back, until they
+		// are evicted.
+		struct MemberSeen
+		{
+			double ts;
+			bool added;
+		};
+		std::mutex _member_mutex;
+		StripedMap<dht::InfoHash, MemberSeen> _member_ts;
+		typedef std::function<void(const FetchBatchPtr&,
+		                           const std::shared_ptr<dht::Value>&)> ListenCallback;
+		void listen_key(std::vector<Listen>&, const dht::InfoHash&,
+		                const dht::Value::Filter&, const ListenCallback&);
+		size_t add_listens(std::vector<Listen>&&);
+		void apply_member(const FetchBatchPtr&, const std::shared_ptr<dht::Value>&);
+		void apply_incoming(const FetchBatchPtr&, const Handle&,
+		                    const std::shared_ptr<dht::Value>&);
+		void cancel_listens(const std::vector<Listen>&);
+		AtomSpace* listen_space(void);
+
+		// Seeder; see DHTSeeder.cc
+		void seed_member(const FetchBatchPtr&, const dht::InfoHash&,
+		                 const std::shared_ptr<dht::Value>&);
+		void seed_atom(const FetchBatchPtr&, const Handle&);
+		void seed_want(const FetchBatchPtr&, const dht::InfoHash&);
+		void reseed_key(const FetchBatchPtr&, const dht::InfoHash&);
+		void reseed(const dht::InfoHash&, const ValueVec&);
 
 		// --------------------------
 		// Performance statistics
@@ -180,6 +704,43 @@ class DHTAtomStorage : public BackingStore
 		std::atomic<size_t> _value_updates;
 		std::atomic<size_t> _value_deletes;
 		std::atomic<size_t> _value_fetches;
+		std::atomic<size_t> _num_puts_queued;
+		std::atomic<size_t> _num_puts_coalesced;
+		std::atomic<size_t> _num_puts_sent;
+		std::atomic<size_t> _num_puts_failed;  // after all retries
+		std::atomic<size_t> _num_put_retries;
+		std::atomic<size_t> _num_puts_lost;    // never answered
+		std::atomic<size_t> _num_bloom_checks;
+		std::atomic<size_t> _num_bloom_absent; // lookups skipped
+		std::atomic<size_t> _num_bloom_fetches;
+		std::atomic<size_t> _num_wants_sent;
+		std::atomic<size_t> _num_wants_seen;     // by the seeder
+		std::atomic<size_t> _num_wants_answered;
+
+		// Latencies of every get and put, by the kind of value that
+		// was gotten or put. Gets that found nothing are counted
+		// apart. See DHTMetrics.cc
+		enum
+		{
+			METRIC_ATOM,
+			METRIC_SPACE,
+			METRIC_VALUES,
+			METRIC_INCOMING,
+			METRIC_OTHER,
+			METRIC_MISS,
+			NUM_METRICS
+		};
+		static const char* metric_name(size_t);
+		static size_t metric_of(dht::ValueType::Id);
+		LatencyHistogram _get_latency[NUM_METRICS];
+		LatencyHistogram _put_latency[NUM_METRICS];
+		std::atomic<size_t> _num_gets_failed;
+		std::atomic<size_t> _num_timeouts;  // "DHT is not responding!"
+		std::atomic<size_t> _num_barrier_timeouts;
+		std::atomic<size_t> _num_gets_retried;  // sent again, after failing
+		std::atomic<size_t> _num_gets_expired;  // never answered in time
+
+		void prt_latency(const char*, size_t, const LatencyHistogram&);
 
 		// These have to be static, as they are incremented
 		// from static functions.
@@ -209,8 +770,19 @@ class DHTAtomStorage : public BackingStore
 		std::string dht_storage_log(void);
 		std::string dht_routing_tables_log(void);
 		std::string dht_searches_log(void);
+		std::string dht_metrics(void);
+		std::string dht_prometheus(void);
 
 		void load_atomspace(AtomSpace*, const std::string&);
+		void run_seeder(const std::atomic<bool>&);
+
+		size_t listen_atomspace(void);
+		size_t listen_values(const Handle&);
+		size_t listen_incoming(const Handle&);
+		void unlisten(size_t);
+		void unlisten_all(void);
+		void set_lifetime(const std::string&, size_t);
+		std::string get_lifetimes(void);
 
 		void kill_data(void); // destroy DB contents
 
@@ -224,7 +796,10 @@ class DHTAtomStorage : public BackingStore
 		Handle getLink(Type, const HandleSeq&);
 		void getIncomingSet(AtomTable&, const Handle&);
 		void getIncomingByType(AtomTable&, const Handle&, Type t);
+		size_t fetch_neighborhood(AtomTable&, const Handle&, size_t depth,
+		                          Type t = NOTYPE);
 		void storeAtom(const Handle&, bool synchronous = false);
+		void storeAtoms(const HandleSeq&, bool synchronous = false);
 		void removeAtom(const Handle&, bool recursive);
 		void loadType(AtomTable&, Type);
 		void loadAtomSpace(AtomTable&); // Load entire contents
@@ -232,6 +807,19 @@ class DHTAtomStorage : public BackingStore
 		void barrier();
 
 		// Debugging and performance monitoring
+		struct Gauges
+		{
+			size_t lookups_queued;
+			size_t lookups_inflight;
+			size_t lookups_done;  // waiting for a dispatcher
+			size_t puts_queued;
+			size_t puts_outstanding;
+			size_t put_window;
+			size_t nodes_good;    // IPv4 routing table
+			size_t nodes_dubious;
+			size_t table_depth;
+		};
+		Gauges get_gauges(void);
 		void print_stats(void);
 		void clear_stats(void); // reset stats counters.
 };
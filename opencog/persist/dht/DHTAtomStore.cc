@@ -6,13 +6,18 @@
  * SPDX-License-Identifier: AGPL-3.0-or-later
  */
 
+#include <algorithm>
+
 #include <stdlib.h>
+#include <string.h>
 #include <opendht/node.h>
 
 #include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atomspace/AtomSpace.h>
 
 #include "DHTAtomStorage.h"
+#include "ValuesMerge.h"
 
 using namespace opencog;
 
@@ -33,67 +38,87 @@ void DHTAtomStorage::store_recursive(const Handle& h)
 	if (_observing_only)
 		throw IOException(TRACE_INFO, "DHT Node is only observing!");
 
+	// Whatever it holds was published before it was.
+	if (_published.contains(h)) return;
+
+	// Resursive store; add leaves first.
+	if (h->is_link())
+		for (const Handle& held: h->getOutgoingSet())
+			store_recursive(held);
+
+	// Only after adding leaves, add the atom.
+	store_single(h);
+}
+
+/**
+ * Store the atom, and update the incoming sets of the atoms that it
+ * holds. The held atoms are NOT stored; the caller is responsible
+ * for storing them first. If the atom was already published, then
+ * so were the incoming-set records; they are not sent again.
+ */
+void DHTAtomStorage::store_single(const Handle& h)
+{
+	if (not publish_to_atomspace(h)) return;
 	if (h->is_node())
 	{
-		publish_to_atomspace(h);
 		_num_node_inserts++;
 		return;
 	}
 
-	// Resursive store; add leaves first.
-	for (const Handle& held: h->getOutgoingSet())
-		store_recursive(held);
-
-	// Only after adding leaves, add the atom.
-	publish_to_atomspace(h);
-
 	// Finally, update the incoming sets.
 	dht::InfoHash holderguid = get_guid(h);
-	for (const Handle& held: h->getOutgoingSet())
+	const HandleSeq& oset = h->getOutgoingSet();
+	for (size_t i = 0; i < oset.size(); i++)
 	{
-		dht::InfoHash memuid = get_membership(held);
-		_runner.put(memuid,
-			dht::Value(_incoming_policy, holderguid, h->get_hash()));
+		if (held_before(oset, i)) continue;
+		dht::InfoHash memuid = get_membership(oset[i]);
+		queue_put(memuid, incoming_value(holderguid, h));
 	}
 	_num_link_inserts++;
 }
 
+/// True if the i'th Atom in the outgoing set also appears earlier in
+/// it; its incoming-set record has already been sent.
+bool DHTAtomStorage::held_before(const HandleSeq& oset, size_t i)
+{
+	return oset.begin() + i != std::find(oset.begin(), oset.begin() + i, oset[i]);
+}
+
 /**
  * Store the indicated atom and all of the values attached to it.
  * Also store it's incoming set.
  *
  * The actual store is done asynchronously (in a different thread)
  * by the DHT library; thus this method will typically return before
- * the store has completed.
+ * the store has completed, unless the synchronous flag is set.
  */
 void DHTAtomStorage::storeAtom(const Handle& h, bool synchronous)
 {
 	store_atom_values(h);
 	store_recursive(h);
+	if (synchronous) barrier();
 }
 
 /* ================================================================== */
 /**
- * Publish Atom to the AtomSpace
+ * Publish Atom to the AtomSpace. Returns false if it was already.
  */
-void DHTAtomStorage::publish_to_atomspace(const Handle& atom)
+bool DHTAtomStorage::publish_to_atomspace(const Handle& atom)
 {
 	if (_observing_only)
 		throw IOException(TRACE_INFO, "DHT Node is only observing!");
 
-	std::unique_lock<std::mutex> lck(_publish_mutex);
-	const auto& pa = _published.find(atom);
-	if (_published.end() != pa) return;
-
-	lck.unlock();
+	if (_published.contains(atom)) return false;
 
-	// Publish the generic AtomSpace encoding.
+	// Publish the binary Atom encoding.
 	// These will always have a dht-id of "1", so that only one copy
 	// is kept around.
-	std::string gstr = encodeAtomToStr(atom);
-	_runner.put(get_guid(atom), dht::Value(_atom_policy, gstr, 1));
+	dht::InfoHash guid = get_guid(atom);
+	dht::Value gval(_atom_bin_policy, encodeAtomToRecord(atom), 1);
+	disk_cache_put(guid, gval);
+	queue_put(guid, std::move(gval));
 
-	// Put the atom into the atomspace.
+	// Put the atom into its membership shard of the atomspace.
 	// These will have a dht-id that is the atom hash, thus allowing
 	// multiple dht-values on the atomspace, but each value having
 	// a distinct dht-id.  Now, the atom-hashes are 64-bit, so there
@@ -103,13 +128,29 @@ void DHTAtomStorage::publish_to_atomspace(const Handle& atom)
 	// We also have to mark the atom with a timestamp, to guarantee
 	// forward progress in the case that it is deleted later, and then
 	// added again.
-	std::string astr = "add " + std::to_string(now()) + " " + gstr;
-	_runner.put(_atomspace_hash,
-	            dht::Value(_space_policy, astr, atom->get_hash()));
+	std::string astr = "add " + std::to_string(now()) + " "
+		+ encodeAtomToStr(atom);
+	dht::Value aval(_space_policy, astr, atom->get_hash());
+	dht::InfoHash shard = get_shard(atom);
+	touch_key(shard, true);
+	queue_put(shard, dht::Value(aval));
+
+	// Same as above, but for the per-type index, so that loadType()
+	// need not look at every Atom in the AtomSpace.
+	if (_type_index)
+	{
+		dht::InfoHash tshard = get_type_shard(atom);
+		touch_key(tshard, true);
+		queue_put(tshard, std::move(aval));
+	}
+	bloom_add(atom);
 
-	lck.lock();
-	_published.emplace(atom);
+	// Two threads storing the same atom at the same time will both
+	// get here; this is harmless, as the store queue coalesces the
+	// duplicate puts.
+	_published.try_insert(atom, true);
 	_store_count ++;
+	return true;
 }
 
 /* ================================================================== */
@@ -119,23 +160,75 @@ void DHTAtomStorage::publish_to_atomspace(const Handle& atom)
  * Atom. This is the Atom as it stands naked, without any values, or
  * incoming set, or AtomSpace that it belongs to. Its just the pure
  * Atom.
- *
- * XXX TODO this should use all of the hashing and alpha-equivalence
- * rules that ContentHash Atom::compute_hash() const uses.
- * !! Perhaps we should extend class Atom to provide both 20-byte
- * (160 bit) and larger (256 bit) hashes? Yes, we should!
- * That would avoid bugs & shit...
  */
 dht::InfoHash DHTAtomStorage::get_guid(const Handle& h)
 {
-	std::lock_guard<std::mutex> lck(_guid_mutex);
-	const auto& ip = _guid_map.find(h);
-	if (_guid_map.end() != ip)
-		return ip->second;
-	std::string gstr = encodeAtomToStr(h);
-	dht::InfoHash gkey = dht::InfoHash::get(gstr);
-	_guid_map[h] = gkey;
-	return gkey;
+	dht::InfoHash gkey;
+	if (_guid_map.get(h, gkey)) return gkey;
+
+	// Hash without holding any lock; other threads may be storing.
+	gkey = compute_guid(h);
+	return _guid_map.insert(h, gkey);
+}
+
+/**
+ * Compute the GUID. For AtomSpaces created before Merkle GUIDs were
+ * introduced, this is the hash of the s-expression for the Atom.
+ * For links, this renders the entire tree of the outgoing set, over
+ * and over, for every link in the tree.
+ *
+ * The Merkle GUID of a Node is the hash of the type name and the
+ * node name. The Merkle GUID of a Link is the hash of the type name,
+ * and the GUIDs of the outgoing set; these are almost always cached,
+ * and so each Atom is hashed just once, in time proportional to its
+ * arity. Type names are used, rather than the numeric types, as the
+ * latter depend on the order in which types were loaded. The 0 and
+ * 1 bytes keep the node and link encodings apart.
+ *
+ * The hashing itself is done by the OpenDHT crypto backend, which
+ * will use the CPU's SHA instructions, if it has them.
+ */
+dht::InfoHash DHTAtomStorage::compute_guid(const Handle& h)
+{
+	if (not merkle_guids())
+		return dht::InfoHash::get(encodeAtomToStr(h));
+
+	const std::string& tname = nameserver().getTypeName(h->get_type());
+	std::string buf;
+	if (h->is_node())
+	{
+		const std::string& name = h->get_name();
+		buf.reserve(tname.size() + 1 + name.size());
+		buf.append(tname);
+		buf.push_back('\0');
+		buf.append(name);
+	}
+	else
+	{
+		const HandleSeq& oset = h->getOutgoingSet();
+		buf.reserve(tname.size() + 1 + oset.size() * dht::HASH_LEN);
+		buf.append(tname);
+		buf.push_back('\1');
+		for (const Handle& ho : oset)
+		{
+			dht::InfoHash ogid(get_guid(ho));
+			buf.append((const char*) ogid.data(), ogid.size());
+		}
+	}
+	return dht::InfoHash::get((const uint8_t*) buf.data(), buf.size());
+}
+
+/**
+ * Return true if this AtomSpace uses Merkle GUIDs. This is recorded
+ * in the shard descriptor, and so may need a trip to the DHT the
+ * first time around. Observers, which have no AtomSpace, and so no
+ * descriptor, go by the URI; see init().
+ */
+bool DHTAtomStorage::merkle_guids(void)
+{
+	if (_observing_only) return _merkle_guids;
+	get_num_shards();
+	return _merkle_guids;
 }
 
 /* ================================================================== */
@@ -143,18 +236,36 @@ dht::InfoHash DHTAtomStorage::get_guid(const Handle& h)
  * Return the AtomSpace-specific (bus still globally-unique) hash
  * corresponding to the Atom, in this AtomSpace.  This hash is
  * required for looking up values and incoming sets.
+ *
+ * With Merkle GUIDs, this is the hash of the AtomSpace hash and the
+ * GUID; a fixed 40 bytes, no matter how big the Atom is.
+ *
+ * With graph-local placement, the MUID of a Link is then moved next
+ * to the MUID of its first outgoing Atom; see place_near().
  */
 dht::InfoHash DHTAtomStorage::get_membership(const Handle& h)
 {
-	std::lock_guard<std::mutex> lck(_membership_mutex);
-	const auto& ip = _membership_map.find(h);
-	if (_membership_map.end() != ip)
-		return ip->second;
-
-	std::string astr = _atomspace_name + encodeAtomToStr(h);
-	dht::InfoHash akey = dht::InfoHash::get(astr);
-	_membership_map[h] = akey;
-	return akey;
+	dht::InfoHash akey;
+	if (_membership_map.get(h, akey)) return akey;
+
+	if (merkle_guids())
+	{
+		dht::InfoHash gkey(get_guid(h));
+		uint8_t buf[2 * dht::HASH_LEN];
+		memcpy(buf, _atomspace_hash.data(), _atomspace_hash.size());
+		memcpy(buf + _atomspace_hash.size(), gkey.data(), gkey.size());
+		akey = dht::InfoHash::get(buf, sizeof(buf));
+	}
+	else
+	{
+		std::string astr = _atomspace_name + encodeAtomToStr(h);
+		akey = dht::InfoHash::get(astr);
+	}
+
+	// merkle_guids() looked up the descriptor, so this is known.
+	if (0 < _locality and h->is_link() and 0 < h->get_arity())
+		place_near(akey, get_membership(h->getOutgoingAtom(0)), _locality);
+	return _membership_map.insert(h, akey);
 }
 
 /* ================================================================== */
@@ -210,26 +321,26 @@ bool DHTAtomStorage::cy_edit_space(dht::InfoHash key,
 	_space_edits++;
 
 	std::string snew = new_val->unpack<std::string>();
-
-#define ADD_ATOM "add "
-#define DROP_ATOM "drop "
-	if (0 == snew.compare(0, sizeof(DROP_ATOM)-1, DROP_ATOM) or
-	    0 == snew.compare(0, sizeof(DROP_ATOM)-1, DROP_ATOM))
+	std::string sold = old_val->unpack<std::string>();
+
+	// An "add" may replace a "drop" and vice-versa, as long as both
+	// are for the same Atom, and the new one is more recent. If DHT
+	// thinks that it is altering the same Atom, but it's not, then we
+	// don't let it.  This is in order to avoid the birthday paradox
+	// resulting in the wrong Atom being deleted. Late-arriving stale
+	// records are refused, so that the most recent one always wins.
+	bool nadd, oadd;
+	double nts, ots;
+	size_t pnew, pold;
+	if (parse_member(snew, nadd, nts, pnew) and
+	    parse_member(sold, oadd, ots, pold))
 	{
-		// If DHT thinks that it is altering the same Atom,
-		// then we let it. Otherwise, we don't.  This is in order
-		// to avoid the birthday paradox resulting in the wrong
-		// Atom being deleted.
-		std::string sold = old_val->unpack<std::string>();
-		size_t pold = sold.find('(');
-		size_t pnew = snew.find('(');
-		// Honor the request, if they are the same atom.
-		if (0 == sold.substr(pold).compare(snew.substr(pnew)))
-			return true;
-		// Not the same atom. Oh nooo.
-		return false;
+		if (0 != sold.compare(pold, std::string::npos, snew, pnew))
+			return false;
+		return ots <= nts;
 	}
 
+	// The shard descriptor is never replaced; the first one wins.
 	// All atoms belonging to the atomspace have a value->id equal to
 	// thier 64-bit atomspace hash. Although 64-bits is large, and even
 	// with the birthday paradox, there still is a 1 in 2^32 chance
@@ -261,6 +372,23 @@ bool DHTAtomStorage::cy_edit_values(dht::InfoHash key,
 	// All values are given the value->id==1 and so all value updates
 	// go through this callback.  Returning `true` here will cause
 	// the old_val to be dropped and replaced by `new_val`.
+	//
+	// Records in the merge format are first merged with `old_val`: a
+	// delta keeps the keys that it does not mention, and the counts of
+	// CountTruthValues add up the shares of all of the writers. See
+	// ValuesMerge.h. Anything that can't be merged just replaces.
+	if (VALUES_BIN_ID != new_val->type or VALUES_BIN_ID != old_val->type)
+		return true;
+	try
+	{
+		ValuesRecord nrec(new_val->unpack<ValuesRecord>());
+		if (DHT_MERGE_VERSION != nrec.v) return true;
+
+		ValuesRecord orec(old_val->unpack<ValuesRecord>());
+		merge_values_record(orec, nrec);
+		new_val->data = dht::Value(VALUES_BIN_ID, orec, new_val->id).data;
+	}
+	catch (const std::exception& ex) {}
 	return true;
 }
 
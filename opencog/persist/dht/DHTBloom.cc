@@ -0,0 +1,236 @@
+/*
+ * DHTBloom.cc
+ * Bloom-filter summaries of the AtomSpace membership shards.
+ *
+ * Fetching an Atom that is not in the AtomSpace costs a full DHT
+ * lookup, which has to wait for every node that might have the key to
+ * say that it does not; this is the slowest kind of lookup there is.
+ * With `bloom=<rate>` in the URI, when the AtomSpace is created, each
+ * membership shard gets a Bloom filter, on a key of its own, holding
+ * the MUIDs of all of the Atoms ever published to that shard. Readers
+ * fetch the filters, keep them, and refresh them every `bloom_refresh`
+ * seconds; an Atom that is in neither the cached filter, nor the
+ * filter of what was published from here, is not in the AtomSpace, and
+ * the lookup is skipped.
+ *
+ * The filters only grow: every writer ORs its own into the one in
+ * the DHT (see cy_edit_bloom()), and so they can be merged over any
+ * number of writers, in any order. Dropped Atoms stay in the filter;
+ * that only costs a lookup. The one way to get a wrong answer is to
+ * ask for an Atom that some other writer published after the filter
+ * was last fetched; thus, other writers' Atoms may take as long as
+ * the refresh period to show up. Overlays don't use the filters, as
+ * an Atom missing from the delta may well be in the base.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <time.h>
+
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+/// The value->id of a filter; there is only one per key.
+#define BLOOM_VID 1
+
+/// Writers put the filters at most this often, in seconds, and
+/// again at every barrier().
+#define BLOOM_PUBLISH_SECS 1
+
+/// Set up the filters, as the shard descriptor says. Called once,
+/// from get_num_shards().
+void DHTAtomStorage::init_bloom(const Layout& lay, size_t nshards)
+{
+	if (0 == lay.bloom_hashes or 0 < _base_name.size()) return;
+
+	std::lock_guard<std::mutex> lck(_bloom_mutex);
+	_bloom_shards.resize(nshards);
+	for (size_t i = 0; i < nshards; i++)
+	{
+		BloomShard& bs = _bloom_shards[i];
+		bs.key = dht::InfoHash::get(_atomspace_name + "#"
+			+ std::to_string(i) + "bloom");
+		bs.local = BloomFilter(lay.bloom_bits, lay.bloom_hashes);
+	}
+}
+
+/* ================================================================ */
+
+/// Add the Atom to the filter of its shard. Called when the Atom is
+/// published to the AtomSpace.
+void DHTAtomStorage::bloom_add(const Handle& h)
+{
+	size_t nshards = get_num_shards();
+	if (_bloom_shards.empty()) return;
+	dht::InfoHash muid = get_membership(h);
+
+	bool due;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		BloomShard& bs = _bloom_shards[h->get_hash() % nshards];
+		bs.local.add(muid);
+		bs.dirty = true;
+		due = _bloom_published + BLOOM_PUBLISH_SECS <= time(0);
+	}
+	if (due) bloom_publish();
+}
+
+/// Put the filters that changed. The DHT nodes OR them into the ones
+/// that they already have.
+void DHTAtomStorage::bloom_publish(void)
+{
+	if (_bloom_shards.empty()) return;
+
+	std::vector<std::pair<dht::InfoHash, BloomRecord>> puts;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		_bloom_published = time(0);
+		for (BloomShard& bs : _bloom_shards)
+		{
+			if (not bs.dirty) continue;
+			BloomRecord rec;
+			rec.k = bs.local.nhashes();
+			rec.b = bs.local.bits();
+			puts.emplace_back(bs.key, std::move(rec));
+			bs.dirty = false;
+		}
+	}
+
+	for (const auto& pr : puts)
+	{
+		touch_key(pr.first, true);
+		queue_put(pr.first, dht::Value(_bloom_policy, pr.second, BLOOM_VID),
+			false);
+	}
+}
+
+/* ================================================================ */
+
+/// Return true if the Atom is certainly not in the AtomSpace; false
+/// if it might be. This never waits on the DHT: if the cached filter
+/// is due for a refresh, the refresh is started, and the answer is
+/// given by the filter that is already here, if any.
+bool DHTAtomStorage::bloom_absent(const Handle& h)
+{
+	if (_observing_only) return false;
+	size_t nshards = get_num_shards();
+	if (_bloom_shards.empty()) return false;
+	dht::InfoHash muid = get_membership(h);
+	size_t i = h->get_hash() % nshards;
+	_num_bloom_checks++;
+
+	bool absent;
+	bool refresh;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		BloomShard& bs = _bloom_shards[i];
+
+		// An empty remote filter says "maybe" to everything.
+		absent = not bs.local.maybe_contains(muid) and
+			not bs.remote.maybe_contains(muid);
+
+		time_t now = time(0);
+		refresh = (bs.fetched + _bloom_refresh <= now);
+		if (refresh) bs.fetched = now;
+	}
+	if (refresh) bloom_fetch(i);
+
+	if (absent) _num_bloom_absent++;
+	return absent;
+}
+
+/// Fetch the filter of the shard, and OR it into the cached one.
+/// Nothing waits for this. The answer may come from a node that
+/// missed some of the puts; as the filters only grow, the cached one
+/// is still good, as far as it goes, and so nothing in it is lost.
+void DHTAtomStorage::bloom_fetch(size_t i)
+{
+	FetchBatchPtr batch;
+	dht::InfoHash key;
+	size_t nbits, nhashes;
+	{
+		std::lock_guard<std::mutex> lck(_bloom_mutex);
+		if (nullptr == _bloom_batch) _bloom_batch = new_batch();
+		batch = _bloom_batch;
+		key = _bloom_shards[i].key;
+		nbits = _bloom_shards[i].local.nbits();
+		nhashes = _bloom_shards[i].local.nhashes();
+	}
+	touch_key(key, true);
+	_num_bloom_fetches++;
+
+	async_get(batch, key, dht::Value::TypeFilter(_bloom_policy),
+		[this, i, nbits, nhashes](ValueVec&& dvals)
+		{
+			// Different nodes may have missed different puts.
+			BloomFilter found;
+			for (const auto& dval : dvals)
+			{
+				try
+				{
+					BloomRecord rec(dval->unpack<BloomRecord>());
+					if (rec.k != nhashes or 8 * rec.b.size() != nbits)
+						continue;
+					BloomFilter bf(std::move(rec.b), rec.k);
+					if (found.empty())
+						found = std::move(bf);
+					else
+						found.merge(bf);
+				}
+				catch (const std::exception& ex)
+				{
+					logger().warn("DHT: bad Bloom filter: %s", ex.what());
+				}
+			}
+			if (found.empty()) return;
+
+			std::lock_guard<std::mutex> lck(_bloom_mutex);
+			BloomShard& bs = _bloom_shards[i];
+			if (bs.remote.empty())
+				bs.remote = std::move(found);
+			else
+				bs.remote.merge(found);
+		});
+}
+
+/* ================================================================ */
+
+bool DHTAtomStorage::cy_store_bloom(dht::InfoHash key,
+                                std::shared_ptr<dht::Value>& value,
+                                const dht::InfoHash& from,
+                                const dht::SockAddr& addr)
+{
+	return true;
+}
+
+/// OR the old filter into the new one, so that what other writers
+/// added is kept. Filters of some other size are junk; they are
+/// refused, and the old one is kept.
+bool DHTAtomStorage::cy_edit_bloom(dht::InfoHash key,
+                              const std::shared_ptr<dht::Value>& old_val,
+                              std::shared_ptr<dht::Value>& new_val,
+                              const dht::InfoHash& from,
+                              const dht::SockAddr& addr)
+{
+	if (BLOOM_ID != new_val->type or BLOOM_ID != old_val->type)
+		return true;
+	try
+	{
+		BloomRecord nrec(new_val->unpack<BloomRecord>());
+		BloomRecord orec(old_val->unpack<BloomRecord>());
+		BloomFilter nbf(std::move(nrec.b), nrec.k);
+		if (not nbf.merge(BloomFilter(std::move(orec.b), orec.k)))
+			return false;
+		nrec.b = nbf.bits();
+		new_val->data = dht::Value(BLOOM_ID, nrec, new_val->id).data;
+	}
+	catch (const std::exception& ex) { return false; }
+	return true;
+}
+
+/* ============================= END OF FILE ================= */
@@ -9,11 +9,20 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/atoms/base/Link.h>
 #include <opencog/atoms/base/Node.h>
 #include <opencog/atomspace/AtomSpace.h>
+#include <opencog/util/Logger.h>
 
 #include "DHTAtomStorage.h"
 
@@ -21,123 +30,438 @@ using namespace opencog;
 
 /* ================================================================ */
 
+/// Load all of the Atoms on the membership keys, with their Values.
+/// If `atom_type` is not NOTYPE, then only Atoms of that type are
+/// loaded. The Atoms are handed to `insert`, in batches. Returns the
+/// number of Atoms loaded.
+///
+/// This is a pipeline of three stages, all running at the same time:
+/// * All of the membership keys are fetched at once. As records
+///   arrive, they are decoded, in chunks, on the dispatcher threads.
+/// * As each Atom is decoded, a lookup for its Values is issued. No
+///   more than `_max_inflight` lookups are handed to OpenDHT at once.
+/// * As the Values arrive, the Atoms are queued; the calling thread
+///   takes them off of the queue, a batch at a time, and inserts
+///   them. Thus, the dispatchers never wait on the AtomSpace.
+///
+/// An Atom may have both "add" and "drop" records, on different keys;
+/// the most recent one wins. Since they arrive in no particular order,
+/// an Atom may be inserted, and then a more recent "drop" shows up.
+/// Such Atoms are handed to `remove`.
+///
+/// The batch timeout is reset every time some lookup completes, so
+/// large AtomSpaces do not time out. With `partial=1` in the URI, a
+/// lookup that times out (a slow shard, or the Values of some Atom)
+/// is skipped, with a warning, instead of failing the whole load.
+size_t DHTAtomStorage::load_members(const std::vector<dht::InfoHash>& keys,
+                                    Type atom_type,
+                                    const std::function<void(const HandleSeq&)>& insert,
+                                    const std::function<void(const HandleSeq&)>& remove)
+{
+	// The most recent record seen, for each Atom.
+	struct Member
+	{
+		double ts;
+		bool added;
+		bool inserted;
+	};
+	StripedMap<Handle, Member> members;
+
+	std::mutex ready_mtx;
+	HandleSeq ready;
+	HandleSeq dropped;
+
+	FetchBatchPtr batch(new_batch());
+	batch->partial = _partial_loads;
+	MemberCallback got_member =
+		[&, batch](const Handle& h, bool added, double ts)
+	{
+		if (NOTYPE != atom_type and h->get_type() != atom_type) return;
+
+		bool fetch = added;
+		bool undo = false;
+		if (not members.try_insert(h, Member{ts, added, false}))
+		{
+			fetch = false;
+			members.update(h, [&](Member& m)
+			{
+				if (ts <= m.ts) return;
+				fetch = added and not m.added;
+				undo = not added and m.inserted;
+				m.ts = ts;
+				m.added = added;
+				if (undo) m.inserted = false;
+			});
+		}
+
+		if (undo)
+		{
+			std::lock_guard<std::mutex> lck(ready_mtx);
+			dropped.push_back(h);
+		}
+		if (not fetch) return;
+
+		async_fetch_values(batch, h,
+			[&ready_mtx, &ready](const Handle& hv)
+			{
+				std::lock_guard<std::mutex> lck(ready_mtx);
+				ready.push_back(hv);
+			});
+	};
+	for (const dht::InfoHash& key : keys)
+		foreach_member(batch, key, got_member);
+
+#define LOAD_POLL std::chrono::milliseconds(50)
+#define LOAD_REPORT std::chrono::seconds(5)
+	auto start = std::chrono::steady_clock::now();
+	auto report = start + LOAD_REPORT;
+	size_t loaded = 0;
+	bool done = false;
+	while (not done)
+	{
+		// If this throws, no more callbacks will run, and so no one
+		// else is looking at `ready`.
+		done = wait_batch_until(batch,
+			std::chrono::steady_clock::now() + LOAD_POLL);
+
+		HandleSeq chunk;
+		HandleSeq undo;
+		{
+			std::lock_guard<std::mutex> lck(ready_mtx);
+			chunk.swap(ready);
+			undo.swap(dropped);
+		}
+
+		// Skip anything dropped while its Values were being fetched.
+		// The check and the flag are set together, under the map
+		// lock, so that a drop arriving later will see the flag.
+		HandleSeq keep;
+		keep.reserve(chunk.size());
+		for (const Handle& h : chunk)
+			members.update(h, [&](Member& m)
+			{
+				if (not m.added or m.inserted) return;
+				m.inserted = true;
+				keep.push_back(h);
+			});
+
+		insert(keep);
+		if (0 < undo.size()) remove(undo);
+		loaded += keep.size();
+		loaded -= std::min(loaded, undo.size());
+		_load_count += keep.size();
+
+		auto now = std::chrono::steady_clock::now();
+		if (report <= now and not done)
+		{
+			std::chrono::duration<double> secs = now - start;
+			size_t pending;
+			{
+				std::lock_guard<std::mutex> blck(batch->mtx);
+				pending = batch->pending;
+			}
+			printf("\tLoaded %zu atoms in %.1f seconds (%.0f per second); "
+			       "%zu lookups pending\n",
+			       loaded, secs.count(), loaded / secs.count(), pending);
+			report = now + LOAD_REPORT;
+		}
+	}
+
+	size_t incomplete;
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		incomplete = batch->incomplete;
+	}
+	if (0 < incomplete)
+		logger().warn("DHT: load is partial; %zu lookups timed out",
+			incomplete);
+
+	return loaded;
+}
+
 /// load_atomspace -- load the AtomSpace with the given name.
 void DHTAtomStorage::load_atomspace(AtomSpace* as,
                                     const std::string& spacename)
 {
-	size_t start_count = _load_count;
 	printf("Loading all atoms from %s\n", spacename.c_str());
-	time_t bulk_start = time(0);
+	auto start = std::chrono::steady_clock::now();
 
+	// The membership is spread over the shards, plus the AtomSpace
+	// key itself, for Atoms written before sharding was introduced.
 	dht::InfoHash space_hash = dht::InfoHash::get(spacename);
+	size_t nshards = (spacename == _atomspace_name) ?
+		get_num_shards() : fetch_num_shards(space_hash);
+	std::vector<dht::InfoHash> keys = get_shard_keys(spacename, nshards);
+	keys.push_back(space_hash);
 
-	// XXX FIXME, when working on the Atomspace, we need
-	// a longer timeout!?!!!
-	std::cout << "Start waiting for atomspace" << std::endl;
-	auto atovs = get_stuff(space_hash);
-	std::cout << "Done waiting for atomspace" << std::endl;
-
-	for (auto ato: atovs)
+	// An overlay is loaded together with its base; the drops in the
+	// overlay are more recent than the adds in the base.
+	if (spacename == _atomspace_name and 0 < _base_name.size())
 	{
-		std::string sname = ato->unpack<std::string>();
-
-		// Currently, the format is the string "add" or "drop",
-		// followed by a timestamp, followed by the scheme string.
-		// Ignore anything that doesn't start with "add"
-#define ADD_ATOM "add "
-	   if (sname.compare(0, sizeof(ADD_ATOM)-1, ADD_ATOM))
-			continue;
-
-		std::cout << "Load Atom " << sname << std::endl;
-		// pos is always 22 because the prefix is "add 1572978874.801600 "
-		// at least it will be for the next bijillion seconds.
-		// size_t pos = sname.find('(');
-		size_t pos = sizeof("add 1572978874.801600");
-		Handle h(decodeStrAtom(sname, pos));
-		as->add_atom(fetch_values(std::move(h)));
-		_load_count++;
+		std::vector<dht::InfoHash> bkeys = get_base_keys(NOTYPE);
+		keys.insert(keys.end(), bkeys.begin(), bkeys.end());
 	}
 
-	time_t secs = time(0) - bulk_start;
-	double rate = ((double) _load_count) / secs;
-	printf("Finished loading %zu atoms in total in %d seconds (%d per second)\n",
-		(_load_count - start_count), (int) secs, (int) rate);
+	size_t loaded = load_members(keys, NOTYPE,
+		[as](const HandleSeq& hs)
+		{
+			for (const Handle& h : hs)
+				as->add_atom(h);
+		},
+		[as](const HandleSeq& hs)
+		{
+			for (const Handle& h : hs)
+				as->extract_atom(h);
+		});
+
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+	double rate = (0.0 < secs.count()) ? loaded / secs.count() : 0.0;
+	printf("Finished loading %zu atoms in total in %.1f seconds (%.0f per second)\n",
+		loaded, secs.count(), rate);
 
 	// synchrnonize!
 	as->barrier();
 }
 
-/// A copy of the above.
-/// Inefficient, but it works. We could solve the inefficiency
-/// by maintaining an index of atoms-by-type in the DHT. This
-/// would certainly push more crap into the DHT ... is it worth
-/// it, to have this index?
+/// Load all Atoms of the given type. This uses the per-type
+/// membership index, if the AtomSpace has one. Otherwise, for
+/// AtomSpaces created before the index existed, the entire
+/// AtomSpace is fetched, and filtered by type. Inefficient, but
+/// it works.
 ///
 void DHTAtomStorage::loadType(AtomTable &table, Type atom_type)
 {
-	// XXX FIXME, when working on the Atomspace, we need
-	// a longer timeout!?!!!
-	std::cout << "Start waiting for atomspace" << std::endl;
-	auto atovs = get_stuff(_atomspace_hash);
-	std::cout << "Done waiting for atomspace, got "
-	          << std::to_string(atovs.size()) << std::endl;
-
-	for (auto ato: atovs)
+	size_t nshards = get_num_shards();
+	std::vector<dht::InfoHash> keys;
+	if (_type_index)
+		keys = get_type_shard_keys(_atomspace_name, atom_type, nshards);
+	else
 	{
-		std::string sname = ato->unpack<std::string>();
+		keys = get_shard_keys(_atomspace_name, nshards);
+		keys.push_back(_atomspace_hash);
+	}
+	if (0 < _base_name.size())
+	{
+		std::vector<dht::InfoHash> bkeys = get_base_keys(atom_type);
+		keys.insert(keys.end(), bkeys.begin(), bkeys.end());
+	}
 
-		// See comments above.
-	   if (sname.compare(0, sizeof(ADD_ATOM)-1, ADD_ATOM))
-			continue;
+	load_members(keys, atom_type,
+		[&table](const HandleSeq& hs)
+		{
+			for (const Handle& h : hs)
+				table.add(h, false);
+		},
+		[&table](const HandleSeq& hs)
+		{
+			for (const Handle& h : hs)
+				table.getAtomSpace()->extract_atom(h);
+		});
+}
+
+/// Sort the Atoms, and everything that they hold, into levels: Nodes
+/// are at level zero, and Links are one level above the highest Atom
+/// that they hold. Each Atom appears once, no matter how many times
+/// it is held. Atoms for which `stop` is true are left out, and so is
+/// whatever they hold, unless it is also held by something else.
+std::vector<HandleSeq>
+DHTAtomStorage::sort_levels(const HandleSeq& roots,
+                            const std::function<bool(const Handle&)>& stop)
+{
+	// One more than the level that the Atom is at; zero if left out.
+	std::unordered_map<Handle, size_t> levmap;
+	std::vector<HandleSeq> levels;
+	std::function<size_t(const Handle&)> get_level =
+		[&](const Handle& h)->size_t
+	{
+		const auto& lv = levmap.find(h);
+		if (levmap.end() != lv) return lv->second;
+		if (stop(h))
+		{
+			levmap.emplace(h, 0);
+			return 0;
+		}
 
-		size_t pos = sizeof("add 1572978874.801600");
-		Handle h(decodeStrAtom(sname, pos));
-		if (h->get_type() != atom_type) continue;
+		size_t lev = 0;
+		if (h->is_link())
+			for (const Handle& ho : h->getOutgoingSet())
+				lev = std::max(lev, get_level(ho));
 
-		// std::cout << "Load Atom " << sname << std::endl;
-		table.add(fetch_values(std::move(h)), false);
-		_load_count++;
-	}
+		levmap.emplace(h, lev+1);
+		if (levels.size() <= lev) levels.resize(lev+1);
+		levels[lev].push_back(h);
+		return lev+1;
+	};
+	for (const Handle& h : roots) get_level(h);
+	return levels;
 }
 
-/// Store all of the atoms in the atom table.
-void DHTAtomStorage::storeAtomSpace(const AtomTable &table)
+/// Store one level. All of the Atoms in it are independent of
+/// one-another, and so are split across a pool of worker threads,
+/// which do the hashing, encoding and queueing of the puts in
+/// parallel. The incoming-set records for the newly-published Links
+/// are gathered up, and queued after all of the Links are.
+void DHTAtomStorage::store_level(const HandleSeq& hs, size_t nthreads,
+                         const std::function<bool(const Handle&)>& with_values,
+                         bool publish, std::vector<size_t>& wcount,
+                         std::vector<double>& wsecs)
 {
-	logger().info("Bulk store of AtomSpace\n");
+	std::vector<IncomingPuts> wputs(nthreads);
+	std::string error;
+	std::mutex errmtx;
 
-	size_t cnt = 0;
-	time_t bulk_start = time(0);
+	// There's no need to flush every so often; the store queue
+	// paces the puts, so that OpenDHT does not fall behind.
+	auto work = [&](size_t w)
+	{
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			for (size_t i = w; i < hs.size(); i += nthreads)
+			{
+				const Handle& h = hs[i];
+				if (with_values(h)) store_atom_values(h);
+				wcount[w]++;
+				if (not publish or not publish_to_atomspace(h)) continue;
+				if (h->is_node())
+				{
+					_num_node_inserts++;
+					continue;
+				}
+
+				dht::InfoHash holderguid = get_guid(h);
+				const HandleSeq& oset = h->getOutgoingSet();
+				for (size_t j = 0; j < oset.size(); j++)
+					if (not held_before(oset, j))
+						wputs[w][oset[j]].emplace_back(
+							incoming_value(holderguid, h));
+				_num_link_inserts++;
+			}
+		}
+		catch (const std::exception& ex)
+		{
+			std::lock_guard<std::mutex> lck(errmtx);
+			if (error.empty()) error = ex.what();
+		}
+		std::chrono::duration<double> dt =
+			std::chrono::steady_clock::now() - start;
+		wsecs[w] += dt.count();
+	};
+
+	std::vector<std::thread> pool;
+	size_t nwork = std::min(nthreads, hs.size());
+	for (size_t w = 1; w < nwork; w++)
+		pool.emplace_back(work, w);
+	work(0);
+	for (std::thread& t : pool) t.join();
+
+	if (not error.empty())
+		throw RuntimeException(TRACE_INFO, "%s", error.c_str());
+
+	// A hub, held by many Links, gets all of their records at once.
+	IncomingPuts puts(std::move(wputs[0]));
+	for (size_t w = 1; w < nthreads; w++)
+		for (auto& pr : wputs[w])
+		{
+			std::vector<dht::Value>& vals = puts[pr.first];
+			std::move(pr.second.begin(), pr.second.end(),
+				std::back_inserter(vals));
+		}
+	store_incoming(std::move(puts), nthreads);
+}
+
+/// Queue the incoming-set records, one key at a time, on a pool of
+/// worker threads.
+void DHTAtomStorage::store_incoming(IncomingPuts&& puts, size_t nthreads)
+{
+	if (puts.empty()) return;
+	std::vector<std::pair<Handle, std::vector<dht::Value>>> todo(
+		std::make_move_iterator(puts.begin()),
+		std::make_move_iterator(puts.end()));
+	puts.clear();
 
-	auto storat = [&](const Handle& h)->void
+	std::string error;
+	std::mutex errmtx;
+	auto work = [&](size_t w)
 	{
-		storeAtom(h);
-		cnt++;
-		if (0 == cnt%500)
+		try
 		{
-			// Force DHT to flush pending queues every so often.
-			// Otherwise, the user perceives a hang. Worse, failure
-			// to flush often enough does TWO bad things: it wrecks
-			// performance, and also causes OpenDHT to print message
-			// "Dropped NNN packets with high delay".  Yow!!
-			// On my system, 500 seems to be the magic number.
-			barrier();
+			for (size_t i = w; i < todo.size(); i += nthreads)
+				queue_puts(get_membership(todo[i].first),
+					std::move(todo[i].second));
 		}
-		if (0 == cnt%1000)
+		catch (const std::exception& ex)
 		{
-			time_t now = time(0);
-			time_t elap = now - bulk_start;
-			if (0 < elap)
-			{
-				double rate = ((double) cnt) / elap;
-				printf("\tStored %zu atoms in %d seconds (%d per second)\n",
-				       cnt, (int) elap, (int) rate);
-			}
+			std::lock_guard<std::mutex> lck(errmtx);
+			if (error.empty()) error = ex.what();
 		}
 	};
 
-	// Try to knock out the nodes first, then the links.
-	table.foreachHandleByType(storat, NODE, true);
-	table.foreachHandleByType(storat, LINK, true);
+	std::vector<std::thread> pool;
+	size_t nwork = std::min(nthreads, todo.size());
+	for (size_t w = 1; w < nwork; w++)
+		pool.emplace_back(work, w);
+	work(0);
+	for (std::thread& t : pool) t.join();
+
+	if (not error.empty())
+		throw RuntimeException(TRACE_INFO, "%s", error.c_str());
+}
+
+/// Store all of the atoms in the atom table.
+///
+/// The Atoms are sorted into levels, which are stored in order, so
+/// that the leaves are published before the Links that hold them.
+/// See store_level().
+void DHTAtomStorage::storeAtomSpace(const AtomTable &table)
+{
+	logger().info("Bulk store of AtomSpace\n");
+	time_t bulk_start = time(0);
+
+	HandleSeq all;
+	table.foreachHandleByType(
+		[&](const Handle& h)->void { all.push_back(h); }, ATOM, true);
+	std::vector<HandleSeq> levels(sort_levels(all,
+		[](const Handle&) { return false; }));
+	all.clear();
+
+	size_t nthreads = get_param("store_threads",
+		(size_t) std::max(1U, std::thread::hardware_concurrency()));
+	if (0 == nthreads) nthreads = 1;
+
+	std::vector<size_t> wcount(nthreads, 0);
+	std::vector<double> wsecs(nthreads, 0.0);
+	size_t cnt = 0;
+
+	for (size_t lev = 0; lev < levels.size(); lev++)
+	{
+		const HandleSeq& hs = levels[lev];
+		store_level(hs, nthreads, [](const Handle&) { return true; },
+			true, wcount, wsecs);
+
+		cnt += hs.size();
+		time_t elap = time(0) - bulk_start;
+		printf("\tStored level %zu: %zu atoms; %zu total in %d seconds\n",
+		       lev, hs.size(), cnt, (int) elap);
+	}
+
+	// The workers only count; the rates are printed from here, one
+	// line per worker, and then the spread, which shows how evenly
+	// the levels were split.
+	double slowest = 0.0;
+	double fastest = 0.0;
+	for (size_t w = 0; w < nthreads; w++)
+	{
+		double rate = (0.0 < wsecs[w]) ? wcount[w] / wsecs[w] : 0.0;
+		printf("\tWorker %zu stored %zu atoms (%d per second)\n",
+		       w, wcount[w], (int) rate);
+		if (0.0 == wsecs[w]) continue;
+		if (0.0 == slowest or rate < slowest) slowest = rate;
+		if (fastest < rate) fastest = rate;
+	}
+	printf("\t%zu workers stored %d to %d atoms per second each\n",
+	       nthreads, (int) slowest, (int) fastest);
 
 	barrier();
 	time_t secs = time(0) - bulk_start;
@@ -146,6 +470,45 @@ void DHTAtomStorage::storeAtomSpace(const AtomTable &table)
 		cnt, (int) secs, (int) rate);
 }
 
+/**
+ * Store the Atoms, with their Values, and everything that they hold,
+ * as storeAtom() would, one after the other, but in one pass. Atoms
+ * held by several of them, or several times, are stored just once;
+ * Atoms already published are skipped, along with whatever they
+ * hold. The incoming-set records that go on the same Atom are queued
+ * together. The biggest win is for hubs, which are held by very many
+ * Links: each of those records is still sent, but the hub itself is
+ * not revisited, once per Link.
+ */
+void DHTAtomStorage::storeAtoms(const HandleSeq& hs, bool synchronous)
+{
+	if (_observing_only)
+		throw IOException(TRACE_INFO, "DHT Node is only observing!");
+
+	std::unordered_set<Handle> given(hs.begin(), hs.end());
+	HandleSeq values_only;
+	std::vector<HandleSeq> levels(sort_levels(hs,
+		[&](const Handle& h)
+		{
+			if (not _published.contains(h)) return false;
+			if (given.count(h)) values_only.push_back(h);
+			return true;
+		}));
+
+	size_t nthreads = get_param("store_threads",
+		(size_t) std::max(1U, std::thread::hardware_concurrency()));
+	if (0 == nthreads) nthreads = 1;
+	std::vector<size_t> wcount(nthreads, 0);
+	std::vector<double> wsecs(nthreads, 0.0);
+
+	auto is_given = [&given](const Handle& h) { return 0 < given.count(h); };
+	store_level(values_only, nthreads, is_given, false, wcount, wsecs);
+	for (const HandleSeq& level : levels)
+		store_level(level, nthreads, is_given, true, wcount, wsecs);
+
+	if (synchronous) barrier();
+}
+
 void DHTAtomStorage::loadAtomSpace(AtomTable &table)
 {
 	load_atomspace(table.getAtomSpace(), _atomspace_name);
@@ -0,0 +1,501 @@
+/*
+ * DHTFetch.cc
+ * Asynchronous, callback-driven fetch engine.
+ *
+ * Every DHT lookup is issued with the callback version of
+ * `DhtRunner::get()`. The OpenDHT thread does nothing more than to
+ * accumulate the values, and, when the lookup is done, to place it on
+ * the done-queue. A dispatcher thread pulls lookups off of the
+ * done-queue, and runs the user callback. The callback is free to
+ * issue more lookups (e.g. for Values, after an Atom is decoded);
+ * these are placed onto the same batch, so that the batch is done only
+ * when the entire tree of dependent lookups is done.
+ *
+ * At most `_max_inflight` lookups are handed to OpenDHT at any given
+ * time; the remainder wait in the lookup-queue. This avoids flooding
+ * the network (and the OpenDHT RX queues) during bulk loads.
+ *
+ * There may be several dispatcher threads; the callbacks must be
+ * thread-safe. Big chunks of work (such as decoding a membership
+ * shard) can be split up with async_run(), so that they are spread
+ * across all of the dispatchers.
+ *
+ * A lookup is not sent again while OpenDHT is still working on it:
+ * OpenDHT folds a second get on the same key into the search that is
+ * already running, and so it would reach no one new. A lookup that
+ * OpenDHT reports as failed is sent again, after the retransmit
+ * timeout (see get_rto()), as a new search; that gives the routing
+ * table time to settle. A lookup that goes without any answer for
+ * `_wait_time` is given up on: the batch fails, unless it is a partial
+ * batch, in which case the lookup is finished with what it has, and
+ * the batch goes on without it. Streamed lookups are sent only once,
+ * as the values would arrive more than once.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <algorithm>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+// How often the watcher looks at the lookups in flight.
+#define WATCH_TICK std::chrono::milliseconds(5)
+
+DHTAtomStorage::FetchBatchPtr DHTAtomStorage::new_batch(void)
+{
+	FetchBatchPtr batch(std::make_shared<FetchBatch>());
+	batch->progress = std::chrono::steady_clock::now();
+	return batch;
+}
+
+/// Wait until all lookups in the batch have completed, and all
+/// callbacks have run. Throws if some lookup went unanswered for
+/// `_wait_time` (unless the batch is partial), if the DHT stops
+/// making progress on the batch for twice that long, or if any of
+/// the callbacks threw. After this returns (or throws), no callbacks
+/// belonging to this batch will be run; thus, the callbacks may
+/// safely reference the caller's stack.
+void DHTAtomStorage::wait_batch(const FetchBatchPtr& batch)
+{
+	while (not wait_batch_until(batch,
+		std::chrono::steady_clock::now() + _wait_time)) {}
+}
+
+/// Same as above, but give up waiting at time `until`, returning
+/// false if the batch is not yet done. This does not cancel the
+/// batch; the callbacks keep running. It still throws if the DHT
+/// has stopped making progress, or if any of the callbacks threw.
+bool DHTAtomStorage::wait_batch_until(const FetchBatchPtr& batch,
+                                      std::chrono::steady_clock::time_point until)
+{
+	std::unique_lock<std::mutex> lck(batch->mtx);
+	while (0 < batch->pending or batch->timed_out)
+	{
+		// The lookups time out on their own; this is for the lookups
+		// still waiting to be sent, and for callbacks that hang.
+		auto deadline = batch->progress + 2 * _wait_time;
+		if (batch->timed_out or deadline <= std::chrono::steady_clock::now())
+		{
+			batch->cancelled = true;
+			batch->cv.wait(lck, [&batch]{ return 0 == batch->running; });
+			_num_timeouts++;
+			throw IOException(TRACE_INFO, "DHT is not responding!");
+		}
+		if (until <= std::chrono::steady_clock::now()) return false;
+		batch->cv.wait_until(lck, std::min(deadline, until));
+	}
+
+	if (not batch->error.empty())
+		throw RuntimeException(TRACE_INFO, "%s", batch->error.c_str());
+	return true;
+}
+
+/* ================================================================ */
+
+/// Ask the DHT for all values on the key, passing the filter.
+/// The callback will be called exactly once, from the dispatcher
+/// thread, with all of the values that were found.
+void DHTAtomStorage::async_get(const FetchBatchPtr& batch,
+                               const dht::InfoHash& key,
+                               const dht::Value::Filter& filter,
+                               GotCallback&& cb,
+                               bool stream)
+{
+	LookupPtr lk(std::make_shared<Lookup>());
+	lk->batch = batch;
+	lk->key = key;
+	lk->filter = filter;
+	lk->cb = std::move(cb);
+	lk->stream = stream;
+
+	{
+		// A batch may sit idle for a while between lookups; don't
+		// count the idle time against the DHT.
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		if (0 == batch->pending)
+			batch->progress = std::chrono::steady_clock::now();
+		batch->pending++;
+	}
+
+	std::unique_lock<std::mutex> lck(_lookup_mutex);
+	if (_max_inflight <= _inflight)
+	{
+		_lookup_queue.push_back(lk);
+		return;
+	}
+	_inflight++;
+	lck.unlock();
+
+	start_lookup(lk);
+}
+
+/// Same as async_get(), except that the callback is called as the
+/// values arrive, instead of once, at the end. It may be called any
+/// number of times (including zero times, if nothing was found), and
+/// from several dispatcher threads at once. Nothing has to wait for
+/// the slowest DHT node to answer; and the values need not all be
+/// held in RAM at the same time.
+void DHTAtomStorage::async_stream(const FetchBatchPtr& batch,
+                                  const dht::InfoHash& key,
+                                  const dht::Value::Filter& filter,
+                                  GotCallback&& cb)
+{
+	async_get(batch, key, filter, std::move(cb), true);
+}
+
+/// Run the function on a dispatcher thread, as a part of the batch.
+void DHTAtomStorage::async_run(const FetchBatchPtr& batch,
+                               std::function<void()>&& fn)
+{
+	LookupPtr lk(std::make_shared<Lookup>());
+	lk->batch = batch;
+	lk->local = true;
+	lk->cb = [fn](ValueVec&&) { fn(); };
+
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		if (0 == batch->pending)
+			batch->progress = std::chrono::steady_clock::now();
+		batch->pending++;
+	}
+
+	std::unique_lock<std::mutex> lck(_lookup_mutex);
+	_done_queue.push_back(lk);
+	lck.unlock();
+	_dispatch_cv.notify_one();
+}
+
+/// Hand the lookup to OpenDHT, and start watching it.
+void DHTAtomStorage::start_lookup(const LookupPtr& lk)
+{
+	lk->started = std::chrono::steady_clock::now();
+	lk->alive = lk->started;
+	{
+		std::lock_guard<std::mutex> lck(_lookup_mutex);
+		_watched.push_back(lk);
+	}
+	start_attempt(lk);
+}
+
+/// Send the lookup (again). The callbacks here run in the OpenDHT
+/// thread, and so must not do anything more than stash the results
+/// (or, when streaming, queue them for dispatch).
+void DHTAtomStorage::start_attempt(const LookupPtr& lk)
+{
+	size_t n;
+	{
+		std::lock_guard<std::mutex> llck(lk->mtx);
+		if (lk->finished) return;
+		n = lk->tries.size();
+		lk->tries.emplace_back();
+		lk->outstanding++;
+		lk->retry = false;
+		lk->sent = std::chrono::steady_clock::now();
+	}
+
+	dht::GetCallback gcb =
+		[this, lk, n](const ValueVec& vals)->bool
+		{
+			std::unique_lock<std::mutex> llck(lk->mtx);
+			if (lk->finished) return false;
+			lk->alive = std::chrono::steady_clock::now();
+			if (0 == lk->vtype and 0 < vals.size())
+				lk->vtype = vals[0]->type;
+			if (lk->stream)
+			{
+				llck.unlock();
+				auto got = std::make_shared<ValueVec>(vals);
+				async_run(lk->batch, [lk, got]() { lk->cb(std::move(*got)); });
+				return true;
+			}
+			lk->tries[n].insert(lk->tries[n].end(), vals.begin(), vals.end());
+			return true;
+		};
+
+	dht::DoneCallbackSimple dcb =
+		[this, lk, n](bool ok) { attempt_done(lk, n, ok); };
+
+	_runner.get(lk->key, gcb, dcb, lk->filter);
+}
+
+/// The attempt is done. A failed attempt is sent again, after the
+/// retransmit timeout (or half of `_wait_time`, if that's shorter),
+/// unless it has been sent `_get_tries` times
+/// already; then, the lookup fails, with the most values that any of
+/// the attempts found.
+void DHTAtomStorage::attempt_done(const LookupPtr& lk, size_t n, bool ok)
+{
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::microseconds rto;
+	{
+		std::lock_guard<std::mutex> lck(_lookup_mutex);
+		rto = get_rto();
+	}
+
+	std::chrono::steady_clock::duration rtt;
+	{
+		std::lock_guard<std::mutex> llck(lk->mtx);
+		lk->outstanding--;
+		if (lk->finished) return;
+		rtt = now - lk->sent;
+		if (not ok and not lk->stream and lk->tries.size() < _get_tries)
+		{
+			// Failing is an answer, too. Until the round-trip time has
+			// been measured, the timeout is `_wait_time`; don't wait
+			// that long, else the lookup expires, instead.
+			lk->alive = now;
+			lk->retry = true;
+			lk->retry_at = now + std::min(rto,
+				std::chrono::microseconds(_wait_time) / 2);
+			return;
+		}
+		lk->finished = true;
+		if (ok)
+			lk->vals = std::move(lk->tries[n]);
+		else
+			for (ValueVec& vals : lk->tries)
+				if (lk->vals.size() < vals.size()) lk->vals = std::move(vals);
+	}
+
+	_get_latency[metric_of(lk->vtype)].record(now - lk->started);
+	if (not ok) _num_gets_failed++;
+
+	// The attempts are made one after another, and so the one that
+	// succeeded is the one that answered.
+	if (ok)
+	{
+		std::lock_guard<std::mutex> lck(_lookup_mutex);
+		_rtt.sample(rtt);
+	}
+	lookup_done(lk);
+}
+
+/// Nothing was heard for too long; give up, keeping whatever values
+/// have arrived.
+void DHTAtomStorage::expire_lookup(const LookupPtr& lk)
+{
+	{
+		std::lock_guard<std::mutex> llck(lk->mtx);
+		if (lk->finished) return;
+		lk->finished = true;
+		lk->expired = true;
+		for (ValueVec& vals : lk->tries)
+			if (lk->vals.size() < vals.size()) lk->vals = std::move(vals);
+	}
+
+	_get_latency[metric_of(lk->vtype)].record(
+		std::chrono::steady_clock::now() - lk->started);
+	_num_gets_expired++;
+	logger().debug("DHT: lookup of %s timed out", lk->key.toString().c_str());
+	lookup_done(lk);
+}
+
+/// Queue the finished lookup for dispatch.
+void DHTAtomStorage::lookup_done(const LookupPtr& lk)
+{
+	std::lock_guard<std::mutex> lck(_lookup_mutex);
+	_done_queue.push_back(lk);
+	_dispatch_cv.notify_one();
+}
+
+/* ================================================================ */
+
+/// The retransmit timeout, between `_min_rto` and `_wait_time`. Until
+/// something has been measured, it is `_wait_time`. Call with the
+/// lookup mutex held.
+std::chrono::microseconds DHTAtomStorage::get_rto(void)
+{
+	return _rtt.rto(_min_rto, _wait_time);
+}
+
+/// The watcher thread. Send again the lookups that failed, once the
+/// retransmit timeout has passed, and give up on the ones that went
+/// unanswered for too long.
+void DHTAtomStorage::watch_loop(void)
+{
+	std::unique_lock<std::mutex> lck(_lookup_mutex);
+	while (true)
+	{
+		_watch_cv.wait_for(lck, WATCH_TICK, [this] { return _watch_stop; });
+		if (_watch_stop) return;
+
+		_watched.erase(std::remove_if(_watched.begin(), _watched.end(),
+			[](const LookupPtr& lk) { return lk->finished.load(); }),
+			_watched.end());
+		if (_watched.empty()) continue;
+
+		std::vector<LookupPtr> watched(_watched);
+		lck.unlock();
+
+		auto now = std::chrono::steady_clock::now();
+		std::vector<LookupPtr> resend;
+		std::vector<LookupPtr> expire;
+		for (const LookupPtr& lk : watched)
+		{
+			std::lock_guard<std::mutex> llck(lk->mtx);
+			if (lk->finished) continue;
+			if (lk->alive + _wait_time <= now)
+			{
+				expire.push_back(lk);
+				continue;
+			}
+
+			if (lk->retry and lk->retry_at <= now)
+				resend.push_back(lk);
+		}
+
+		for (const LookupPtr& lk : expire)
+			expire_lookup(lk);
+
+		for (const LookupPtr& lk : resend)
+		{
+			_num_gets_retried++;
+			start_attempt(lk);
+		}
+		lck.lock();
+	}
+}
+
+/// Run the callback of a completed lookup, and then mark it done.
+/// The callback runs before the pending count is decremented, so
+/// that any lookups it issues keep the batch alive. Streamed values
+/// have already been handed over, as they arrived.
+void DHTAtomStorage::finish_lookup(const LookupPtr& lk)
+{
+	const FetchBatchPtr& batch = lk->batch;
+
+	// Only a partial batch goes on without the lookup.
+	bool skip = false;
+	if (lk->expired)
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		batch->incomplete++;
+		if (not batch->partial)
+		{
+			batch->timed_out = true;
+			skip = true;
+		}
+	}
+	if (not lk->stream and not skip)
+		run_callback(batch, [&lk]() { lk->cb(std::move(lk->vals)); });
+
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		batch->pending--;
+		batch->progress = std::chrono::steady_clock::now();
+	}
+	batch->cv.notify_all();
+}
+
+/// Run a callback on behalf of a batch, unless the batch has been
+/// abandoned. Exceptions are recorded in the batch, and are re-thrown
+/// to the waiter.
+void DHTAtomStorage::run_callback(const FetchBatchPtr& batch,
+                                  const std::function<void()>& fn)
+{
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		if (batch->cancelled) return;
+		batch->running++;
+	}
+
+	try
+	{
+		fn();
+	}
+	catch (const std::exception& ex)
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		if (batch->error.empty())
+			batch->error = ex.what();
+	}
+
+	{
+		std::lock_guard<std::mutex> blck(batch->mtx);
+		batch->running--;
+	}
+	batch->cv.notify_all();
+}
+
+/// The dispatcher threads. Pull completed lookups off of the queue,
+/// refill the in-flight window, and run the callbacks.
+void DHTAtomStorage::dispatch_loop(void)
+{
+	std::unique_lock<std::mutex> lck(_lookup_mutex);
+	while (true)
+	{
+		_dispatch_cv.wait(lck, [this]
+			{ return _dispatch_stop or not _done_queue.empty(); });
+		if (_dispatch_stop) return;
+
+		LookupPtr lk(_done_queue.front());
+		_done_queue.pop_front();
+		if (not lk->local) _inflight--;
+
+		std::vector<LookupPtr> ready;
+		while (_inflight < _max_inflight and not _lookup_queue.empty())
+		{
+			ready.push_back(_lookup_queue.front());
+			_lookup_queue.pop_front();
+			_inflight++;
+		}
+		lck.unlock();
+
+		for (const LookupPtr& rdy : ready)
+			start_lookup(rdy);
+
+		finish_lookup(lk);
+		lck.lock();
+	}
+}
+
+/* ================================================================ */
+
+/// Blocking get. Wait for the lookup to complete, and return all of
+/// the values found on the key.
+DHTAtomStorage::ValueVec
+DHTAtomStorage::get_stuff(const dht::InfoHash& ihash,
+                          const dht::Value::Filter& filter)
+{
+	ValueVec vals;
+	FetchBatchPtr batch(new_batch());
+	async_get(batch, ihash, filter,
+		[&vals](ValueVec&& got) { vals = std::move(got); });
+	wait_batch(batch);
+	return vals;
+}
+
+/* ================================================================ */
+
+/// Write-through to the on-disk cache, if there is one. Everything
+/// put into, or gotten from the DHT should pass through here, so that
+/// the disk copy stays as fresh as what we've seen.
+void DHTAtomStorage::disk_cache_put(const dht::InfoHash& key,
+                                    const dht::Value& val)
+{
+	if (_disk_cache) _disk_cache->put(key, val);
+}
+
+void DHTAtomStorage::disk_cache_put(const dht::InfoHash& key,
+                                    const ValueVec& vals)
+{
+	if (nullptr == _disk_cache) return;
+	for (const auto& val : vals) _disk_cache->put(key, *val);
+}
+
+/// Look up the key in the on-disk cache, if there is one.
+bool DHTAtomStorage::disk_cache_get(const dht::InfoHash& key,
+                                    ValueVec& vals)
+{
+	if (nullptr == _disk_cache) return false;
+	return _disk_cache->get(key, vals);
+}
+
+/* ============================= END OF FILE ================= */
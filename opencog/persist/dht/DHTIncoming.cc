@@ -8,6 +8,7 @@
 #include <stdlib.h>
 
 #include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/atom_types/NameServer.h>
 
 #include "DHTAtomStorage.h"
 
@@ -15,48 +16,188 @@ using namespace opencog;
 
 /* ================================================================== */
 /**
- * Retreive the entire incoming set of the indicated atom.
- * This fetches the Atoms in the incoming set; the ValueSaveUTest
- * expects the associated Values to be fetched also.
+ * Create the incoming-set record for the holder. The dht-id is the
+ * 64-bit hash of the holder, and the dht-value is the guid of the
+ * holder (or the zero hash, if the holder is being deleted). The
+ * type of the holder goes into the user_type, so that the incoming
+ * set can be filtered by type without fetching the holders.
  */
-void DHTAtomStorage::getIncomingSet(AtomTable& table, const Handle& h)
+dht::Value DHTAtomStorage::incoming_value(const dht::InfoHash& guid,
+                                          const Handle& holder)
+{
+	dht::Value inv(_incoming_policy, guid, holder->get_hash());
+	inv.user_type = nameserver().getTypeName(holder->get_type());
+	return inv;
+}
+
+/* ================================================================== */
+/**
+ * Return the guids of all of the Atoms in the incoming set of the
+ * indicated atom. Holders that have been deleted are marked with
+ * the zero hash; these are skipped.
+ */
+std::vector<dht::InfoHash>
+DHTAtomStorage::get_incoming_guids(const Handle& h)
+{
+	return get_incoming_guids(h, _incoming_filter);
+}
+
+/**
+ * Same as above, but only for holders of type t. The incoming-set
+ * records carry the type name of the holder in the dht::Value
+ * user_type, and so the holders of other types are dropped before
+ * any of them are fetched. Records written before the type was
+ * recorded have an empty user_type; these are passed through, and
+ * must be checked after the holder is fetched.
+ */
+std::vector<dht::InfoHash>
+DHTAtomStorage::get_incoming_guids(const Handle& h, Type t)
 {
+	return get_incoming_guids(h, incoming_filter(t));
+}
+
+/// The filter for the holders of type t; all of them, if NOTYPE.
+dht::Value::Filter DHTAtomStorage::incoming_filter(Type t)
+{
+	if (NOTYPE == t) return _incoming_filter;
+
+	std::string tname = nameserver().getTypeName(t);
+	return [tname](const dht::Value& v)
+		{
+			return INCOMING_ID == v.type and
+				(v.user_type.empty() or v.user_type == tname);
+		};
+}
+
+std::vector<dht::InfoHash>
+DHTAtomStorage::get_incoming_guids(const Handle& h,
+                                   const dht::Value::Filter& filter)
+{
+	if (bloom_absent(h)) return std::vector<dht::InfoHash>();
+
 	dht::InfoHash mhash = get_membership(h);
-	auto dincs = get_stuff(mhash, _incoming_filter);
+	touch_key(mhash);
+
+	// In an overlay, the delta records for a holder replace those
+	// in the base; thus, holders deleted in the delta are skipped.
+	ValueVec dincs;
+	if (0 < _base_name.size())
+		dincs = get_overlay(mhash, get_base_membership(h), filter);
+	else
+		dincs = get_stuff(mhash, filter);
+	return incoming_guids(dincs);
+}
+
+/// Decode the incoming-set records.
+std::vector<dht::InfoHash>
+DHTAtomStorage::incoming_guids(const ValueVec& dincs)
+{
+	static dht::InfoHash zerohash;
+
+	std::vector<dht::InfoHash> guids;
+	guids.reserve(dincs.size());
 	for (const auto& dinc : dincs)
 	{
 		// std::cout << "Got incoming guid: "
 		//	      << dinc->unpack<dht::InfoHash>().toString() << std::endl;
-		Handle h(fetch_values(fetch_atom(dinc->unpack<dht::InfoHash>())));
-		// std::cout << "Got incoming Atom: " << h->to_string() << std::endl;
+		dht::InfoHash inhash = dinc->unpack<dht::InfoHash>();
+		if (inhash == zerohash) continue;
+		guids.emplace_back(inhash);
+	}
+	return guids;
+}
+
+/**
+ * Same as get_incoming_guids(), but without waiting; the guids are
+ * handed to the callback. In an overlay, both the delta and the base
+ * are asked at the same time; whichever answers last merges them.
+ */
+void DHTAtomStorage::async_fetch_incoming(const FetchBatchPtr& batch,
+                                          const Handle& h,
+                                          const dht::Value::Filter& filter,
+                                          GuidsCallback&& cb)
+{
+	if (bloom_absent(h))
+	{
+		async_run(batch, [cb]() { cb(std::vector<dht::InfoHash>()); });
+		return;
+	}
+
+	dht::InfoHash mhash = get_membership(h);
+	touch_key(mhash);
 
-		table.add(h, false);
+	if (0 == _base_name.size())
+	{
+		async_get(batch, mhash, filter,
+			[cb](ValueVec&& dincs) { cb(incoming_guids(dincs)); });
+		return;
+	}
+
+	struct Halves
+	{
+		std::mutex mtx;
+		ValueVec vals;
+		ValueVec bvals;
+		size_t left = 2;
+	};
+	auto halves = std::make_shared<Halves>();
+	auto half = [cb, halves](bool base)
+	{
+		return [cb, halves, base](ValueVec&& got)
+		{
+			std::unique_lock<std::mutex> lck(halves->mtx);
+			(base ? halves->bvals : halves->vals) = std::move(got);
+			if (0 < --halves->left) return;
+			lck.unlock();
+
+			overlay_merge(halves->vals, std::move(halves->bvals));
+			cb(incoming_guids(halves->vals));
+		};
+	};
+	async_get(batch, mhash, filter, half(false));
+	async_get(batch, get_base_membership(h), filter, half(true));
+}
+
+/* ================================================================== */
+/**
+ * Retreive the entire incoming set of the indicated atom.
+ * This fetches the Atoms in the incoming set; the ValueSaveUTest
+ * expects the associated Values to be fetched also.
+ *
+ * All of the holders are fetched in one batch, and then all of
+ * their Values in another; thus, this costs two network round-trips,
+ * no matter how large the incoming set is.
+ */
+void DHTAtomStorage::getIncomingSet(AtomTable& table, const Handle& h)
+{
+	std::vector<dht::InfoHash> guids(get_incoming_guids(h));
+	HandleSeq hs(fetch_values_batch(fetch_atoms(guids)));
+	for (const Handle& hin : hs)
+	{
+		// std::cout << "Got incoming Atom: " << hin->to_string() << std::endl;
+		table.add(hin, false);
 	}
 
 	_num_get_insets++;
-	_num_get_inlinks += dincs.size();
+	_num_get_inlinks += hs.size();
 }
 
 /**
  * Retreive the incoming set of the indicated atom, but only those atoms
- * of type t.  This is done brute-force right now, and a faster, more
- * elegant version could be provided in the future, someday, I guess.
+ * of type t.  Only holders of type t are fetched (plus any holders
+ * recorded without a type, which are checked once fetched).
  */
 void DHTAtomStorage::getIncomingByType(AtomTable& table, const Handle& h, Type t)
 {
-	dht::InfoHash mhash = get_membership(h);
-	auto dincs = get_stuff(mhash, _incoming_filter);
-	for (const auto& dinc : dincs)
-	{
-		// std::cout << "Got incoming guid: "
-		//	   << dinc->unpack<dht::InfoHash>().toString() << std::endl;
-		Handle h(fetch_atom(dinc->unpack<dht::InfoHash>()));
-		if (h->get_type() != t) continue;
+	std::vector<dht::InfoHash> guids(get_incoming_guids(h, t));
+	HandleSeq typed;
+	for (Handle& hin : fetch_atoms(guids))
+		if (hin->get_type() == t) typed.emplace_back(std::move(hin));
 
-		Handle hv(fetch_values(std::move(h)));
+	for (const Handle& hv : fetch_values_batch(std::move(typed)))
+	{
 		// std::cout << "Got typed incoming Atom: "
 		//           << hv->to_string() << std::endl;
-
 		table.add(hv, false);
 		_num_get_inlinks ++;
 	}
@@ -0,0 +1,304 @@
+/*
+ * DHTIndex.cc
+ * Sharded AtomSpace membership, and per-type membership indexes.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/atom_types/NameServer.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/**
+ * Return the keys holding the membership shards of the named
+ * AtomSpace. The AtomSpace key itself (the hash of the name) is
+ * NOT one of these; it holds the shard descriptor, as well as the
+ * membership of AtomSpaces written before sharding was introduced.
+ */
+std::vector<dht::InfoHash>
+DHTAtomStorage::get_shard_keys(const std::string& spacename, size_t nshards)
+{
+	std::vector<dht::InfoHash> keys;
+	keys.reserve(nshards);
+	for (size_t i = 0; i < nshards; i++)
+		keys.emplace_back(
+			dht::InfoHash::get(spacename + "#" + std::to_string(i)));
+	return keys;
+}
+
+/// Same as above, but for the per-type membership of the AtomSpace.
+std::vector<dht::InfoHash>
+DHTAtomStorage::get_type_shard_keys(const std::string& spacename,
+                                    Type t, size_t nshards)
+{
+	const std::string& tname = nameserver().getTypeName(t);
+	std::vector<dht::InfoHash> keys;
+	keys.reserve(nshards);
+	for (size_t i = 0; i < nshards; i++)
+		keys.emplace_back(
+			dht::InfoHash::get(spacename + tname + "#" + std::to_string(i)));
+	return keys;
+}
+
+/**
+ * Look up the shard descriptor on the AtomSpace key. Return zero,
+ * if there isn't one; that is, if this AtomSpace has never been
+ * written to, or was written before sharding was introduced.
+ *
+ * The descriptor has the form "shards N", followed by optional
+ * flags: "types" if the writers also maintain the per-type
+ * membership, "merkle" if the GUIDs are Merkle hashes, "local B"
+ * if the MUIDs of Links are placed near their first outgoing Atom,
+ * sharing B leading bits with it, and "bloom K M" if the writers
+ * publish Bloom filters of M bits and K hashes over each shard.
+ * The flags are returned in `layp`, if the caller wants them.
+ */
+size_t DHTAtomStorage::fetch_num_shards(const dht::InfoHash& space,
+                                        Layout* layp)
+{
+	Layout lay;
+	auto dvals = get_stuff(space,
+		[](const dht::Value& v)
+		{ return SPACE_ID == v.type and SHARDS_VID == v.id; });
+
+#define SHARDS "shards "
+#define TYPES " types"
+#define MERKLE " merkle"
+#define LOCAL " local"
+#define BLOOM " bloom"
+	for (const auto& dval : dvals)
+	{
+		std::string sdesc = dval->unpack<std::string>();
+		if (sdesc.compare(0, sizeof(SHARDS)-1, SHARDS)) continue;
+		char* end = nullptr;
+		size_t nshards = strtoul(&sdesc[sizeof(SHARDS)-1], &end, 10);
+		if (0 == nshards or MAX_SHARDS < nshards) continue;
+		std::string flags(end);
+		flags += ' ';
+		lay.typed = (std::string::npos != flags.find(TYPES " "));
+		lay.merkle = (std::string::npos != flags.find(MERKLE " "));
+
+		size_t pos = flags.find(LOCAL " ");
+		lay.local = (std::string::npos == pos) ? 0 :
+			strtoul(&flags[pos + sizeof(LOCAL)], nullptr, 10);
+		if (MAX_LOCALITY < lay.local) continue;
+
+		lay.bloom_hashes = 0;
+		lay.bloom_bits = 0;
+		pos = flags.find(BLOOM " ");
+		if (std::string::npos != pos)
+		{
+			lay.bloom_hashes = strtoul(&flags[pos + sizeof(BLOOM)], &end, 10);
+			lay.bloom_bits = strtoul(end, nullptr, 10);
+			if (BloomFilter::MAX_HASHES < lay.bloom_hashes or
+			    BloomFilter::MAX_BITS < lay.bloom_bits or
+			    0 == lay.bloom_bits or 0 != lay.bloom_bits % 64)
+				lay.bloom_hashes = 0;
+		}
+		if (layp) *layp = lay;
+		return nshards;
+	}
+	if (layp) *layp = Layout();
+	return 0;
+}
+
+/**
+ * Return the number of membership shards for the currently-open
+ * AtomSpace, looking it up in the DHT the first time around. If
+ * there is no descriptor in the DHT, then publish one, using the
+ * shard count given in the URI.
+ *
+ * The space edit policy refuses to replace an existing descriptor,
+ * so the first writer wins. Two writers creating the same AtomSpace
+ * at exactly the same time, with different shard counts, will
+ * disagree; this is not handled.
+ */
+size_t DHTAtomStorage::get_num_shards(void)
+{
+	if (0 < _num_shards) return _num_shards;
+
+	std::lock_guard<std::mutex> lck(_shard_mutex);
+	if (0 < _num_shards) return _num_shards;
+
+	Layout lay;
+	size_t nshards = fetch_num_shards(_atomspace_hash, &lay);
+	if (0 == nshards)
+	{
+		// An overlay shares the Atom records of its base, and so
+		// must compute the GUIDs the same way. The MUIDs are its
+		// own, and so may be placed differently.
+		nshards = _want_shards;
+		lay.typed = true;
+		lay.merkle = true;
+		lay.local = _want_locality;
+		if (0 < _want_bloom_fpr)
+		{
+			lay.bloom_hashes = BloomFilter::hashes_for(_want_bloom_fpr);
+			lay.bloom_bits = BloomFilter::bits_for(
+				_want_bloom_atoms / nshards + 1, _want_bloom_fpr);
+		}
+		if (0 < _base_name.size())
+		{
+			get_base_shards();
+			lay.merkle = _base_merkle;
+		}
+		if (not _observing_only)
+		{
+			std::string bloom;
+			if (lay.bloom_hashes)
+				bloom = BLOOM " " + std::to_string(lay.bloom_hashes)
+					+ " " + std::to_string(lay.bloom_bits);
+			touch_key(_atomspace_hash, true);
+			queue_put(_atomspace_hash,
+				dht::Value(_space_policy,
+					SHARDS + std::to_string(nshards) + TYPES
+						+ (lay.merkle ? MERKLE : "")
+						+ (lay.local ? LOCAL " " + std::to_string(lay.local) : "")
+						+ bloom,
+					SHARDS_VID));
+		}
+	}
+	else if (0 < _base_name.size() and get_base_shards() and
+	         lay.merkle != _base_merkle)
+		throw IOException(TRACE_INFO,
+			"AtomSpace %s and its base %s use different GUIDs",
+			_atomspace_name.c_str(), _base_name.c_str());
+	_type_index = lay.typed;
+	_merkle_guids = lay.merkle;
+	_locality = lay.local;
+
+	_shard_keys = get_shard_keys(_atomspace_name, nshards);
+	init_bloom(lay, nshards);
+	_num_shards = nshards;
+	return nshards;
+}
+
+/// Return the membership shard that the Atom belongs to. The Atom
+/// hash is used, since it is the same for all peers.
+dht::InfoHash DHTAtomStorage::get_shard(const Handle& h)
+{
+	size_t nshards = get_num_shards();
+	return _shard_keys[h->get_hash() % nshards];
+}
+
+/// Return the per-type membership shard that the Atom belongs to.
+/// This is not cached; it is only needed when the Atom is first
+/// published, and when it is deleted.
+dht::InfoHash DHTAtomStorage::get_type_shard(const Handle& h)
+{
+	size_t nshards = get_num_shards();
+	return dht::InfoHash::get(_atomspace_name
+		+ nameserver().getTypeName(h->get_type())
+		+ "#" + std::to_string(h->get_hash() % nshards));
+}
+
+/* ================================================================ */
+
+/**
+ * Parse a membership record. These have the form
+ *    add 1572978874.801600 (Concept "foo")
+ * or the same, with "drop". Return false if it's neither. Otherwise,
+ * set `added`, the timestamp, and the position of the Atom
+ * s-expression.
+ */
+bool DHTAtomStorage::parse_member(const std::string& rec,
+                                  bool& added, double& ts, size_t& pos)
+{
+#define ADD_ATOM "add "
+#define DROP_ATOM "drop "
+	if (0 == rec.compare(0, sizeof(ADD_ATOM)-1, ADD_ATOM))
+	{
+		added = true;
+		pos = sizeof(ADD_ATOM)-1;
+	}
+	else if (0 == rec.compare(0, sizeof(DROP_ATOM)-1, DROP_ATOM))
+	{
+		added = false;
+		pos = sizeof(DROP_ATOM)-1;
+	}
+	else return false;
+
+	char* end = nullptr;
+	ts = strtod(&rec[pos], &end);
+	pos = end - rec.c_str();
+	while (pos < rec.size() and ' ' == rec[pos]) pos++;
+	return pos < rec.size() and '(' == rec[pos];
+}
+
+/**
+ * Fetch one membership key, and decode the records on it. The
+ * callback is called for every "add" and "drop" record, as they
+ * arrive; the timestamps are passed along, so that the caller can
+ * decide which is the most recent. Nothing is fetched, other than
+ * the Atom: the caller should fetch the Values, if needed.
+ *
+ * The callback may be called from several dispatcher threads at
+ * once. Large bunches of records are decoded in chunks, so that
+ * they are spread over all of the dispatchers.
+ */
+void DHTAtomStorage::foreach_member(const FetchBatchPtr& batch,
+                                    const dht::InfoHash& key,
+                                    const MemberCallback& cb)
+{
+#define MEMBER_CHUNK 256
+	async_stream(batch, key, dht::Value::TypeFilter(_space_policy),
+		[this, batch, cb](ValueVec&& atovs)
+		{
+			if (atovs.size() <= MEMBER_CHUNK)
+			{
+				decode_members(atovs, 0, atovs.size(), cb);
+				return;
+			}
+
+			auto vals = std::make_shared<ValueVec>(std::move(atovs));
+			for (size_t i = 0; i < vals->size(); i += MEMBER_CHUNK)
+			{
+				size_t end = std::min(i + MEMBER_CHUNK, vals->size());
+				async_run(batch, [this, vals, i, end, cb]()
+					{ decode_members(*vals, i, end, cb); });
+			}
+		});
+}
+
+/// Blocking version of the above, for all of the given keys.
+void DHTAtomStorage::foreach_member(const std::vector<dht::InfoHash>& keys,
+                                    const MemberCallback& cb)
+{
+	FetchBatchPtr batch(new_batch());
+	for (const dht::InfoHash& key : keys)
+		foreach_member(batch, key, cb);
+	wait_batch(batch);
+}
+
+/// Decode the membership records from `begin` to `end`.
+void DHTAtomStorage::decode_members(const ValueVec& atovs,
+                                    size_t begin, size_t end,
+                                    const MemberCallback& cb)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		const auto& ato = atovs[i];
+		if (SPACE_ID != ato->type) continue;
+		std::string sname = ato->unpack<std::string>();
+
+		// The shard descriptor, or something unknown.
+		bool added;
+		double ts;
+		size_t pos;
+		if (not parse_member(sname, added, ts, pos)) continue;
+		cb(decodeStrAtom(sname, pos), added, ts);
+	}
+}
+
+/* ============================= END OF FILE ================= */
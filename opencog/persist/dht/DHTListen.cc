@@ -0,0 +1,263 @@
+/*
+ * DHTListen.cc
+ * Subscriptions to changes in the DHT.
+ *
+ * Each subscription is one or more OpenDHT listens. OpenDHT calls
+ * back, from its own thread, with the values already on the key, and
+ * then again with each value as it is put. The callback hands the
+ * values to a dispatcher, which applies them to the AtomSpace that we
+ * are registered with; thus, OpenDHT is never re-entered from its own
+ * thread.
+ *
+ * All of the callbacks go on one batch. No one waits on it; it is
+ * cancelled when the subscriptions are, so that nothing is applied
+ * after unregisterWith().
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atomspace/AtomSpace.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+/// Listen on the key, handing each value to the callback.
+void DHTAtomStorage::listen_key(std::vector<Listen>& listens,
+                                const dht::InfoHash& key,
+                                const dht::Value::Filter& filter,
+                                const ListenCallback& cb)
+{
+	FetchBatchPtr batch;
+	{
+		std::lock_guard<std::mutex> lck(_listen_mutex);
+		if (nullptr == _listen_batch) _listen_batch = new_batch();
+		batch = _listen_batch;
+	}
+
+	// Expired values are ignored; the Atoms are still in the
+	// AtomSpace, whether or not the DHT still has them.
+	std::future<size_t> token = _runner.listen(key,
+		[this, batch, cb](const ValueVec& vals, bool expired)
+		{
+			if (expired) return true;
+			for (const auto& val : vals)
+			{
+				_listen_events++;
+				async_run(batch, [batch, cb, val]() { cb(batch, val); });
+			}
+			return true;
+		},
+		filter);
+
+	listens.emplace_back(Listen{key, token.share()});
+}
+
+/// Record the listens, and return an id for them.
+size_t DHTAtomStorage::add_listens(std::vector<Listen>&& listens)
+{
+	std::lock_guard<std::mutex> lck(_listen_mutex);
+	size_t id = ++_next_listen;
+	_listens.emplace(id, std::move(listens));
+	return id;
+}
+
+/// Return the AtomSpace that changes are applied to.
+AtomSpace* DHTAtomStorage::listen_space(void)
+{
+	if (nullptr == _as)
+		throw RuntimeException(TRACE_INFO,
+			"Not registered with an AtomSpace!");
+	return _as;
+}
+
+/* ================================================================ */
+
+/**
+ * Subscribe to the membership of the currently open AtomSpace. Atoms
+ * that are added elsewhere are added here, with their Values; Atoms
+ * that are dropped are extracted. The Atoms already there are
+ * delivered first, so there is no need to load the AtomSpace before
+ * subscribing. Returns the subscription id.
+ */
+size_t DHTAtomStorage::listen_atomspace(void)
+{
+	listen_space();
+
+	std::vector<dht::InfoHash> keys(get_shard_keys(_atomspace_name,
+		get_num_shards()));
+	keys.push_back(_atomspace_hash);
+
+	std::vector<Listen> listens;
+	for (const dht::InfoHash& key : keys)
+		listen_key(listens, key, dht::Value::TypeFilter(_space_policy),
+			[this](const FetchBatchPtr& batch,
+			       const std::shared_ptr<dht::Value>& val)
+			{ apply_member(batch, val); });
+
+	return add_listens(std::move(listens));
+}
+
+void DHTAtomStorage::apply_member(const FetchBatchPtr& batch,
+                                  const std::shared_ptr<dht::Value>& val)
+{
+	// The shard descriptor, or something unknown.
+	std::string rec = val->unpack<std::string>();
+	bool added;
+	double ts;
+	size_t pos;
+	if (not parse_member(rec, added, ts, pos)) return;
+	Handle h(decodeStrAtom(rec, pos));
+	AtomSpace* as = listen_space();
+
+	// Records arrive in any order, and a record already applied may
+	// be delivered again, e.g. when the DHT is refreshed. Only the
+	// newest one counts, as in load_atomspace(). The check and the
+	// change to the AtomSpace are made together, else an older add
+	// could land after a newer drop.
+	dht::InfoHash guid(get_guid(h));
+	Handle ah;
+	{
+		std::lock_guard<std::mutex> lck(_member_mutex);
+		MemberSeen seen;
+		if (_member_ts.get(guid, seen) and ts <= seen.ts) return;
+		_member_ts.set(guid, MemberSeen{ts, added});
+
+		if (not added)
+		{
+			as->extract_atom(h);
+			return;
+		}
+		ah = as->add_atom(h);
+	}
+
+	async_fetch_values(batch, ah, [](const Handle&) {});
+}
+
+/**
+ * Subscribe to the Values on the Atom. The Atom is added to the
+ * AtomSpace, if it's not already there, and the Values are updated
+ * every time that they change. Returns the subscription id.
+ */
+size_t DHTAtomStorage::listen_values(const Handle& h)
+{
+	Handle ah(listen_space()->add_atom(h));
+	dht::InfoHash muid = get_membership(ah);
+
+	std::vector<Listen> listens;
+	listen_key(listens, muid, _values_filter,
+		[this, ah, muid](const FetchBatchPtr& batch,
+		                 const std::shared_ptr<dht::Value>& val)
+		{
+			disk_cache_put(muid, *val);
+			got_values(batch, ah, ValueVec({val}), [](const Handle&) {});
+		});
+
+	return add_listens(std::move(listens));
+}
+
+/**
+ * Subscribe to the IncomingSet of the Atom. Holders that are added
+ * elsewhere are added here, with their Values; those that are
+ * removed are extracted. Returns the subscription id.
+ */
+size_t DHTAtomStorage::listen_incoming(const Handle& h)
+{
+	Handle ah(listen_space()->add_atom(h));
+	dht::InfoHash muid = get_membership(ah);
+
+	std::vector<Listen> listens;
+	listen_key(listens, muid, _incoming_filter,
+		[this, ah](const FetchBatchPtr& batch,
+		           const std::shared_ptr<dht::Value>& val)
+		{ apply_incoming(batch, ah, val); });
+
+	return add_listens(std::move(listens));
+}
+
+void DHTAtomStorage::apply_incoming(const FetchBatchPtr& batch,
+                                    const Handle& h,
+                                    const std::shared_ptr<dht::Value>& val)
+{
+	static dht::InfoHash zerohash;
+
+	// A deleted holder is marked with the zero hash; the value->id
+	// is the hash of the holder. Find it in the IncomingSet.
+	dht::InfoHash inhash = val->unpack<dht::InfoHash>();
+	if (inhash == zerohash)
+	{
+		AtomSpace* as = listen_space();
+		for (const LinkPtr& lp : h->getIncomingSet(as))
+		{
+			if ((dht::Value::Id) lp->get_hash() != val->id) continue;
+			as->extract_atom(lp->get_handle(), true);
+			break;
+		}
+		return;
+	}
+
+	async_fetch_atom(batch, inhash,
+		[this, batch](const Handle& hin)
+		{
+			async_fetch_values(batch, listen_space()->add_atom(hin),
+				[](const Handle&) {});
+		});
+}
+
+/* ================================================================ */
+
+void DHTAtomStorage::cancel_listens(const std::vector<Listen>& listens)
+{
+	for (const Listen& lsn : listens)
+		_runner.cancelListen(lsn.key, lsn.token);
+}
+
+/// Cancel the subscription. Changes that are already on their way
+/// may still be applied.
+void DHTAtomStorage::unlisten(size_t id)
+{
+	std::vector<Listen> listens;
+	{
+		std::lock_guard<std::mutex> lck(_listen_mutex);
+		const auto& it = _listens.find(id);
+		if (_listens.end() == it)
+			throw RuntimeException(TRACE_INFO,
+				"No such subscription: %zu", id);
+		listens = std::move(it->second);
+		_listens.erase(it);
+	}
+	cancel_listens(listens);
+}
+
+/// Cancel all subscriptions. Nothing is applied to the AtomSpace
+/// after this returns.
+void DHTAtomStorage::unlisten_all(void)
+{
+	std::map<size_t, std::vector<Listen>> all;
+	FetchBatchPtr batch;
+	{
+		std::lock_guard<std::mutex> lck(_listen_mutex);
+		all.swap(_listens);
+		batch.swap(_listen_batch);
+	}
+	for (const auto& pr : all)
+		cancel_listens(pr.second);
+
+	// Skip whatever is still queued, and wait for whatever is
+	// running.
+	if (nullptr != batch)
+	{
+		std::unique_lock<std::mutex> blck(batch->mtx);
+		batch->cancelled = true;
+		batch->cv.wait(blck, [&batch]{ return 0 == batch->running; });
+	}
+
+	std::lock_guard<std::mutex> lck(_member_mutex);
+	_member_ts.erase_if(
+		[](const dht::InfoHash&, const MemberSeen&) { return true; });
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,211 @@
+/*
+ * DHTMerge.cc
+ * Delta-encoded Values, and CRDT counts on CountTruthValues.
+ *
+ * With `values=merge` in the URI, a store sends only the keys whose
+ * Values changed since the Atom was last stored or fetched, as a
+ * delta; the DHT nodes merge it into the record that they already have
+ * (see cy_edit_values() and ValuesMerge.h). The first store of an Atom
+ * not seen before sends all of the keys.
+ *
+ * The counts on CountTruthValues are CRDT counters. Each writer
+ * (each DHTAtomStorage) has its own share, which goes up or down by
+ * however much the count on the Atom changed since it was last seen.
+ * Thus, many writers can add to the same count, without fetching it
+ * first, and without losing each other's increments.
+ *
+ * What was seen is kept until the Atom is extracted. This is not a
+ * cache: if it were evicted, the writer's share would be lost. What
+ * was stored counts as seen only once the DHT has it; until then,
+ * later stores are encoded against what was seen before, and so the
+ * deltas carry the earlier changes, too. The shares are absolute, not
+ * increments, and so this does not count anything twice.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <algorithm>
+
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/atoms/truthvalue/TruthValue.h>
+
+#include "DHTAtomStorage.h"
+#include "ValuesMerge.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+/// Encode the Values on the Atom that changed. Also returns all of
+/// them, in `full`, for the disk cache, and what will have been seen,
+/// in `now`, once the put is done.
+ValuesRecord DHTAtomStorage::encodeValuesDelta(const Handle& atom,
+                                               ValuesRecord& full,
+                                               ValuesSeen& now)
+{
+	// An Atom whose Values were deleted is as good as unknown.
+	ValuesSeen seen;
+	bool known = _values_seen.get(atom, seen) and 0 < seen.vals.size();
+
+	now.seq = ++_count_seq;
+	ValuesRecord delta;
+	delta.v = DHT_MERGE_VERSION;
+	delta.d = true;
+	for (const Handle& key : atom->getKeys())
+	{
+		ValuePtr v(atom->getValue(key));
+		now.vals.emplace(key, v);
+
+		KeyValueRecord kv;
+		kv.k = get_guid(key);
+		kv.val = encodeValueToRecord(v);
+
+		if (COUNT_TRUTH_VALUE == v->get_type())
+		{
+			CountState cs{0.0, 0.0, 0};
+			const auto& it = seen.counts.find(key);
+			if (seen.counts.end() != it) cs = it->second;
+
+			double count = TruthValueCast(v)->get_count();
+			if (count != cs.base or 0 == cs.seq)
+			{
+				cs.mine += count - cs.base;
+				cs.base = count;
+				cs.seq = ++_count_seq;
+			}
+			now.counts.emplace(key, cs);
+			kv.c.push_back(CountRecord{_writer_id, cs.seq, cs.mine});
+		}
+
+		const auto& sit = seen.vals.find(key);
+		bool changed = (seen.vals.end() == sit or sit->second != v);
+		full.kvs.push_back(kv);
+		if (changed) delta.kvs.emplace_back(std::move(kv));
+	}
+
+	for (const auto& pr : seen.vals)
+		if (now.vals.end() == now.vals.find(pr.first))
+			delta.x.push_back(get_guid(pr.first));
+
+	full.v = uses_merge(full) ? DHT_MERGE_VERSION : DHT_WIRE_VERSION;
+
+	// If nothing is known, or nothing changed, send all of it. The
+	// latter re-publishes, which is what the caller may have wanted.
+	if (not known or (0 == delta.kvs.size() and 0 == delta.x.size()))
+		return full;
+	return delta;
+}
+
+/// Remember the Values that were fetched, and this writer's share of
+/// the counts. For each key, `shares` has the shares in the record.
+void DHTAtomStorage::seen_values(const Handle& atom, const HandleSeq& keys,
+                         const std::vector<ValuePtr>& vals,
+                         const std::vector<std::vector<CountRecord>>& shares)
+{
+	ValuesSeen seen;
+	seen.seq = ++_count_seq;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		seen.vals.emplace(keys[i], vals[i]);
+		if (COUNT_TRUTH_VALUE != vals[i]->get_type()) continue;
+
+		CountState cs{TruthValueCast(vals[i])->get_count(), 0.0, 0};
+		for (const CountRecord& cr : shares[i])
+		{
+			if (cr.w != _writer_id) continue;
+			cs.mine = cr.n;
+			cs.seq = cr.q;
+		}
+		seen.counts.emplace(keys[i], cs);
+	}
+	set_values_seen(atom, seen);
+}
+
+/// Record what was seen, unless something newer already was. Puts
+/// may be answered in any order, and fetches may race with them.
+void DHTAtomStorage::set_values_seen(const Handle& atom,
+                                     const ValuesSeen& seen)
+{
+	while (true)
+	{
+		bool found = _values_seen.update(atom,
+			[&seen](ValuesSeen& vs) { if (vs.seq < seen.seq) vs = seen; });
+		if (found or _values_seen.try_insert(atom, seen)) return;
+	}
+}
+
+/* ================================================================ */
+
+/// Merge the binary Values records that came back from a get; there
+/// may be several, from different nodes. Returns null if there are
+/// fewer than two.
+std::shared_ptr<dht::Value>
+DHTAtomStorage::merge_values(const std::vector<std::shared_ptr<dht::Value>>& dvals)
+{
+	std::vector<ValuesRecord> recs;
+	for (const auto& dval : dvals)
+		if (VALUES_BIN_ID == dval->type)
+			recs.emplace_back(dval->unpack<ValuesRecord>());
+	if (recs.size() < 2) return nullptr;
+
+	// All of the Values first, and then the deltas on top.
+	std::stable_partition(recs.begin(), recs.end(),
+		[](const ValuesRecord& rec) { return not rec.d; });
+
+	ValuesRecord merged(recs[0]);
+	for (size_t i = 1; i < recs.size(); i++)
+		merge_values_record(merged, recs[i]);
+	return std::make_shared<dht::Value>(VALUES_BIN_ID, merged, 1);
+}
+
+/// A put of the Values is replacing one that is still in the store
+/// queue. If the new one is a delta, then it has to carry whatever
+/// the queued one had, too.
+void DHTAtomStorage::merge_queued_values(const dht::Value& queued,
+                                         dht::Value& val)
+{
+	if (VALUES_BIN_ID != queued.type) return;
+
+	ValuesRecord rec(val.unpack<ValuesRecord>());
+	if (not rec.d) return;
+
+	ValuesRecord merged(queued.unpack<ValuesRecord>());
+	merge_values_record(merged, rec);
+	val.data = dht::Value(VALUES_BIN_ID, merged, val.id).data;
+}
+
+/// A delta failed, and has to be sent again, but a later put of the
+/// Values was sent in the meanwhile. The later one wins for whatever
+/// keys it has; send only the rest. Returns false if nothing is left.
+bool DHTAtomStorage::rebase_values(dht::Value& val, const dht::Value& newer)
+{
+	if (VALUES_BIN_ID != val.type or VALUES_BIN_ID != newer.type)
+		return false;
+
+	// If the later one has all of the Values, there's nothing left.
+	// Otherwise, what is left is sent as a delta, even if it had all
+	// of them, else it would remove the keys of the later one.
+	ValuesRecord nrec(newer.unpack<ValuesRecord>());
+	if (not nrec.d) return false;
+	ValuesRecord rec(val.unpack<ValuesRecord>());
+	rec.d = true;
+	rec.v = DHT_MERGE_VERSION;
+
+	auto in_newer = [&nrec](const dht::InfoHash& k)
+	{
+		if (nrec.x.end() != std::find(nrec.x.begin(), nrec.x.end(), k))
+			return true;
+		return nullptr != find_key_value(nrec, k);
+	};
+	rec.kvs.erase(std::remove_if(rec.kvs.begin(), rec.kvs.end(),
+		[&in_newer](const KeyValueRecord& kv) { return in_newer(kv.k); }),
+		rec.kvs.end());
+	rec.x.erase(std::remove_if(rec.x.begin(), rec.x.end(), in_newer),
+		rec.x.end());
+
+	if (0 == rec.kvs.size() and 0 == rec.x.size()) return false;
+	val.data = dht::Value(VALUES_BIN_ID, rec, val.id).data;
+	return true;
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,273 @@
+/*
+ * DHTMetrics.cc
+ * Latency histograms, and other metrics, in machine-readable form.
+ *
+ * Every get is timed from the moment it is handed to OpenDHT, until
+ * OpenDHT says that it is done; every put, from the moment it is
+ * handed to OpenDHT, until it is answered. Time spent waiting in our
+ * own queues is not included; the gauges show how deep those are. The
+ * timings go into histograms, one for each kind of value (which, for
+ * gets, is known only once something is found).
+ *
+ * Everything can be had as an s-expression association list, or as
+ * Prometheus text, to be scraped.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+
+#include <sstream>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+const char* DHTAtomStorage::metric_name(size_t m)
+{
+	static const char* names[NUM_METRICS] =
+		{ "atom", "space", "values", "incoming", "other", "miss" };
+	return names[m];
+}
+
+/// The histogram for a value type; zero means nothing was found.
+size_t DHTAtomStorage::metric_of(dht::ValueType::Id vtype)
+{
+	switch (vtype)
+	{
+		case 0: return METRIC_MISS;
+		case ATOM_ID:
+		case ATOM_BIN_ID: return METRIC_ATOM;
+		case SPACE_ID: return METRIC_SPACE;
+		case VALUES_ID:
+		case VALUES_BIN_ID: return METRIC_VALUES;
+		case INCOMING_ID: return METRIC_INCOMING;
+		default: return METRIC_OTHER;
+	}
+}
+
+DHTAtomStorage::Gauges DHTAtomStorage::get_gauges(void)
+{
+	Gauges g;
+	{
+		std::lock_guard<std::mutex> lck(_lookup_mutex);
+		g.lookups_queued = _lookup_queue.size();
+		g.lookups_inflight = _inflight;
+		g.lookups_done = _done_queue.size();
+	}
+	{
+		std::lock_guard<std::mutex> lck(_put_mutex);
+		g.puts_queued = _put_queue.size();
+		g.puts_outstanding = _puts_outstanding;
+		g.put_window = _put_window;
+	}
+
+	// OpenDHT does not say how many hops a search took. The depth of
+	// the routing table is the closest thing to it: a lookup takes
+	// about as many hops as there are levels to descend.
+	dht::NodeStats ns = _runner.getNodesStats(AF_INET);
+	g.nodes_good = ns.good_nodes;
+	g.nodes_dubious = ns.dubious_nodes;
+	g.table_depth = ns.table_depth;
+	return g;
+}
+
+/* ================================================================ */
+
+/// One line for print_stats(), if anything was recorded.
+void DHTAtomStorage::prt_latency(const char* op, size_t m,
+                                 const LatencyHistogram& hist)
+{
+	LatencyHistogram::Snapshot snap(hist.snapshot());
+	if (0 == snap.count) return;
+	printf("%s %-8s msecs: n = %zu mean = %.2f p50 = %.2f p99 = %.2f "
+	       "p99.9 = %.2f max = %.2f\n", op, metric_name(m),
+	       (size_t) snap.count, snap.mean_us() / 1000.0,
+	       snap.percentile(0.5) / 1000.0, snap.percentile(0.99) / 1000.0,
+	       snap.percentile(0.999) / 1000.0, snap.max_us / 1000.0);
+}
+
+static void sexpr_latency(std::stringstream& ss, const char* name,
+                          const LatencyHistogram& hist)
+{
+	LatencyHistogram::Snapshot snap(hist.snapshot());
+	ss << "(" << name
+	   << " (count . " << snap.count << ")"
+	   << " (mean-ms . " << snap.mean_us() / 1000.0 << ")"
+	   << " (p50-ms . " << snap.percentile(0.5) / 1000.0 << ")"
+	   << " (p90-ms . " << snap.percentile(0.9) / 1000.0 << ")"
+	   << " (p99-ms . " << snap.percentile(0.99) / 1000.0 << ")"
+	   << " (p999-ms . " << snap.percentile(0.999) / 1000.0 << ")"
+	   << " (max-ms . " << snap.max_us / 1000.0 << "))";
+}
+
+/**
+ * Return the metrics as an association list, in a string, suitable
+ * for the scheme `read`. The latencies are in milliseconds:
+ *
+ *    ((gets (atom (count . 12) (mean-ms . 3.1) (p50-ms . 2.9) ...)
+ *           (space ...) ...)
+ *     (puts (atom ...) ...)
+ *     (gauges (lookups-queued . 0) ...)
+ *     (counters (timeouts . 0) ...))
+ */
+std::string DHTAtomStorage::dht_metrics(void)
+{
+	std::stringstream ss;
+	ss << "((gets";
+	for (size_t i = 0; i < NUM_METRICS; i++)
+	{
+		ss << " ";
+		sexpr_latency(ss, metric_name(i), _get_latency[i]);
+	}
+	ss << ")\n (puts";
+	for (size_t i = 0; i < NUM_METRICS; i++)
+	{
+		if (METRIC_MISS == i) continue;
+		ss << " ";
+		sexpr_latency(ss, metric_name(i), _put_latency[i]);
+	}
+
+	Gauges g(get_gauges());
+	ss << ")\n (gauges"
+	   << " (lookups-queued . " << g.lookups_queued << ")"
+	   << " (lookups-inflight . " << g.lookups_inflight << ")"
+	   << " (lookups-undispatched . " << g.lookups_done << ")"
+	   << " (puts-queued . " << g.puts_queued << ")"
+	   << " (puts-outstanding . " << g.puts_outstanding << ")"
+	   << " (put-window . " << g.put_window << ")"
+	   << " (nodes-good . " << g.nodes_good << ")"
+	   << " (nodes-dubious . " << g.nodes_dubious << ")"
+	   << " (table-depth . " << g.table_depth << "))";
+
+	ss << "\n (counters"
+	   << " (timeouts . " << _num_timeouts << ")"
+	   << " (barrier-timeouts . " << _num_barrier_timeouts << ")"
+	   << " (gets-retried . " << _num_gets_retried << ")"
+	   << " (gets-expired . " << _num_gets_expired << ")"
+	   << " (gets-failed . " << _num_gets_failed << ")"
+	   << " (puts-queued . " << _num_puts_queued << ")"
+	   << " (puts-coalesced . " << _num_puts_coalesced << ")"
+	   << " (puts-sent . " << _num_puts_sent << ")"
+	   << " (puts-failed . " << _num_puts_failed << ")"
+	   << " (puts-retried . " << _num_put_retries << ")"
+	   << " (puts-unanswered . " << _num_puts_lost << ")"
+	   << " (wants-sent . " << _num_wants_sent << ")"
+	   << " (wants-seen . " << _num_wants_seen << ")"
+	   << " (wants-answered . " << _num_wants_answered << ")))";
+	return ss.str();
+}
+
+/* ================================================================ */
+
+static void prom_histogram(std::stringstream& ss, const char* metric,
+                           const char* policy, const LatencyHistogram& hist)
+{
+	// Powers of two, from 64 usecs to about a minute. These fall on
+	// bucket boundaries, and so the counts are exact.
+#define PROM_MIN_EXP 6
+#define PROM_MAX_EXP 26
+	LatencyHistogram::Snapshot snap(hist.snapshot());
+	uint64_t total = 0;
+	for (int e = PROM_MIN_EXP; e <= PROM_MAX_EXP; e++)
+	{
+		uint64_t le = 1ULL << e;
+		total = snap.count_below(le);
+		ss << metric << "_bucket{policy=\"" << policy
+		   << "\",le=\"" << le / 1.0e6 << "\"} " << total << "\n";
+	}
+
+	// The +Inf bucket must agree with the count.
+	total = snap.count_below(UINT64_MAX);
+	ss << metric << "_bucket{policy=\"" << policy << "\",le=\"+Inf\"} "
+	   << total << "\n";
+	ss << metric << "_sum{policy=\"" << policy << "\"} "
+	   << snap.sum_us / 1.0e6 << "\n";
+	ss << metric << "_count{policy=\"" << policy << "\"} " << total << "\n";
+}
+
+static void prom_value(std::stringstream& ss, const char* metric,
+                       const char* type, const char* help, size_t val)
+{
+	ss << "# HELP " << metric << " " << help << "\n"
+	   << "# TYPE " << metric << " " << type << "\n"
+	   << metric << " " << val << "\n";
+}
+
+/// Return the metrics in the Prometheus text exposition format.
+std::string DHTAtomStorage::dht_prometheus(void)
+{
+	std::stringstream ss;
+
+	ss << "# HELP atomspace_dht_get_seconds DHT get round-trip time.\n"
+	   << "# TYPE atomspace_dht_get_seconds histogram\n";
+	for (size_t i = 0; i < NUM_METRICS; i++)
+		prom_histogram(ss, "atomspace_dht_get_seconds",
+			metric_name(i), _get_latency[i]);
+
+	ss << "# HELP atomspace_dht_put_seconds DHT put round-trip time.\n"
+	   << "# TYPE atomspace_dht_put_seconds histogram\n";
+	for (size_t i = 0; i < NUM_METRICS; i++)
+	{
+		if (METRIC_MISS == i) continue;
+		prom_histogram(ss, "atomspace_dht_put_seconds",
+			metric_name(i), _put_latency[i]);
+	}
+
+	Gauges g(get_gauges());
+	prom_value(ss, "atomspace_dht_lookups_queued", "gauge",
+		"Gets waiting for room in the in-flight window.", g.lookups_queued);
+	prom_value(ss, "atomspace_dht_lookups_inflight", "gauge",
+		"Gets handed to OpenDHT, not yet done.", g.lookups_inflight);
+	prom_value(ss, "atomspace_dht_lookups_undispatched", "gauge",
+		"Gets done, waiting for a dispatcher.", g.lookups_done);
+	prom_value(ss, "atomspace_dht_puts_queued", "gauge",
+		"Puts in the store queue.", g.puts_queued);
+	prom_value(ss, "atomspace_dht_puts_outstanding", "gauge",
+		"Puts handed to OpenDHT, not yet answered.", g.puts_outstanding);
+	prom_value(ss, "atomspace_dht_put_window", "gauge",
+		"Most puts that may be outstanding.", g.put_window);
+	prom_value(ss, "atomspace_dht_nodes_good", "gauge",
+		"Good IPv4 nodes in the routing table.", g.nodes_good);
+	prom_value(ss, "atomspace_dht_nodes_dubious", "gauge",
+		"Dubious IPv4 nodes in the routing table.", g.nodes_dubious);
+	prom_value(ss, "atomspace_dht_table_depth", "gauge",
+		"Depth of the IPv4 routing table.", g.table_depth);
+
+	prom_value(ss, "atomspace_dht_timeouts_total", "counter",
+		"Waits that gave up on an unresponsive DHT.", _num_timeouts);
+	prom_value(ss, "atomspace_dht_barrier_timeouts_total", "counter",
+		"Barriers that gave up on unanswered puts.", _num_barrier_timeouts);
+	prom_value(ss, "atomspace_dht_gets_retried_total", "counter",
+		"Gets sent again, after OpenDHT reported them failed.",
+		_num_gets_retried);
+	prom_value(ss, "atomspace_dht_gets_expired_total", "counter",
+		"Gets given up on, for going unanswered.", _num_gets_expired);
+	prom_value(ss, "atomspace_dht_gets_failed_total", "counter",
+		"Gets that OpenDHT reported as failed.", _num_gets_failed);
+	prom_value(ss, "atomspace_dht_puts_coalesced_total", "counter",
+		"Puts replaced by a later put while queued.", _num_puts_coalesced);
+	prom_value(ss, "atomspace_dht_puts_sent_total", "counter",
+		"Puts handed to OpenDHT.", _num_puts_sent);
+	prom_value(ss, "atomspace_dht_puts_failed_total", "counter",
+		"Puts given up on, after all retries.", _num_puts_failed);
+	prom_value(ss, "atomspace_dht_puts_retried_total", "counter",
+		"Puts sent again, after failing.",
+		_num_put_retries);
+	prom_value(ss, "atomspace_dht_puts_unanswered_total", "counter",
+		"Puts that OpenDHT did not answer in time.", _num_puts_lost);
+	prom_value(ss, "atomspace_dht_wants_sent_total", "counter",
+		"Requests for a seeder to put back a missing key.",
+		_num_wants_sent);
+	prom_value(ss, "atomspace_dht_wants_seen_total", "counter",
+		"Requests to put back a key, seen by this seeder.",
+		_num_wants_seen);
+	prom_value(ss, "atomspace_dht_wants_answered_total", "counter",
+		"Requests to put back a key, that this seeder could answer.",
+		_num_wants_answered);
+	return ss.str();
+}
+
+/* ============================= END OF FILE ================= */
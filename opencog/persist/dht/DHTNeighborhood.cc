@@ -0,0 +1,160 @@
+/*
+ * DHTNeighborhood.cc
+ * Speculative prefetch of the neighborhood of an Atom.
+ *
+ * A graph walk that calls getIncomingSet(), then fetches the Values on
+ * each holder, then moves on to the next Atom, waits for one
+ * round-trip after another. Here, all of that is asked for at once, up
+ * front, in one batch: the Values on the Atom, its incoming set, the
+ * holders and their Values, the other Atoms in the holders and their
+ * Values, and so on, out to the given depth. Each answer issues the
+ * next requests as soon as it arrives, so the cost is about one
+ * round-trip per level, and not one per Atom.
+ *
+ * A neighborhood can be large; a hub Node can have a vast incoming
+ * set. So as not to crowd out everything else in the in-flight window,
+ * only so many requests are outstanding at a time; the rest queue up,
+ * and are issued, in order, as the earlier ones are answered.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <opencog/atoms/base/Atom.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+/// Issue the request, if the budget allows; else queue it. Every
+/// request must call nb_done(), exactly once, when it is answered.
+/// What is queued holds on to the Neighborhood only weakly; else the
+/// queue, left behind by a failed batch, would keep itself alive.
+void DHTAtomStorage::nb_issue(const NeighborhoodPtr& nb,
+                              std::function<void()>&& fn)
+{
+	{
+		std::lock_guard<std::mutex> lck(nb->mtx);
+		if (_prefetch_inflight <= nb->outstanding)
+		{
+			nb->waiting.emplace_back(std::move(fn));
+			return;
+		}
+		nb->outstanding++;
+	}
+	fn();
+}
+
+/// A request was answered; hand its turn to the next one waiting.
+/// That one is run by a dispatcher, and not here, as the answer may
+/// have come from the local caches, without ever leaving this stack.
+void DHTAtomStorage::nb_done(const NeighborhoodPtr& nb)
+{
+	std::function<void()> next;
+	{
+		std::lock_guard<std::mutex> lck(nb->mtx);
+		if (nb->waiting.empty())
+		{
+			nb->outstanding--;
+			return;
+		}
+		next = std::move(nb->waiting.front());
+		nb->waiting.pop_front();
+	}
+	async_run(nb->batch, std::move(next));
+}
+
+/// Fetch the Values on the Atom, and, if it is not yet at the edge,
+/// its holders. The Atom is `level` hops out from the start.
+void DHTAtomStorage::nb_visit(const NeighborhoodPtr& nb,
+                              const Handle& h, size_t level)
+{
+	{
+		std::lock_guard<std::mutex> lck(nb->mtx);
+		if (not nb->seen.insert(h).second) return;
+	}
+
+	std::weak_ptr<Neighborhood> wnb(nb);
+	nb_issue(nb, [this, wnb, h]()
+	{
+		NeighborhoodPtr nb(wnb.lock());
+		if (nullptr == nb) return;
+		async_fetch_values(nb->batch, h,
+			[this, nb](const Handle&) { nb_done(nb); });
+	});
+
+	if (nb->depth <= level) return;
+
+	nb_issue(nb, [this, wnb, h, level]()
+	{
+		NeighborhoodPtr nb(wnb.lock());
+		if (nullptr == nb) return;
+		async_fetch_incoming(nb->batch, h, nb->filter,
+			[this, nb, level](std::vector<dht::InfoHash>&& guids)
+			{
+				nb_done(nb);
+				for (const dht::InfoHash& guid : guids)
+					nb_holder(nb, guid, level + 1);
+			});
+	});
+}
+
+/// Fetch a holder, add it to the AtomTable, and visit it, and the
+/// other Atoms in it. Holders that can't be found, e.g. because they
+/// have expired, are skipped; this is a prefetch, and not a load.
+void DHTAtomStorage::nb_holder(const NeighborhoodPtr& nb,
+                               const dht::InfoHash& guid, size_t level)
+{
+	std::weak_ptr<Neighborhood> wnb(nb);
+	nb_issue(nb, [this, wnb, guid, level]()
+	{
+		NeighborhoodPtr nb(wnb.lock());
+		if (nullptr == nb) return;
+		async_fetch_atom(nb->batch, guid,
+			[this, nb, level](const Handle& got)
+			{
+				nb_done(nb);
+				if (nullptr == got) return;
+
+				// Holders recorded without a type are checked here.
+				if (NOTYPE != nb->type and got->get_type() != nb->type)
+					return;
+
+				Handle hin(nb->table->add(got, false));
+				nb_visit(nb, hin, level);
+				for (const Handle& ho : hin->getOutgoingSet())
+					nb_visit(nb, ho, level);
+			}, true);
+	});
+}
+
+/**
+ * Fetch the Atom's Values, and its neighborhood, out to `depth` hops,
+ * into the AtomTable. One hop goes from an Atom to a Link holding it,
+ * and across, to the other Atoms in that Link; they are all `depth`
+ * hops out. If `t` is not NOTYPE, only the holders of type `t` are
+ * followed. This blocks until everything has arrived. Returns the
+ * number of Atoms whose Values were fetched.
+ */
+size_t DHTAtomStorage::fetch_neighborhood(AtomTable& table, const Handle& h,
+                                          size_t depth, Type t)
+{
+	// The callbacks cannot wait on the DHT; find out how the keys
+	// are computed now.
+	merkle_guids();
+	if (0 < _base_name.size()) get_base_shards();
+
+	NeighborhoodPtr nb(std::make_shared<Neighborhood>());
+	nb->batch = new_batch();
+	nb->table = &table;
+	nb->filter = incoming_filter(t);
+	nb->type = t;
+	nb->depth = depth;
+
+	nb_visit(nb, table.add(h, false), 0);
+	wait_batch(nb->batch);
+	return nb->seen.size();
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,155 @@
+/*
+ * DHTOverlay.cc
+ * Read-write overlay AtomSpaces, on top of a read-only base.
+ *
+ * Many users share one large AtomSpace, the base, which none of them
+ * write to. Each user opens its own AtomSpace, the delta, with `base=`
+ * in the URI. Everything that is written goes to the delta, exactly as
+ * if there were no base. Reads look in the delta first, and then in
+ * the base:
+ *
+ * * Values: if the delta has a values record for the Atom, then that
+ *   is what the Atom has, even if the record is empty (the Values
+ *   were deleted). Otherwise, the base has the Values.
+ * * IncomingSets: the union of both; a delta record for a holder
+ *   replaces the base record for the same holder. Thus, deleting a
+ *   base holder marks it deleted in the delta.
+ * * Membership: the records from both, with the most recent "add" or
+ *   "drop" winning, as always. The base is read-only, so the delta's
+ *   records are the more recent ones.
+ *
+ * The Atom records (the GUIDs) are not per-AtomSpace, and so are
+ * shared. The delta must use the same kind of GUID as the base; a
+ * new delta adopts whatever the base uses.
+ *
+ * Base keys are never touched, and so never refreshed; keeping the
+ * base alive is up to whoever owns it (e.g. a seeder). Subscriptions
+ * see only the changes to the delta.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <string.h>
+
+#include <opencog/atoms/base/Atom.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+/// Look up the base layout, the first time around. A base that has
+/// no descriptor is either empty, or was written before sharding.
+size_t DHTAtomStorage::get_base_shards(void)
+{
+	if (_base_known) return _base_shards;
+
+	std::lock_guard<std::mutex> lck(_base_mutex);
+	if (_base_known) return _base_shards;
+
+	Layout lay;
+	_base_shards = fetch_num_shards(_base_hash, &lay);
+	_base_typed = lay.typed;
+	_base_merkle = lay.merkle;
+	_base_locality = lay.local;
+	_base_known = true;
+	return _base_shards;
+}
+
+/// Return the MUID of the Atom in the base AtomSpace. This is the
+/// same as get_membership(), but for the base; it is not cached, as
+/// it's cheap, given the GUID. (With graph-local placement, it costs
+/// one hash per level, down to the leftmost leaf.)
+dht::InfoHash DHTAtomStorage::get_base_membership(const Handle& h)
+{
+	dht::InfoHash mkey;
+	if (merkle_guids())
+	{
+		dht::InfoHash gkey(get_guid(h));
+		uint8_t buf[2 * dht::HASH_LEN];
+		memcpy(buf, _base_hash.data(), _base_hash.size());
+		memcpy(buf + _base_hash.size(), gkey.data(), gkey.size());
+		mkey = dht::InfoHash::get(buf, sizeof(buf));
+	}
+	else
+		mkey = dht::InfoHash::get(_base_name + encodeAtomToStr(h));
+
+	get_base_shards();
+	if (0 < _base_locality and h->is_link() and 0 < h->get_arity())
+		place_near(mkey, get_base_membership(h->getOutgoingAtom(0)),
+		           _base_locality);
+	return mkey;
+}
+
+/// Return the base membership keys, for all Atoms, if `t` is NOTYPE,
+/// else for Atoms of type `t`. If the base has no per-type index,
+/// then all of the keys are returned; the caller must filter.
+std::vector<dht::InfoHash> DHTAtomStorage::get_base_keys(Type t)
+{
+	size_t nshards = get_base_shards();
+	if (NOTYPE != t and _base_typed)
+		return get_type_shard_keys(_base_name, t, nshards);
+
+	std::vector<dht::InfoHash> keys = get_shard_keys(_base_name, nshards);
+	keys.push_back(_base_hash);
+	return keys;
+}
+
+/* ================================================================ */
+
+/// Get the key in the delta, and the same in the base, at the same
+/// time. The delta values override the base values with the same
+/// value->id.
+DHTAtomStorage::ValueVec
+DHTAtomStorage::get_overlay(const dht::InfoHash& key,
+                            const dht::InfoHash& basekey,
+                            const dht::Value::Filter& filter)
+{
+	ValueVec vals;
+	ValueVec bvals;
+	FetchBatchPtr batch(new_batch());
+	async_get(batch, key, filter,
+		[&vals](ValueVec&& got) { vals = std::move(got); });
+	async_get(batch, basekey, filter,
+		[&bvals](ValueVec&& got) { bvals = std::move(got); });
+	wait_batch(batch);
+
+	overlay_merge(vals, std::move(bvals));
+	return vals;
+}
+
+/// Add the base values to the delta values, unless the delta has one
+/// with the same value->id.
+void DHTAtomStorage::overlay_merge(ValueVec& vals, ValueVec&& bvals)
+{
+	std::set<dht::Value::Id> ids;
+	for (const auto& val : vals) ids.insert(val->id);
+	for (auto& bval : bvals)
+		if (ids.end() == ids.find(bval->id))
+			vals.emplace_back(std::move(bval));
+}
+
+/// The delta has no Values for the Atom; get them from the base.
+void DHTAtomStorage::async_fetch_base_values(const FetchBatchPtr& batch,
+                                             const Handle& h,
+                                             AtomCallback&& cb)
+{
+	dht::InfoHash buid = get_base_membership(h);
+	async_get(batch, buid, _values_filter,
+		[this, batch, h, buid, cb](ValueVec&& bvals)
+		{
+			if (0 < bvals.size())
+				disk_cache_put(buid, bvals);
+			else
+			{
+				want(buid, true);
+				disk_cache_get(buid, bvals);
+			}
+
+			AtomCallback acb(cb);
+			got_values(batch, h, bvals, std::move(acb));
+		});
+}
+
+/* ============================= END OF FILE ================= */
@@ -10,6 +10,7 @@
 
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/atomspace/BackingStore.h>
+#include <opencog/atoms/atom_types/NameServer.h>
 #include <opencog/guile/SchemePrimitive.h>
 
 #include "DHTAtomStorage.h"
@@ -51,7 +52,16 @@ void DHTPersistSCM::init(void)
     define_scheme_primitive("dht-bootstrap", &DHTPersistSCM::do_bootstrap, this, "persist-dht");
     define_scheme_primitive("dht-stats", &DHTPersistSCM::do_stats, this, "persist-dht");
     define_scheme_primitive("dht-clear-stats", &DHTPersistSCM::do_clear_stats, this, "persist-dht");
+    define_scheme_primitive("dht-metrics-string", &DHTPersistSCM::do_metrics, this, "persist-dht");
+    define_scheme_primitive("dht-prometheus", &DHTPersistSCM::do_prometheus, this, "persist-dht");
     define_scheme_primitive("dht-load-atomspace", &DHTPersistSCM::do_load_atomspace, this, "persist-dht");
+    define_scheme_primitive("dht-fetch-neighborhood-typename", &DHTPersistSCM::do_fetch_neighborhood, this, "persist-dht");
+    define_scheme_primitive("dht-store-atoms", &DHTPersistSCM::do_store_atoms, this, "persist-dht");
+    define_scheme_primitive("dht-set-lifetime", &DHTPersistSCM::do_set_lifetime, this, "persist-dht");
+    define_scheme_primitive("dht-listen-atomspace", &DHTPersistSCM::do_listen_atomspace, this, "persist-dht");
+    define_scheme_primitive("dht-listen-values", &DHTPersistSCM::do_listen_values, this, "persist-dht");
+    define_scheme_primitive("dht-listen-incoming", &DHTPersistSCM::do_listen_incoming, this, "persist-dht");
+    define_scheme_primitive("dht-unlisten", &DHTPersistSCM::do_unlisten, this, "persist-dht");
 
     define_scheme_primitive("dht-examine", &DHTPersistSCM::do_examine, this, "persist-dht");
     define_scheme_primitive("dht-atomspace-hash", &DHTPersistSCM::do_atomspace_hash, this, "persist-dht");
@@ -207,6 +217,105 @@ void DHTPersistSCM::do_load_atomspace(const std::string& asname)
     _backing->load_atomspace(_as, asname);
 }
 
+int DHTPersistSCM::do_fetch_neighborhood(const Handle& h, int depth,
+                                         const std::string& tname)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-fetch-neighborhood: Error: AtomSpace not connected to DHT!");
+
+    if (depth < 0)
+        throw RuntimeException(TRACE_INFO,
+            "dht-fetch-neighborhood: Error: depth must not be negative!");
+
+    Type t = NOTYPE;
+    if (0 < tname.size())
+    {
+        t = nameserver().getType(tname);
+        if (NOTYPE == t)
+            throw RuntimeException(TRACE_INFO,
+                "dht-fetch-neighborhood: Error: Unknown type %s", tname.c_str());
+    }
+
+    return _backing->fetch_neighborhood(_as->get_atomtable(), h, depth, t);
+}
+
+void DHTPersistSCM::do_store_atoms(const HandleSeq& hs)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-store-atoms: Error: AtomSpace not connected to DHT!");
+
+    _backing->storeAtoms(hs);
+}
+
+void DHTPersistSCM::do_set_lifetime(const std::string& policy, int minutes)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-lifetime: Error: AtomSpace not connected to DHT!");
+
+    if (minutes <= 0)
+        throw RuntimeException(TRACE_INFO,
+            "dht-set-lifetime: Error: lifetime must be positive!");
+
+    _backing->set_lifetime(policy, minutes);
+}
+
+int DHTPersistSCM::do_listen_atomspace(void)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-listen-atomspace: Error: AtomSpace not connected to DHT!");
+
+    return _backing->listen_atomspace();
+}
+
+int DHTPersistSCM::do_listen_values(const Handle& h)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-listen-values: Error: AtomSpace not connected to DHT!");
+
+    return _backing->listen_values(h);
+}
+
+int DHTPersistSCM::do_listen_incoming(const Handle& h)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-listen-incoming: Error: AtomSpace not connected to DHT!");
+
+    return _backing->listen_incoming(h);
+}
+
+void DHTPersistSCM::do_unlisten(int id)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-unlisten: Error: AtomSpace not connected to DHT!");
+
+    _backing->unlisten(id);
+}
+
+std::string DHTPersistSCM::do_metrics(void)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-metrics: Error: AtomSpace not connected to DHT!");
+
+    return _backing->dht_metrics();
+}
+
+std::string DHTPersistSCM::do_prometheus(void)
+{
+    if (nullptr == _backing)
+        throw RuntimeException(TRACE_INFO,
+            "dht-prometheus: Error: AtomSpace not connected to DHT!");
+
+    return _backing->dht_prometheus();
+}
+
 void DHTPersistSCM::do_stats(void)
 {
     if (nullptr == _backing) {
@@ -50,7 +50,16 @@ public:
 	std::string do_routing_tables_log(void);
 	std::string do_searches_log(void);
 	void do_load_atomspace(const std::string&);
+	int do_fetch_neighborhood(const Handle&, int, const std::string&);
+	void do_store_atoms(const HandleSeq&);
+	void do_set_lifetime(const std::string&, int);
+	int do_listen_atomspace(void);
+	int do_listen_values(const Handle&);
+	int do_listen_incoming(const Handle&);
+	void do_unlisten(int);
 
+	std::string do_metrics(void);
+	std::string do_prometheus(void);
 	void do_stats(void);
 	void do_clear_stats(void);
 }; // class
@@ -0,0 +1,457 @@
+/*
+ * DHTPutQueue.cc
+ * Write-behind, coalescing store queue.
+ *
+ * All puts are placed on a queue, and are handed to OpenDHT by a
+ * flusher thread. While a put is waiting in the queue, any later put
+ * to the same (key, value type, value id) replaces it; OpenDHT would
+ * have replaced it anyway, so there is no point in sending the earlier
+ * one. This happens a lot with Values that are updated over and over.
+ *
+ * The flusher hands over no more than `_put_window` puts at a time;
+ * the window is the number of puts that OpenDHT has not yet answered.
+ * The window grows as long as the puts are answered promptly, and is
+ * halved when they start taking longer (i.e. when puts are queueing
+ * up somewhere, either in OpenDHT or on the network). This replaces
+ * the older scheme of draining the OpenDHT queues every 500 Atoms,
+ * which was tuned by hand, for one particular machine.
+ *
+ * OpenDHT runs over UDP, and so puts get lost. Every put is tracked
+ * until OpenDHT answers it. Puts that fail are sent again, after a
+ * delay that doubles each time, until `_max_put_tries` sends have
+ * been made. A put that is not answered within `_put_timeout` is not
+ * sent again, as OpenDHT is still working on it; it is taken as a
+ * sign of congestion, and stays counted against the window until
+ * OpenDHT says how it went. A failure, or a late answer, halves the
+ * window. A retry is dropped if a later put gets to the same slot
+ * first; otherwise, the older value could land after the newer one.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <algorithm>
+
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+#define MIN_PUT_WINDOW 8
+#define MAX_PUT_WINDOW 1024
+#define PUT_RETRY_DELAY std::chrono::milliseconds(100)  // then 200, 400 ...
+
+/// Queue a put. Returns immediately, unless the queue is full, in
+/// which case it waits until there is room.
+/// If given, `acked` is called once OpenDHT has stored the value, or
+/// a later one that replaced it in the queue; it is not called if the
+/// put fails.
+void DHTAtomStorage::queue_put(const dht::InfoHash& key, dht::Value&& val,
+                               bool touch, PutAcked&& acked)
+{
+	// Whatever is written is in use; keep it from expiring. Refreshes
+	// themselves do not count, else nothing would ever go cold.
+	if (touch) touch_key(key);
+
+	std::unique_lock<std::mutex> lck(_put_mutex);
+	bool queued = enqueue_put(lck, key, std::move(val), std::move(acked));
+	lck.unlock();
+	if (queued) _put_cv.notify_one();
+}
+
+/// Queue several puts to the same key, taking the lock just once.
+void DHTAtomStorage::queue_puts(const dht::InfoHash& key,
+                                std::vector<dht::Value>&& vals)
+{
+	touch_key(key);
+
+	bool queued = false;
+	std::unique_lock<std::mutex> lck(_put_mutex);
+	for (dht::Value& val : vals)
+		queued = enqueue_put(lck, key, std::move(val)) or queued;
+	lck.unlock();
+	if (queued) _put_cv.notify_one();
+}
+
+/// Queue the puts of a refresh. These are what the DHT had a moment
+/// ago; a put of our own to the same slot, that is still queued, or
+/// not yet answered, is newer, and so the refresh is dropped.
+void DHTAtomStorage::queue_refresh(const dht::InfoHash& key,
+                                   const ValueVec& vals)
+{
+	bool queued = false;
+	std::unique_lock<std::mutex> lck(_put_mutex);
+	for (const auto& val : vals)
+	{
+		if (dht::Value::INVALID_ID != val->id)
+		{
+			PutSlot slot(key, val->type, val->id);
+			if (_put_slots.end() != _put_slots.find(slot) or
+			    _put_latest.end() != _put_latest.find(slot))
+				continue;
+		}
+		queued = enqueue_put(lck, key, dht::Value(*val)) or queued;
+	}
+	lck.unlock();
+	if (queued) _put_cv.notify_one();
+}
+
+/// Put the value on the queue, or replace the one there in the same
+/// slot. Returns true if it was added to the queue. Call with the put
+/// mutex held; if the queue is full, this waits for room.
+bool DHTAtomStorage::enqueue_put(std::unique_lock<std::mutex>& lck,
+                                 const dht::InfoHash& key, dht::Value&& val,
+                                 PutAcked&& acked)
+{
+	PutSlot slot(key, val.type, val.id);
+	bool slotted = (dht::Value::INVALID_ID != val.id);
+	while (true)
+	{
+		// Values without an id get a random one, and so cannot be
+		// coalesced. The new value is fresh; it gets all of its tries,
+		// even if the one that it replaces is a retry.
+		if (slotted)
+		{
+			const auto& it = _put_slots.find(slot);
+			if (_put_slots.end() != it)
+			{
+				// A delta of the Values must not lose the keys of the
+				// one that it replaces.
+				if (_merge_values and VALUES_BIN_ID == val.type)
+					merge_queued_values(*it->second->val, val);
+				it->second->val = std::make_shared<dht::Value>(std::move(val));
+				it->second->acked = std::move(acked);
+				it->second->tries = 0;
+				_num_puts_coalesced++;
+				return false;
+			}
+		}
+
+		if (_put_queue.size() < _max_queued or _flush_stop) break;
+
+		// Whatever was queued so far has to go, to make room.
+		_put_cv.notify_one();
+		_drain_cv.wait(lck);
+	}
+
+	// OpenDHT would pick the id itself, on its own thread, while we
+	// may be looking at it; pick it here.
+	if (not slotted) val.id = _put_ids();
+
+	QueuedPutPtr qp(std::make_shared<QueuedPut>());
+	qp->key = key;
+	qp->val = std::make_shared<dht::Value>(std::move(val));
+	qp->slotted = slotted;
+	qp->acked = std::move(acked);
+	_put_queue.push_back(qp);
+	if (slotted)
+		_put_slots.emplace(slot, qp);
+	_num_puts_queued++;
+	return true;
+}
+
+/// The flusher thread. Hand puts to OpenDHT, as the window allows.
+void DHTAtomStorage::flush_loop(void)
+{
+	std::unique_lock<std::mutex> lck(_put_mutex);
+	while (true)
+	{
+		auto now = std::chrono::steady_clock::now();
+		expire_puts(now);
+		requeue_puts(now);
+		if (_flush_stop) return;
+
+		if (_put_queue.empty() or _put_window <= _puts_outstanding)
+		{
+			_put_cv.wait_until(lck, next_put_wake(now));
+			continue;
+		}
+
+		std::vector<QueuedPutPtr> chunk;
+		while (not _put_queue.empty() and
+		       _puts_outstanding + chunk.size() < _put_window)
+		{
+			QueuedPutPtr qp(_put_queue.front());
+			_put_queue.pop_front();
+			if (qp->slotted)
+			{
+				PutSlot slot(qp->key, qp->val->type, qp->val->id);
+				_put_slots.erase(slot);
+				_put_latest[slot] = qp;
+			}
+			qp->tries++;
+			qp->sent = now;
+			qp->late = false;
+			_put_inflight.insert(qp);
+			chunk.emplace_back(std::move(qp));
+		}
+		_puts_outstanding += chunk.size();
+		lck.unlock();
+
+		// There's room in the queue now.
+		_drain_cv.notify_all();
+
+		// Group the puts by key, so that puts to the same key go out
+		// together, and share one OpenDHT search. The sort is stable,
+		// so that puts to any one key stay in order.
+		std::stable_sort(chunk.begin(), chunk.end(),
+			[](const QueuedPutPtr& a, const QueuedPutPtr& b)
+			{ return a->key < b->key; });
+
+		for (const QueuedPutPtr& qp : chunk)
+		{
+			dht::ValueType::Id vtype = qp->val->type;
+			size_t tries = qp->tries;
+			_runner.put(qp->key, qp->val,
+				[this, qp, tries, now, vtype](bool ok)
+				{ put_done(qp, tries, ok, now, vtype); });
+			_num_puts_sent++;
+		}
+
+		lck.lock();
+	}
+}
+
+/// Called by OpenDHT when a put has been answered (or has failed).
+/// `tries` says which send of the put this is the answer to.
+void DHTAtomStorage::put_done(const QueuedPutPtr& qp, size_t tries, bool ok,
+                              std::chrono::steady_clock::time_point start,
+                              dht::ValueType::Id vtype)
+{
+	auto done = std::chrono::steady_clock::now();
+	auto latency = done - start;
+	_put_latency[metric_of(vtype)].record(latency);
+
+	std::unique_lock<std::mutex> lck(_put_mutex);
+
+	// Each send is answered exactly once; a put is never sent again
+	// while OpenDHT still has it. This is just in case.
+	if (qp->tries != tries or 0 == _put_inflight.erase(qp)) return;
+
+	_puts_outstanding--;
+	_put_progress = done;
+	PutAcked acked;
+	if (not ok)
+		put_failed(qp, done);
+	else
+	{
+		forget_put(qp);
+		acked.swap(qp->acked);
+
+		// Additive increase (per put; thus the window doubles every
+		// round-trip) as long as the latency stays close to the best
+		// seen so far. Multiplicative decrease, at most once per
+		// window, when it does not. A late put already counted as a
+		// loss, when it went late.
+		if (latency < _put_rtt_min) _put_rtt_min = latency;
+		if (not qp->late)
+		{
+			_acks_since_cut++;
+			if (latency <= 2 * _put_rtt_min + std::chrono::milliseconds(2))
+			{
+				if (_put_window < MAX_PUT_WINDOW) _put_window++;
+			}
+			else if (_put_window <= _acks_since_cut)
+				cut_put_window();
+		}
+	}
+	lck.unlock();
+
+	if (acked) acked();
+	_put_cv.notify_one();
+	_drain_cv.notify_all();
+}
+
+/* ================================================================ */
+// Retries. All of these are called with the _put_mutex held.
+
+void DHTAtomStorage::cut_put_window(void)
+{
+	_put_window = std::max((size_t) MIN_PUT_WINDOW, _put_window / 2);
+	_acks_since_cut = 0;
+}
+
+/// True if a later put to the same slot is queued, or was sent.
+/// Deltas of the Values are never quite stale: a queued one takes
+/// on the keys of the failed one, and, for one that was sent, the
+/// failed one is re-sent with just the keys that it doesn't have.
+bool DHTAtomStorage::put_is_stale(const QueuedPutPtr& qp)
+{
+	if (not qp->slotted) return false;
+	bool delta = _merge_values and VALUES_BIN_ID == qp->val->type;
+
+	PutSlot slot(qp->key, qp->val->type, qp->val->id);
+	const auto& qit = _put_slots.find(slot);
+	if (_put_slots.end() != qit)
+	{
+		if (delta)
+		{
+			dht::Value val(*qit->second->val);
+			merge_queued_values(*qp->val, val);
+			qit->second->val = std::make_shared<dht::Value>(std::move(val));
+			qit->second->tries = 0;
+		}
+		return true;
+	}
+
+	const auto& it = _put_latest.find(slot);
+	if (_put_latest.end() == it or it->second == qp) return false;
+	if (not delta) return true;
+
+	dht::Value val(*qp->val);
+	if (not rebase_values(val, *it->second->val)) return true;
+	qp->val = std::make_shared<dht::Value>(std::move(val));
+	return false;
+}
+
+/// The put is done with, one way or another.
+void DHTAtomStorage::forget_put(const QueuedPutPtr& qp)
+{
+	if (not qp->slotted) return;
+
+	const auto& it = _put_latest.find(
+		PutSlot(qp->key, qp->val->type, qp->val->id));
+	if (_put_latest.end() != it and it->second == qp)
+		_put_latest.erase(it);
+}
+
+/// The put failed; schedule another try.
+void DHTAtomStorage::put_failed(const QueuedPutPtr& qp,
+                                std::chrono::steady_clock::time_point now)
+{
+	// Losses come in bunches; cut at most once per window. A late
+	// put was already counted.
+	if (not qp->late) put_lost();
+
+	if (_max_put_tries <= qp->tries)
+	{
+		logger().warn("DHT put to %s failed after %zu tries",
+			qp->key.toString().c_str(), qp->tries);
+		_num_puts_failed++;
+		forget_put(qp);
+		return;
+	}
+	if (put_is_stale(qp)) return;
+
+	auto delay = PUT_RETRY_DELAY * (1 << std::min(qp->tries - 1, (size_t) 6));
+	_put_retries.emplace(now + delay, qp);
+	_num_put_retries++;
+}
+
+/// A put was lost, or is late; this is congestion.
+void DHTAtomStorage::put_lost(void)
+{
+	_acks_since_cut++;
+	if (_put_window <= _acks_since_cut)
+		cut_put_window();
+}
+
+/// Note the puts that were sent too long ago. They are not sent again,
+/// and they still count against the window: OpenDHT still has them,
+/// and will say, sooner or later, how they went.
+void DHTAtomStorage::expire_puts(std::chrono::steady_clock::time_point now)
+{
+	for (const QueuedPutPtr& qp : _put_inflight)
+	{
+		if (qp->late or now < qp->sent + _put_timeout) continue;
+		qp->late = true;
+		_num_puts_lost++;
+		put_lost();
+	}
+}
+
+/// Put the retries that are due at the front of the queue.
+void DHTAtomStorage::requeue_puts(std::chrono::steady_clock::time_point now)
+{
+	while (not _put_retries.empty() and _put_retries.begin()->first <= now)
+	{
+		QueuedPutPtr qp(_put_retries.begin()->second);
+		_put_retries.erase(_put_retries.begin());
+		if (put_is_stale(qp)) continue;
+
+		_put_queue.push_front(qp);
+		if (qp->slotted)
+			_put_slots.emplace(PutSlot(qp->key, qp->val->type, qp->val->id), qp);
+		_put_progress = now;
+	}
+}
+
+/// When the flusher next has to look at the retries and at the puts
+/// that are outstanding.
+std::chrono::steady_clock::time_point
+DHTAtomStorage::next_put_wake(std::chrono::steady_clock::time_point now)
+{
+	auto wake = now + _put_timeout;
+	if (not _put_retries.empty() and _put_retries.begin()->first < wake)
+		wake = _put_retries.begin()->first;
+	for (const QueuedPutPtr& qp : _put_inflight)
+		if (not qp->late and qp->sent + _put_timeout < wake)
+			wake = qp->sent + _put_timeout;
+	return wake;
+}
+
+/* ================================================================== */
+/// Drain the pending store queue. This is a fencing operation; the
+/// goal is to make sure that all writes that occurred before the
+/// barrier really are performed before before all the writes after
+/// the barrier.
+///
+/// This waits until all queued puts have been handed to OpenDHT,
+/// and OpenDHT has acknowledged all of them, or they have failed
+/// after all of their retries. If OpenDHT stops answering for longer
+/// than `_wait_time`, then this gives up, with a warning.
+void DHTAtomStorage::barrier()
+{
+	// The filters are put at most once a second; put the rest now.
+	if (not _observing_only) bloom_publish();
+
+	// First, wait for the value checks made by store_atom_values();
+	// these may result in more puts.
+	FetchBatchPtr checks;
+	{
+		std::lock_guard<std::mutex> clck(_check_mutex);
+		checks.swap(_check_batch);
+	}
+	if (checks)
+	{
+		try { wait_batch(checks); }
+		catch (const std::exception& ex)
+		{
+			logger().warn("DHT barrier: value checks failed: %s", ex.what());
+
+			// The abandoned checks will never complete; forget about
+			// them, so that the Atoms get checked again next time.
+			_values_state.erase_if(
+				[](const Handle&, ValuesState vs)
+				{ return VALUES_CHECKING == vs; });
+		}
+	}
+
+	std::unique_lock<std::mutex> lck(_put_mutex);
+	_put_progress = std::chrono::steady_clock::now();
+	while (not _put_queue.empty() or 0 < _puts_outstanding or
+	       not _put_retries.empty())
+	{
+		auto deadline = _put_progress + _wait_time;
+		if (deadline <= std::chrono::steady_clock::now())
+		{
+			logger().warn("DHT barrier: giving up with %zu puts queued, "
+				"%zu unanswered and %zu to retry", _put_queue.size(),
+				_puts_outstanding, _put_retries.size());
+			_num_barrier_timeouts++;
+			break;
+		}
+		_drain_cv.wait_until(lck, deadline);
+	}
+	lck.unlock();
+
+	// Calling this twice seems to cause all queues to be drained:
+	// The first time, its the high-priority queue, and the second
+	// time, the regular queue.
+	_runner.loop();
+	_runner.loop();
+}
+
+/* ============================= END OF FILE ================= */
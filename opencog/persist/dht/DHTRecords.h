@@ -0,0 +1,122 @@
+/*
+ * FILE:
+ * opencog/persist/dht/DHTRecords.h
+
+ * FUNCTION:
+ * Binary (msgpack) wire format for Atoms and Values.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_DHT_RECORDS_H
+#define _OPENCOG_DHT_RECORDS_H
+
+#include <string>
+#include <vector>
+
+#include <opendht.h>
+
+#include <opencog/atoms/atom_types/types.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+// Bump this whenever the layout of the records below changes.
+// Decoders must reject records with a version they do not know.
+#define DHT_WIRE_VERSION 1
+
+// Values records that use the merge fields (`d`, `x` and `c`, below)
+// carry this version instead; older decoders must not mistake a delta
+// for all of the Values. Those that don't are still version 1.
+#define DHT_MERGE_VERSION 2
+
+// Types are sent as the raw integer Type. This requires that all
+// peers have loaded the same atom type modules, in the same order.
+
+/// The naked, immutable Atom. Nodes carry the name; Links carry the
+/// GUIDs of their outgoing set, instead of a recursive rendering.
+struct AtomRecord
+{
+	uint8_t v = DHT_WIRE_VERSION;
+	Type t = 0;
+	std::string n;
+	std::vector<dht::InfoHash> o;
+
+	MSGPACK_DEFINE_MAP(v, t, n, o)
+};
+
+/// A single Value. FloatValues and TruthValues carry their raw IEEE
+/// doubles in `f`, StringValues carry `s` and LinkValues carry `l`.
+/// Anything else, e.g. an Atom in a LinkValue, is carried in `x`, as
+/// an s-expression. Records written before `x` was added decode with
+/// it empty.
+struct ValueRecord
+{
+	Type t = 0;
+	std::vector<double> f;
+	std::vector<std::string> s;
+	std::vector<ValueRecord> l;
+	std::string x;
+
+	MSGPACK_DEFINE_MAP(t, f, s, l, x)
+};
+
+/// One writer's share of the count of a CountTruthValue. Shares are
+/// merged by keeping, for each writer `w`, the one with the highest
+/// sequence number `q`. The count is the sum of the shares.
+struct CountRecord
+{
+	uint64_t w = 0;
+	uint64_t q = 0;
+	double n = 0.0;
+
+	MSGPACK_DEFINE_MAP(w, q, n)
+};
+
+/// One key-value pair on an Atom. The key is given by its GUID.
+/// CountTruthValues that are merged carry the shares in `c`.
+struct KeyValueRecord
+{
+	dht::InfoHash k;
+	ValueRecord val;
+	std::vector<CountRecord> c;
+
+	MSGPACK_DEFINE_MAP(k, val, c)
+};
+
+/// All of the Values on an Atom. A delta (`d` is set) holds only the
+/// keys that changed, and lists the keys that were removed in `x`;
+/// it is merged into the record already in the DHT.
+struct ValuesRecord
+{
+	uint8_t v = DHT_WIRE_VERSION;
+	std::vector<KeyValueRecord> kvs;
+	bool d = false;
+	std::vector<dht::InfoHash> x;
+
+	MSGPACK_DEFINE_MAP(v, kvs, d, x)
+};
+
+/// A Bloom filter over the MUIDs of the Atoms in one membership
+/// shard; see BloomFilter.h and DHTBloom.cc. The bits are OR'ed
+/// together by the DHT nodes, when several writers put them.
+struct BloomRecord
+{
+	uint8_t v = DHT_WIRE_VERSION;
+	uint32_t k = 0;
+	std::vector<uint8_t> b;
+
+	MSGPACK_DEFINE_MAP(v, k, b)
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_DHT_RECORDS_H
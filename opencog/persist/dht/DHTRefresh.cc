@@ -0,0 +1,238 @@
+/*
+ * DHTRefresh.cc
+ * Data lifetimes, and keeping what is in use from expiring.
+ *
+ * DHT nodes forget what was put, after the lifetime of the value type
+ * runs out. Short lifetimes keep the DHT from filling up with junk,
+ * but then, anything still in use must be put again, before it
+ * expires. Every key that is put or fetched is touched; the keys
+ * touched within the last `_hot_window` are re-put, once every refresh
+ * period. The membership shards are pinned: they are re-put for as
+ * long as we're running, as they're the only way to find the Atoms in
+ * the AtomSpace.
+ *
+ * A refresh first gets the key, and then puts back what the DHT had.
+ * A refresh put is dropped if a put of our own to the same slot is
+ * still queued, or unanswered, as ours is newer. A put made by some
+ * other writer, between the get and the put, can still be undone,
+ * until that writer puts it again. If there is a disk cache, it is
+ * updated from the DHT, and then what's on disk is put back; this
+ * restores values that have already expired.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <limits>
+#include <thread>
+
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+#define PINNED std::numeric_limits<time_t>::max()
+
+/// Mark the key as being in use. Pinned keys are always in use, and
+/// are never evicted from the hot keys.
+void DHTAtomStorage::touch_key(const dht::InfoHash& key, bool pin)
+{
+	if (pin)
+	{
+		_hot_keys.pin(key, PINNED);
+		return;
+	}
+	time_t t = time(0);
+	if (_hot_keys.update(key,
+		[t](time_t& last) { if (PINNED != last) last = t; }))
+		return;
+	_hot_keys.try_insert(key, t);
+}
+
+/// Return the keys touched since `since`, and the pinned keys. The
+/// others are forgotten.
+std::vector<dht::InfoHash> DHTAtomStorage::get_hot_keys(time_t since)
+{
+	std::vector<dht::InfoHash> keys;
+	_hot_keys.erase_if(
+		[&keys, since](const dht::InfoHash& key, time_t last)
+		{
+			if (last < since) return true;
+			keys.push_back(key);
+			return false;
+		});
+	return keys;
+}
+
+/* ================================================================ */
+
+/// Refresh the key in the DHT. If the DHT has anything on the key,
+/// that wins over what's on disk.
+void DHTAtomStorage::reseed_key(const FetchBatchPtr& batch,
+                                const dht::InfoHash& key)
+{
+	async_get(batch, key, {},
+		[this, key](ValueVec&& dvals)
+		{
+			disk_cache_put(key, dvals);
+			ValueVec cvals;
+			if (disk_cache_get(key, cvals))
+				reseed(key, cvals);
+			else
+				reseed(key, dvals);
+		});
+}
+
+void DHTAtomStorage::reseed(const dht::InfoHash& key, const ValueVec& vals)
+{
+	queue_refresh(key, vals);
+}
+
+/// The refresh period: either as given in the URI, or else half of
+/// the shortest lifetime.
+std::chrono::seconds DHTAtomStorage::refresh_period(void)
+{
+	if (0 < _refresh_param.size() and _refresh_param.compare("off"))
+		return std::chrono::seconds(
+			strtoul(_refresh_param.c_str(), nullptr, 10));
+
+	std::lock_guard<std::mutex> lck(_policy_mutex);
+	dht::duration shortest = std::min(
+		std::min(_atom_policy.expiration, _space_policy.expiration),
+		std::min(_values_policy.expiration, _incoming_policy.expiration));
+	return std::chrono::duration_cast<std::chrono::seconds>(shortest) / 2;
+}
+
+/// Refresh every refresh period, until `stop` is set. Report any
+/// errors on the `watch` batch, if there is one.
+void DHTAtomStorage::refresh_loop(const std::atomic<bool>& stop,
+                                  const FetchBatchPtr& watch)
+{
+	auto last = std::chrono::steady_clock::now();
+	while (not stop)
+	{
+		// The period may change, if the lifetimes are changed.
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		std::chrono::seconds period = refresh_period();
+		if (0 == period.count()) period = std::chrono::seconds(1);
+		if (std::chrono::steady_clock::now() < last + period) continue;
+		last = std::chrono::steady_clock::now();
+
+		if (watch)
+		{
+			std::lock_guard<std::mutex> lck(watch->mtx);
+			if (not watch->error.empty())
+				logger().warn("DHT refresh: %s", watch->error.c_str());
+			watch->error.clear();
+		}
+
+		refresh_keys(stop);
+	}
+}
+
+/// Re-put everything that is in use, at no more than `_refresh_rate`
+/// keys per second.
+void DHTAtomStorage::refresh_keys(const std::atomic<bool>& stop)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::vector<dht::InfoHash> keys(
+		get_hot_keys(time(0) - _hot_window.count()));
+
+	FetchBatchPtr batch(new_batch());
+	auto tick = start;
+	size_t nsent = 0;
+	for (const dht::InfoHash& key : keys)
+	{
+		if (stop) break;
+		reseed_key(batch, key);
+		nsent++;
+		if (0 < _refresh_rate and 0 == nsent % _refresh_rate)
+		{
+			tick += std::chrono::seconds(1);
+			std::this_thread::sleep_until(tick);
+		}
+	}
+
+	try
+	{
+		wait_batch(batch);
+	}
+	catch (const std::exception& ex)
+	{
+		logger().warn("DHT refresh: failed: %s", ex.what());
+		return;
+	}
+
+	std::chrono::duration<double> secs =
+		std::chrono::steady_clock::now() - start;
+	logger().info("DHT refresh: %zu of %zu keys in %.1f secs",
+		nsent, keys.size(), secs.count());
+}
+
+/* ================================================================ */
+
+/// Change how long DHT nodes keep what is put. This only affects the
+/// local DHT node; the other nodes use whatever they were told.
+void DHTAtomStorage::set_expiration(dht::ValueType& policy,
+                                    std::chrono::minutes life)
+{
+	policy.expiration = life;
+	_runner.registerType(policy);
+}
+
+/**
+ * Set the lifetime, in minutes, of the named policy: one of "atom",
+ * "space", "values" or "incoming". Values put from now on get this
+ * lifetime on the local DHT node; the other DHT nodes are configured
+ * separately. The refresh period follows, unless it was fixed in
+ * the URI.
+ */
+void DHTAtomStorage::set_lifetime(const std::string& policy, size_t minutes)
+{
+	if (0 == minutes)
+		throw RuntimeException(TRACE_INFO, "The lifetime must not be zero");
+
+	std::chrono::minutes life(minutes);
+	std::lock_guard<std::mutex> lck(_policy_mutex);
+	if (0 == policy.compare("atom"))
+	{
+		set_expiration(_atom_policy, life);
+		set_expiration(_atom_bin_policy, life);
+	}
+	else if (0 == policy.compare("space"))
+	{
+		set_expiration(_space_policy, life);
+		set_expiration(_bloom_policy, life);
+	}
+	else if (0 == policy.compare("values"))
+	{
+		set_expiration(_values_policy, life);
+		set_expiration(_values_bin_policy, life);
+	}
+	else if (0 == policy.compare("incoming"))
+		set_expiration(_incoming_policy, life);
+	else
+		throw RuntimeException(TRACE_INFO,
+			"Unknown policy '%s'; expecting atom, space, values or incoming",
+			policy.c_str());
+}
+
+/// Return the lifetimes, in minutes, for printing.
+std::string DHTAtomStorage::get_lifetimes(void)
+{
+	auto mins = [](const dht::ValueType& policy)
+	{
+		return std::to_string(std::chrono::duration_cast<std::chrono::minutes>(
+			policy.expiration).count());
+	};
+
+	std::lock_guard<std::mutex> lck(_policy_mutex);
+	return "atom " + mins(_atom_policy)
+		+ " space " + mins(_space_policy)
+		+ " values " + mins(_values_policy)
+		+ " incoming " + mins(_incoming_policy);
+}
+
+/* ============================= END OF FILE ================= */
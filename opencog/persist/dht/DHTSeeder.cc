@@ -0,0 +1,201 @@
+/*
+ * DHTSeeder.cc
+ * Keep an AtomSpace alive in the DHT, from a local disk copy.
+ *
+ * A seeder keeps a copy of everything in the disk cache, and puts it
+ * back when the DHT loses it: the nodes drop what was put after
+ * `lifetime` minutes, and whatever they held when they go away.
+ *
+ * The seeder listens on the membership shards; every Atom that is
+ * added (or dropped) is thus seen as it happens. The Atom, and the
+ * Values and IncomingSet on it, are fetched and saved to disk. The
+ * Atom is then "hot": it is re-put before it expires, for as long
+ * as it stays hot. The Values are re-fetched first, so that the DHT
+ * copy, if there is one, wins over the disk copy.
+ *
+ * Atoms that no one has touched in a while go cold, and are allowed
+ * to expire. When a client fails to find one, or its Values, it puts
+ * a "want" request for it; the seeder answers by putting it back.
+ * Thus, cold Atoms cost the DHT nothing. The membership shards are
+ * never cold.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <random>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/util/Logger.h>
+
+#include "DHTAtomStorage.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+/// Ask the seeders, if any, to put the key back into the DHT. If
+/// `base`, ask the seeders of the base AtomSpace, instead. Each
+/// request gets its own value->id, so that the seeders see each one,
+/// even when the same key is asked for again.
+void DHTAtomStorage::want(const dht::InfoHash& key, bool base)
+{
+	if (_observing_only) return;
+
+	static thread_local std::mt19937_64 rng(std::random_device{}());
+	_num_wants_sent++;
+	dht::InfoHash wkey(base ?
+		dht::InfoHash::get(_base_name + "want") : _want_key);
+	queue_put(wkey, dht::Value(_want_policy, key, rng()), false);
+}
+
+/* ================================================================ */
+
+/// A membership record arrived on the shard. Save it, and go get
+/// the Atom that it names.
+void DHTAtomStorage::seed_member(const FetchBatchPtr& batch,
+                                 const dht::InfoHash& shard,
+                                 const std::shared_ptr<dht::Value>& val)
+{
+	disk_cache_put(shard, *val);
+
+	// The shard descriptor, or something unknown.
+	std::string rec = val->unpack<std::string>();
+	bool added;
+	double ts;
+	size_t pos;
+	if (not parse_member(rec, added, ts, pos)) return;
+	Handle h(decodeStrAtom(rec, pos));
+
+	// The same record goes onto the per-type shard. There's no need
+	// to listen there; it's enough to keep a copy.
+	if (_type_index)
+	{
+		dht::InfoHash tshard = get_type_shard(h);
+		disk_cache_put(tshard, *val);
+		touch_key(tshard, true);
+	}
+
+	seed_atom(batch, h);
+}
+
+/// Save the Atom, and the Values and IncomingSet on it.
+void DHTAtomStorage::seed_atom(const FetchBatchPtr& batch, const Handle& h)
+{
+	dht::InfoHash guid = get_guid(h);
+	dht::InfoHash muid = get_membership(h);
+	touch_key(guid);
+	touch_key(muid);
+
+	// The Atom never changes; once is enough.
+	ValueVec cvals;
+	if (not disk_cache_get(guid, cvals))
+		async_get(batch, guid, {},
+			[this, guid](ValueVec&& gvals) { disk_cache_put(guid, gvals); });
+
+	async_get(batch, muid, {},
+		[this, muid](ValueVec&& mvals) { disk_cache_put(muid, mvals); });
+}
+
+/// A client could not find the key. Put it back, if we have it.
+void DHTAtomStorage::seed_want(const FetchBatchPtr& batch,
+                               const dht::InfoHash& key)
+{
+	_num_wants_seen++;
+	ValueVec cvals;
+	if (not disk_cache_get(key, cvals)) return;
+	_num_wants_answered++;
+	touch_key(key);
+	reseed(key, cvals);
+
+	// If it's an Atom, then the Values are sure to be wanted next.
+	for (const auto& cval : cvals)
+	{
+		if (ATOM_ID != cval->type and ATOM_BIN_ID != cval->type) continue;
+		async_fetch_atom(batch, key,
+			[this, batch](const Handle& h)
+			{
+				dht::InfoHash muid = get_membership(h);
+				touch_key(muid);
+				reseed_key(batch, muid);
+			});
+		return;
+	}
+}
+
+/* ================================================================ */
+
+/**
+ * Keep the currently open AtomSpace alive in the DHT, until `stop`
+ * is set. See refresh_loop() for how, and how often.
+ *
+ * This needs a disk cache; see the `cache=` URI parameter.
+ */
+void DHTAtomStorage::run_seeder(const std::atomic<bool>& stop)
+{
+	if (_observing_only)
+		throw IOException(TRACE_INFO, "DHT Node is only observing!");
+
+	if (nullptr == _disk_cache)
+		throw IOException(TRACE_INFO,
+			"The seeder needs a disk cache; use the cache= URI parameter");
+
+	// The seeder refreshes on this thread, not on its own.
+	_refresh_stop = true;
+	if (_refresh_thread.joinable()) _refresh_thread.join();
+
+	// Find out how the AtomSpace is laid out; this also publishes
+	// the layout, if the AtomSpace is new.
+	get_num_shards();
+
+	// Everything triggered by the listeners goes on this batch. No
+	// one waits on it; errors are reported by refresh_loop().
+	FetchBatchPtr batch(new_batch());
+
+	std::vector<dht::InfoHash> keys(_shard_keys);
+	keys.push_back(_atomspace_hash);
+
+	std::vector<std::pair<dht::InfoHash, std::shared_future<size_t>>> tokens;
+	for (const dht::InfoHash& key : keys)
+	{
+		touch_key(key, true);
+
+		// These run on the OpenDHT thread; hand off to the
+		// dispatchers. Expired values are ignored; we still have
+		// them, and they'll be put back.
+		tokens.emplace_back(key, _runner.listen(key,
+			[this, batch, key](const ValueVec& vals, bool expired)
+			{
+				if (expired) return true;
+				for (const auto& val : vals)
+					async_run(batch,
+						[this, batch, key, val]()
+						{ seed_member(batch, key, val); });
+				return true;
+			},
+			dht::Value::TypeFilter(_space_policy)));
+	}
+
+	tokens.emplace_back(_want_key, _runner.listen(_want_key,
+		[this, batch](const ValueVec& vals, bool expired)
+		{
+			if (expired) return true;
+			for (const auto& val : vals)
+			{
+				dht::InfoHash key = val->unpack<dht::InfoHash>();
+				async_run(batch,
+					[this, batch, key]() { seed_want(batch, key); });
+			}
+			return true;
+		},
+		dht::Value::TypeFilter(_want_policy)));
+
+	logger().info("Seeder: seeding %s every %ld secs",
+		_atomspace_name.c_str(), (long) refresh_period().count());
+
+	refresh_loop(stop, batch);
+
+	for (const auto& tok : tokens)
+		_runner.cancelListen(tok.first, tok.second);
+}
+
+/* ============================= END OF FILE ================= */
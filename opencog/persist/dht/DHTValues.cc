@@ -15,6 +15,7 @@
 #include <opencog/atoms/truthvalue/TruthValue.h>
 
 #include "DHTAtomStorage.h"
+#include "SexprReader.h"
 
 using namespace opencog;
 
@@ -30,13 +31,63 @@ void DHTAtomStorage::store_atom_values(const Handle& atom)
 
 	// If there are no keys currently on the atom, but there are values
 	// in the DHT, then we need to clobber the values in the DHT.  Try
-	// to avoid having to to a put, by doing a get first.  Maybe we can
-	// get more efficient by caching?
+	// to avoid having to to a put. If we know what's in the DHT,
+	// because we put it there, or fetched it from there, then we can
+	// decide right away. Otherwise, check, but don't wait for the
+	// answer; barrier() waits for all outstanding checks.
 	if (0 == atom->getKeys().size())
 	{
-		auto dvals = get_stuff(muid, _values_filter);
-		if (0 < dvals.size())
-			delete_atom_values(atom);
+		// If a check is in progress, it will clobber as needed.
+		// If some other thread just now started a check, let it.
+		ValuesState vs;
+		if (_values_state.get(atom, vs))
+		{
+			if (VALUES_PRESENT == vs) delete_atom_values(atom);
+			return;
+		}
+
+		// The Bloom filters are not asked: they may be as much as
+		// `bloom_refresh` out of date, and whatever is found here is
+		// remembered.
+		if (not _values_state.try_insert(atom, VALUES_CHECKING)) return;
+
+		FetchBatchPtr batch;
+		{
+			std::lock_guard<std::mutex> lck(_check_mutex);
+			if (nullptr == _check_batch) _check_batch = new_batch();
+			batch = _check_batch;
+		}
+
+		async_get(batch, muid, _values_filter,
+			[this, batch, atom](ValueVec&& dvals)
+			{
+				// Values were stored or deleted while we were
+				// waiting; those override whatever we found.
+				// If the entry was evicted from the cache, then we
+				// don't know; go by what the Atom has now.
+				bool checking = false;
+				bool known = _values_state.update(atom,
+					[&checking](ValuesState& vs)
+					{
+						checking = (VALUES_CHECKING == vs);
+						if (checking) vs = VALUES_ABSENT;
+					});
+				if (not known)
+					checking = (0 == atom->getKeys().size());
+				if (checking and has_values(dvals))
+					delete_atom_values(atom);
+
+				// In an overlay, the Values in the base show through,
+				// unless the delta has a record; it has to have one.
+				if (checking and 0 == dvals.size() and 0 < _base_name.size())
+					async_get(batch, get_base_membership(atom),
+						_values_filter,
+						[this, atom](ValueVec&& bvals)
+						{
+							if (0 == atom->getKeys().size() and has_values(bvals))
+								delete_atom_values(atom);
+						});
+			});
 		return;
 	}
 
@@ -44,9 +95,25 @@ void DHTAtomStorage::store_atom_values(const Handle& atom)
 	for (const Handle& key : atom->getKeys())
 		store_recursive(key);
 
+	set_values_state(atom, VALUES_PRESENT);
+
+	// Only what changed; the disk cache gets all of it.
+	if (_merge_values)
+	{
+		ValuesRecord full;
+		ValuesSeen now;
+		ValuesRecord delta(encodeValuesDelta(atom, full, now));
+		disk_cache_put(muid, dht::Value(_values_bin_policy, full, 1));
+		queue_put(muid, dht::Value(_values_bin_policy, delta, 1), true,
+			[this, atom, now](void) { set_values_seen(atom, now); });
+		_value_updates ++;
+		return;
+	}
+
 	// Attach the value to the atom
-	_runner.put(muid,
-		dht::Value(_values_policy, encodeValuesToAlist(atom), 1));
+	dht::Value vval(_values_bin_policy, encodeValuesToRecord(atom), 1);
+	disk_cache_put(muid, vval);
+	queue_put(muid, std::move(vval));
 
 	_value_updates ++;
 }
@@ -61,39 +128,159 @@ void DHTAtomStorage::delete_atom_values(const Handle& atom)
 
 	// Attach the value to the atom
 	dht::InfoHash muid = get_membership(atom);
-	_runner.put(muid, dht::Value(_values_policy, "", 1));
+	dht::Value vval(_values_bin_policy, ValuesRecord(), 1);
+	disk_cache_put(muid, vval);
+	queue_put(muid, std::move(vval));
+	set_values_state(atom, VALUES_ABSENT);
+	// Not erased: a store that is still in flight must not bring
+	// back what it had seen.
+	if (_merge_values)
+	{
+		ValuesSeen none;
+		none.seq = ++_count_seq;
+		set_values_seen(atom, none);
+	}
 
 	_value_deletes ++;
 }
 
 /* ================================================================ */
 
-Handle DHTAtomStorage::fetch_values(Handle&& h)
+/// Record what is known about the values for this Atom in the DHT.
+void DHTAtomStorage::set_values_state(const Handle& atom, ValuesState st)
+{
+	_values_state.set(atom, st);
+}
+
+/// Return true if any of the dht-values hold (non-empty) Atom values.
+/// Deleted values are encoded as empty records.
+bool DHTAtomStorage::has_values(const ValueVec& dvals)
+{
+	for (const auto& dval : dvals)
+	{
+		if (VALUES_BIN_ID == dval->type)
+		{
+			if (0 < dval->unpack<ValuesRecord>().kvs.size()) return true;
+			continue;
+		}
+		std::string alist = dval->unpack<std::string>();
+		if (0 < alist.size() and 0 != alist.compare("()")) return true;
+	}
+	return false;
+}
+
+/* ================================================================ */
+
+/// Fetch all of the values on the Atom, and attach them to it.
+/// The callback is handed the Atom, after the values are attached.
+void DHTAtomStorage::async_fetch_values(const FetchBatchPtr& batch,
+                                        const Handle& h,
+                                        AtomCallback&& cb)
 {
+	// Not in the AtomSpace; there is nothing to wait for. This is not
+	// remembered, as the filter may be out of date.
+	if (bloom_absent(h))
+	{
+		async_run(batch, [this, batch, h, cb]()
+			{ got_values(batch, h, ValueVec(), AtomCallback(cb), false); });
+		return;
+	}
+
 	dht::InfoHash muid = get_membership(h);
+	touch_key(muid);
 
-	auto dvals = get_stuff(muid, _values_filter);
+	async_get(batch, muid, _values_filter,
+		[this, batch, h, muid, cb](ValueVec&& dvals)
+		{
+			// Values can change, and so the DHT is the authority.
+			// The disk copy is used only if the DHT has nothing;
+			// either the values expired, or the network is down.
+			// If they expired, a seeder may still have them.
+			if (0 < dvals.size())
+				disk_cache_put(muid, dvals);
+			else
+			{
+				want(muid);
+				disk_cache_get(muid, dvals);
+			}
 
+			// Nothing here; in an overlay, the base has them, if
+			// anyone does.
+			AtomCallback acb(cb);
+			if (0 == dvals.size() and 0 < _base_name.size())
+				async_fetch_base_values(batch, h, std::move(acb));
+			else
+				got_values(batch, h, dvals, std::move(acb));
+		});
+}
+
+/// Attach the values found in the DHT to the Atom, and pass it to
+/// the callback. If `remember`, then what was found is recorded in
+/// the values state.
+void DHTAtomStorage::got_values(const FetchBatchPtr& batch,
+                                const Handle& h,
+                                const ValueVec& dvals,
+                                AtomCallback&& cb,
+                                bool remember)
+{
 	// There may be multiple values attached to this Atom.
-	// We only want one; the one with the latest timestamp.
-	unsigned long timestamp = 0;
-	std::string alist;
+	// They will all have the value->id of 1, and so there
+	// should be only one, unless both the older text and the
+	// newer binary encodings are present. Prefer the binary.
+	std::shared_ptr<dht::Value> latest;
 	for (const auto& dval : dvals)
 	{
 		// std::cout << "Got value: " << dval->toString() << std::endl;
-		if (timestamp < dval->id)
-		{
-			timestamp = dval->id;
-			alist = dval->unpack<std::string>();
-		}
+		if (nullptr == latest or VALUES_BIN_ID == dval->type)
+			latest = dval;
 	}
-	// std::cout << "Latest svalue: " << alist << std::endl;
-	decodeAlist(h, alist);
+
+	// Different nodes may have different binary records, if they
+	// missed some of the deltas; merge them.
+	std::shared_ptr<dht::Value> merged(merge_values(dvals));
+	if (merged) latest = merged;
 	_value_fetches++;
 
+	// Remember, so that a later store need not check again.
+	// Don't override a store that raced ahead of us.
+	if (remember)
+		_values_state.try_insert(h,
+			has_values(dvals) ? VALUES_PRESENT : VALUES_ABSENT);
+
+	if (latest and VALUES_BIN_ID == latest->type)
+	{
+		async_decode_values(batch, h,
+			latest->unpack<ValuesRecord>(), std::move(cb));
+		return;
+	}
+
+	std::string alist;
+	if (latest) alist = latest->unpack<std::string>();
+	// std::cout << "Latest svalue: " << alist << std::endl;
+	Handle atom(h);
+	decodeAlist(atom, alist);
+	cb(atom);
+}
+
+Handle DHTAtomStorage::fetch_values(Handle&& h)
+{
+	FetchBatchPtr batch(new_batch());
+	async_fetch_values(batch, h, [](const Handle&) {});
+	wait_batch(batch);
 	return h;
 }
 
+/// Fetch the values on all of the Atoms, at the same time. The Atoms
+/// are returned in the same order, with the values attached.
+HandleSeq DHTAtomStorage::fetch_values_batch(HandleSeq&& hs)
+{
+	FetchBatchPtr batch(new_batch());
+	for (const Handle& h : hs)
+		async_fetch_values(batch, h, [](const Handle&) {});
+	wait_batch(batch);
+	return hs;
+}
+
 /* ================================================================== */
 
 /// Convert value (or Atom) into a string.
@@ -133,131 +320,13 @@ std::string DHTAtomStorage::encodeValuesToAlist(const Handle& h)
  * Return a Value correspnding to the input string.
  * It is assumed the input string is encoded as a scheme string.
  * For example, `(FloatValue 1 2 3 4)`
- *
- * XXX FIXME This needs to be fuzzed; it is very likely to crash
- * and/or contain bugs if it is given strings of unexpected formats.
  */
-ValuePtr DHTAtomStorage::decodeStrValue(std::string& stv, size_t& pos)
+ValuePtr DHTAtomStorage::decodeStrValue(std::string_view stv, size_t& pos)
 {
-	size_t totlen = stv.size();
-
-#define LV "(LinkValue"
-	if (0 == stv.compare(pos, sizeof(LV)-1, LV))
-	{
-		size_t vos = pos + sizeof(LV)-1;
-		std::vector<ValuePtr> vv;
-		vos = stv.find('(', vos);
-		size_t epos = vos;
-		size_t done = vos + 1;
-		while (vos != std::string::npos and vos < done)
-		{
-			// Find the next balanced paren, and restart there.
-			// This is not very efficient, but it works.
-			epos = vos;
-			int pcnt = 1;
-			while (0 < pcnt and epos < totlen)
-			{
-				char c = stv[++epos];
-				if ('(' == c) pcnt ++;
-				else if (')' == c) pcnt--;
-			}
-			if (epos >= totlen)
-				throw SyntaxException(TRACE_INFO,
-					"Malformed LinkValue: %s", stv.substr(pos).c_str());
-
-			vv.push_back(decodeStrValue(stv, vos));
-			done = stv.find(')', epos+1);
-			vos = stv.find('(', epos+1);
-		}
-		if (std::string::npos == done)
-			throw SyntaxException(TRACE_INFO,
-				"Malformed LinkValue: %s", stv.substr(pos).c_str());
-		pos = done + 1;
-		return createLinkValue(vv);
-	}
-
-#define FV "(FloatValue"
-	if (0 == stv.compare(pos, sizeof(FV)-1, FV))
-	{
-		size_t vos = pos + sizeof(FV)-1;
-		std::vector<double> fv;
-		while (vos < totlen and stv[vos] != ')')
-		{
-			size_t epos;
-			fv.push_back(stod(stv.substr(vos), &epos));
-			vos += epos;
-		}
-		pos = vos + 1;
-		return createFloatValue(fv);
-	}
-
-#define TVL "(SimpleTruthValue "
-#define TVS "(stv "
-	size_t vos = std::string::npos;
-	if (0 == stv.compare(pos, sizeof(TVL)-1, TVL))
-		vos = pos + sizeof(TVL) - 1;
-	else
-	if (0 == stv.compare(pos, sizeof(TVS)-1, TVS))
-		vos = pos + sizeof(TVS) - 1;
-
-	if (std::string::npos != vos)
-	{
-		size_t elen;
-		double strength = stod(stv.substr(vos), &elen);
-		vos += elen;
-		double confidence = stod(stv.substr(vos), &elen);
-		vos += elen;
-		vos = stv.find(')', vos);
-		if (std::string::npos == vos)
-			throw SyntaxException(TRACE_INFO,
-				"Malformed SimpleTruthValue: %s", stv.substr(pos).c_str());
-		pos = vos + 1;
-		return ValueCast(createSimpleTruthValue(strength, confidence));
-	}
-
-#define CTV "(CountTruthValue "
-	if (0 == stv.compare(pos, sizeof(CTV)-1, CTV))
-	{
-		size_t vos = pos + sizeof(CTV) - 1;
-		size_t elen;
-		double strength = stod(stv.substr(vos), &elen);
-		vos += elen;
-		double confidence = stod(stv.substr(vos), &elen);
-		vos += elen;
-		double count = stod(stv.substr(vos), &elen);
-		vos += elen;
-		vos = stv.find(')', vos);
-		if (std::string::npos == vos)
-			throw SyntaxException(TRACE_INFO,
-				"Malformed CountTruthValue: %s", stv.substr(pos).c_str());
-		pos = vos + 1;
-		return ValueCast(createCountTruthValue(strength, confidence, count));
-	}
-
-	// XXX FIXME this mishandles escaped quotes
-#define SV "(StringValue"
-	if (0 == stv.compare(pos, sizeof(SV)-1, SV))
-	{
-		size_t vos = pos + sizeof(SV) - 1;
-		std::vector<std::string> sv;
-		size_t epos = stv.find(')', vos+1);
-		if (std::string::npos == epos)
-			throw SyntaxException(TRACE_INFO,
-				"Malformed StringValue: %s", stv.substr(pos).c_str());
-		while (vos < epos)
-		{
-			vos = stv.find('\"', vos);
-			if (std::string::npos == vos) break;
-			size_t evos = stv.find('\"', vos+1);
-			sv.push_back(stv.substr(vos+1, evos-vos-1));
-			vos = evos+1;
-		}
-		pos = epos + 1;
-		return createStringValue(sv);
-	}
-
-	throw SyntaxException(TRACE_INFO, "Unknown Value %s",
-		stv.substr(pos).c_str());
+	SexprReader rdr(stv, pos);
+	ValuePtr v(rdr.read_value());
+	pos = rdr.pos();
+	return v;
 }
 
 /* ================================================================== */
@@ -268,22 +337,10 @@ ValuePtr DHTAtomStorage::decodeStrValue(std::string& stv, size_t& pos)
  * ((KEY . VALUE)(KEY2 . VALUE2)...)
  * Store the results as values on the atom.
  */
-void DHTAtomStorage::decodeAlist(Handle& atom, std::string& alist)
+void DHTAtomStorage::decodeAlist(Handle& atom, std::string_view alist)
 {
-	// Skip over opening paren
-	size_t pos = 1;
-	size_t totlen = alist.size();
-	pos = alist.find('(', pos);
-	while (std::string::npos != pos and pos < totlen)
-	{
-		++pos;  // over first paren of pair
-		Handle key(decodeStrAtom(alist, pos));
-		pos = alist.find(" . ", pos);
-		pos += 3;
-		ValuePtr val(decodeStrValue(alist, pos));
-		atom->setValue(key, val);
-		pos = alist.find('(', pos);
-	}
+	SexprReader rdr(alist);
+	rdr.read_alist(atom);
 }
 
 /* ============================= END OF FILE ================= */
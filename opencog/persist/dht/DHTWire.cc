@@ -0,0 +1,280 @@
+/*
+ * DHTWire.cc
+ * Binary (msgpack) encoding and decoding of Atoms and Values.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/atom_types/NameServer.h>
+#include <opencog/atoms/value/FloatValue.h>
+#include <opencog/atoms/value/LinkValue.h>
+#include <opencog/atoms/value/StringValue.h>
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+#include <opencog/atoms/truthvalue/TruthValue.h>
+
+#include "DHTAtomStorage.h"
+#include "SexprReader.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+// Encoding
+
+/// Convert an Atom into it's binary record. Links are encoded with
+/// the GUIDs of their outgoing set; the outgoing Atoms must have
+/// been published before the Link is, else readers will not be able
+/// to resolve them.
+AtomRecord DHTAtomStorage::encodeAtomToRecord(const Handle& h)
+{
+	AtomRecord rec;
+	rec.t = h->get_type();
+	if (h->is_node())
+	{
+		rec.n = h->get_name();
+		return rec;
+	}
+
+	rec.o.reserve(h->get_arity());
+	for (const Handle& ho : h->getOutgoingSet())
+		rec.o.emplace_back(get_guid(ho));
+	return rec;
+}
+
+/// Convert a Value into it's binary record. The TruthValues are
+/// FloatValues, and so they carry the raw doubles, too. Whatever the
+/// record has no field for is sent as an s-expression; this includes
+/// the other subtypes of FloatValue, StringValue and LinkValue (e.g.
+/// the streams), which the reader could not rebuild from the fields.
+ValueRecord DHTAtomStorage::encodeValueToRecord(const ValuePtr& v)
+{
+	ValueRecord rec;
+	rec.t = v->get_type();
+
+	if (FLOAT_VALUE == rec.t or nameserver().isA(rec.t, TRUTH_VALUE))
+	{
+		rec.f = FloatValueCast(v)->value();
+		return rec;
+	}
+
+	if (STRING_VALUE == rec.t)
+	{
+		rec.s = StringValueCast(v)->value();
+		return rec;
+	}
+
+	if (LINK_VALUE == rec.t)
+	{
+		for (const ValuePtr& lv : LinkValueCast(v)->value())
+			rec.l.emplace_back(encodeValueToRecord(lv));
+		return rec;
+	}
+
+	rec.x = encodeValueToStr(v);
+	return rec;
+}
+
+/// Convert all of the Values on an Atom into a binary record. The
+/// keys are given by their GUIDs; the keys must have been published.
+ValuesRecord DHTAtomStorage::encodeValuesToRecord(const Handle& h)
+{
+	ValuesRecord rec;
+	for (const Handle& k: h->getKeys())
+	{
+		KeyValueRecord kv;
+		kv.k = get_guid(k);
+		kv.val = encodeValueToRecord(h->getValue(k));
+		rec.kvs.emplace_back(std::move(kv));
+	}
+	return rec;
+}
+
+/* ================================================================ */
+// Decoding
+
+/// Convert a binary record back into a Value. Records for the other
+/// subtypes of FloatValue, StringValue and LinkValue are no longer
+/// written, but some may still be around; these come back as the
+/// plain base type, as they do in the text records.
+ValuePtr DHTAtomStorage::decodeValueRecord(const ValueRecord& rec)
+{
+	if (0 < rec.x.size())
+		return SexprReader(rec.x).read_value();
+
+	if (SIMPLE_TRUTH_VALUE == rec.t and 2 == rec.f.size())
+		return ValueCast(createSimpleTruthValue(rec.f[0], rec.f[1]));
+
+	if (COUNT_TRUTH_VALUE == rec.t and 3 == rec.f.size())
+		return ValueCast(createCountTruthValue(rec.f[0], rec.f[1], rec.f[2]));
+
+	// The other TruthValues; they know how to unpack their doubles.
+	if (nameserver().isA(rec.t, TRUTH_VALUE))
+		return ValueCast(TruthValue::factory(rec.t, rec.f));
+
+	if (nameserver().isA(rec.t, FLOAT_VALUE))
+		return createFloatValue(rec.f);
+
+	if (nameserver().isA(rec.t, STRING_VALUE))
+		return createStringValue(rec.s);
+
+	if (nameserver().isA(rec.t, LINK_VALUE))
+	{
+		std::vector<ValuePtr> vv;
+		vv.reserve(rec.l.size());
+		for (const ValueRecord& lr : rec.l)
+			vv.emplace_back(decodeValueRecord(lr));
+		return createLinkValue(vv);
+	}
+
+	throw SyntaxException(TRACE_INFO, "Unknown Value type %d", rec.t);
+}
+
+/// Convert a binary record back into an Atom. The outgoing set of a
+/// Link is resolved with (possibly asynchronous) lookups of the GUIDs;
+/// the callback is called once all of them are known. With
+/// `missing_ok`, a Link with a missing Atom in it is Handle::UNDEFINED.
+void DHTAtomStorage::async_decode_atom(const FetchBatchPtr& batch,
+                                       const AtomRecord& rec,
+                                       AtomCallback&& cb, bool missing_ok)
+{
+	if (DHT_WIRE_VERSION != rec.v)
+		throw SyntaxException(TRACE_INFO,
+			"Unknown Atom record version %d", rec.v);
+
+	if (nameserver().isNode(rec.t))
+	{
+		_num_got_nodes ++;
+		cb(createNode(rec.t, rec.n));
+		return;
+	}
+
+	if (not nameserver().isLink(rec.t))
+		throw SyntaxException(TRACE_INFO,
+			"Bad Atom record type %d", rec.t);
+
+	struct Pending
+	{
+		Type t;
+		HandleSeq oset;
+		std::atomic<size_t> remaining;
+		AtomCallback cb;
+	};
+	std::shared_ptr<Pending> pnd(std::make_shared<Pending>());
+	pnd->t = rec.t;
+	pnd->oset.resize(rec.o.size());
+	pnd->remaining = rec.o.size() + 1;
+	pnd->cb = std::move(cb);
+
+	auto done = [this, pnd]()
+	{
+		if (0 < --pnd->remaining) return;
+		for (const Handle& ho : pnd->oset)
+			if (nullptr == ho) { pnd->cb(Handle::UNDEFINED); return; }
+		_num_got_links ++;
+		pnd->cb(createLink(pnd->oset, pnd->t));
+	};
+
+	for (size_t i = 0; i < rec.o.size(); i++)
+		async_fetch_atom(batch, rec.o[i],
+			[pnd, i, done](const Handle& ho)
+			{
+				pnd->oset[i] = ho;
+				done();
+			}, missing_ok);
+
+	// The extra count guards against completing before all of the
+	// outgoing lookups have been issued.
+	done();
+}
+
+/// Attach the Values in the binary record to the Atom. The keys are
+/// resolved with (possibly asynchronous) lookups of the GUIDs.
+void DHTAtomStorage::async_decode_values(const FetchBatchPtr& batch,
+                                         const Handle& h,
+                                         const ValuesRecord& rec,
+                                         AtomCallback&& cb)
+{
+	if (DHT_WIRE_VERSION != rec.v and DHT_MERGE_VERSION != rec.v)
+		throw SyntaxException(TRACE_INFO,
+			"Unknown Values record version %d", rec.v);
+
+	struct Pending
+	{
+		Handle atom;
+		std::vector<ValuePtr> vals;
+		HandleSeq keys;
+		std::vector<std::vector<CountRecord>> shares;
+		std::atomic<size_t> remaining;
+		AtomCallback cb;
+	};
+	std::shared_ptr<Pending> pnd(std::make_shared<Pending>());
+	pnd->atom = h;
+	pnd->keys.resize(rec.kvs.size());
+	if (_merge_values)
+		for (const KeyValueRecord& kv : rec.kvs)
+			pnd->shares.push_back(kv.c);
+	pnd->remaining = rec.kvs.size() + 1;
+	pnd->cb = std::move(cb);
+
+	// Decode the values up front; only the keys need lookups.
+	pnd->vals.reserve(rec.kvs.size());
+	for (const KeyValueRecord& kv : rec.kvs)
+		pnd->vals.emplace_back(decodeValueRecord(kv.val));
+
+	auto done = [this, pnd]()
+	{
+		if (0 < --pnd->remaining) return;
+		for (size_t i = 0; i < pnd->keys.size(); i++)
+			pnd->atom->setValue(pnd->keys[i], pnd->vals[i]);
+		if (_merge_values)
+			seen_values(pnd->atom, pnd->keys, pnd->vals, pnd->shares);
+		pnd->cb(pnd->atom);
+	};
+
+	for (size_t i = 0; i < rec.kvs.size(); i++)
+		async_fetch_atom(batch, rec.kvs[i].k,
+			[pnd, i, done](const Handle& key)
+			{
+				pnd->keys[i] = key;
+				done();
+			});
+
+	done();
+}
+
+/* ================================================================ */
+// Debug printing
+
+std::string DHTAtomStorage::prt_atom_record(const AtomRecord& rec)
+{
+	std::stringstream ss;
+	ss << "v" << std::to_string(rec.v) << " "
+	   << nameserver().getTypeName(rec.t);
+	if (nameserver().isNode(rec.t))
+		ss << " \"" << rec.n << "\"";
+	for (const dht::InfoHash& ho : rec.o)
+		ss << " " << ho.toString();
+	return ss.str();
+}
+
+std::string DHTAtomStorage::prt_values_record(const ValuesRecord& rec)
+{
+	std::stringstream ss;
+	ss << "v" << std::to_string(rec.v);
+	if (rec.d) ss << " delta";
+	for (const KeyValueRecord& kv : rec.kvs)
+	{
+		ss << " (" << kv.k.toString() << " . "
+		   << decodeValueRecord(kv.val)->to_short_string();
+		for (const CountRecord& cr : kv.c)
+			ss << " " << std::hex << cr.w << std::dec << ":" << cr.n;
+		ss << ")";
+	}
+	for (const dht::InfoHash& gone : rec.x)
+		ss << " (" << gone.toString() << ")";
+	return ss.str();
+}
+
+/* ============================= END OF FILE ================= */
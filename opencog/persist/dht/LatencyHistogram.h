@@ -0,0 +1,168 @@
+/*
+ * FILE:
+ * opencog/persist/dht/LatencyHistogram.h
+
+ * FUNCTION:
+ * Lock-free, log-linear latency histogram, for the driver metrics.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_LATENCY_HISTOGRAM_H
+#define _OPENCOG_LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A histogram of latencies, in microseconds, in the style of
+/// HdrHistogram: each power of two is split into SUB_BUCKETS linear
+/// sub-buckets, so that every recorded value is known to within
+/// 1/SUB_BUCKETS (about 3%), from one microsecond to about 19 hours.
+/// Longer latencies are counted in the last bucket.
+///
+/// Recording is a few relaxed atomic increments, and may be done
+/// from any thread, including the OpenDHT threads. Reading takes a
+/// snapshot; the snapshot is not atomic as a whole, but the count is
+/// never less than the sum of the buckets that it was taken with.
+class LatencyHistogram
+{
+	public:
+		enum
+		{
+			SUB_BITS = 5,
+			SUB_BUCKETS = 1 << SUB_BITS,
+			MAX_EXP = 36,
+			NUM_BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS,
+		};
+
+		struct Snapshot
+		{
+			uint64_t count = 0;
+			uint64_t sum_us = 0;
+			uint64_t max_us = 0;
+			std::vector<uint64_t> buckets;
+
+			double mean_us(void) const
+			{
+				return (0 < count) ? ((double) sum_us) / count : 0.0;
+			}
+
+			/// The latency that the fraction `q` of the values are at
+			/// or below; e.g. q = 0.99 for the 99th percentile. This is
+			/// the top of the bucket, so it may overstate by a bucket
+			/// width, but never by more than the largest value seen.
+			uint64_t percentile(double q) const
+			{
+				uint64_t total = 0;
+				for (uint64_t n : buckets) total += n;
+				if (0 == total) return 0;
+
+				uint64_t want = q * total;
+				if (want < 1) want = 1;
+				uint64_t seen = 0;
+				for (size_t i = 0; i < buckets.size(); i++)
+				{
+					seen += buckets[i];
+					if (seen < want) continue;
+					uint64_t top = upper_bound(i) - 1;
+					return (top < max_us) ? top : max_us;
+				}
+				return max_us;
+			}
+
+			/// How many values were less than `us`. Exact when `us` is
+			/// a power of two (or less than SUB_BUCKETS); else, to
+			/// within a bucket.
+			uint64_t count_below(uint64_t us) const
+			{
+				uint64_t n = 0;
+				for (size_t i = 0; i < buckets.size(); i++)
+				{
+					if (us < upper_bound(i)) break;
+					n += buckets[i];
+				}
+				return n;
+			}
+		};
+
+		LatencyHistogram(void) { clear(); }
+
+		void record(std::chrono::steady_clock::duration d)
+		{
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+			record_us(0 < us.count() ? us.count() : 0);
+		}
+
+		void record_us(uint64_t us)
+		{
+			_buckets[index(us)].fetch_add(1, std::memory_order_relaxed);
+			_sum.fetch_add(us, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+
+			uint64_t m = _max.load(std::memory_order_relaxed);
+			while (m < us and
+			       not _max.compare_exchange_weak(m, us,
+			                                      std::memory_order_relaxed)) {}
+		}
+
+		Snapshot snapshot(void) const
+		{
+			Snapshot snap;
+			snap.buckets.resize(NUM_BUCKETS);
+			for (size_t i = 0; i < NUM_BUCKETS; i++)
+				snap.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+			snap.count = _count.load(std::memory_order_relaxed);
+			snap.sum_us = _sum.load(std::memory_order_relaxed);
+			snap.max_us = _max.load(std::memory_order_relaxed);
+			return snap;
+		}
+
+		void clear(void)
+		{
+			for (auto& b : _buckets) b = 0;
+			_count = 0;
+			_sum = 0;
+			_max = 0;
+		}
+
+		/// The bucket that holds `us`.
+		static size_t index(uint64_t us)
+		{
+			if (us < SUB_BUCKETS) return us;
+			size_t exp = 63 - __builtin_clzll(us);
+			if (MAX_EXP < exp) return NUM_BUCKETS - 1;
+			return (exp - SUB_BITS) * SUB_BUCKETS + (us >> (exp - SUB_BITS));
+		}
+
+		/// The smallest value that does not go into bucket `i`.
+		static uint64_t upper_bound(size_t i)
+		{
+			size_t grp = i / SUB_BUCKETS;
+			if (0 == grp) return i + 1;
+			uint64_t unit = 1ULL << (grp - 1);
+			return (SUB_BUCKETS + i % SUB_BUCKETS + 1) * unit;
+		}
+
+	private:
+		std::atomic<uint64_t> _buckets[NUM_BUCKETS];
+		std::atomic<uint64_t> _count;
+		std::atomic<uint64_t> _sum;
+		std::atomic<uint64_t> _max;
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_LATENCY_HISTOGRAM_H
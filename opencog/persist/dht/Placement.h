@@ -0,0 +1,60 @@
+/*
+ * FILE:
+ * opencog/persist/dht/Placement.h
+
+ * FUNCTION:
+ * Graph-local placement of the MUIDs of Links.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_DHT_PLACEMENT_H
+#define _OPENCOG_DHT_PLACEMENT_H
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <opendht/infohash.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/**
+ * Overwrite the leading `bits` bits of `key` with those of `anchor`.
+ *
+ * OpenDHT puts a key on the nodes whose ids are XOR-closest to it.
+ * Keys that share a long prefix are thus on the same few nodes;
+ * with N nodes in the DHT, a prefix of about log2(N) bits or more
+ * is enough. Since every Link is anchored to its first outgoing
+ * Atom, and that one to its own, a Node, the Links that start with
+ * it, and the Links that contain those, all end up in the same
+ * region of the DHT, together with their Values and incoming sets.
+ * A walk over the neighborhood then stays on the same nodes.
+ *
+ * The price is balance: a Node that starts very many Links puts all
+ * of them on the same nodes. Fewer bits spread them out some; the
+ * tail bits, from the Link's own hash, keep the keys distinct.
+ */
+inline void place_near(dht::InfoHash& key, const dht::InfoHash& anchor,
+                       size_t bits)
+{
+	size_t nbytes = std::min(bits / 8, key.size());
+	memcpy(key.data(), anchor.data(), nbytes);
+	if (nbytes == key.size() or 0 == bits % 8) return;
+
+	uint8_t mask = 0xff << (8 - bits % 8);
+	key[nbytes] = (anchor[nbytes] & mask) | (key[nbytes] & ~mask);
+}
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_DHT_PLACEMENT_H
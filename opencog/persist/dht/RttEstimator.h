@@ -0,0 +1,80 @@
+/*
+ * FILE:
+ * opencog/persist/dht/RttEstimator.h
+
+ * FUNCTION:
+ * Round-trip time estimates, and the retransmit timeout, as in TCP.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_RTT_ESTIMATOR_H
+#define _OPENCOG_RTT_ESTIMATOR_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// The smoothed round-trip time, and its mean deviation, as in RFC
+/// 6298. The retransmit timeout is the smoothed time plus four times
+/// the deviation, kept within the given bounds; until the first
+/// sample, it is the upper bound. This is not thread-safe; the caller
+/// provides the locking.
+class RttEstimator
+{
+	public:
+		RttEstimator(void) : _srtt_us(0.0), _rttvar_us(0.0) {}
+
+		void sample(std::chrono::steady_clock::duration rtt)
+		{
+			double us = std::chrono::duration_cast<
+				std::chrono::microseconds>(rtt).count();
+			if (0.0 == _srtt_us)
+			{
+				_srtt_us = us;
+				_rttvar_us = us / 2.0;
+			}
+			else
+			{
+				_rttvar_us = 0.75 * _rttvar_us + 0.25 * fabs(_srtt_us - us);
+				_srtt_us = 0.875 * _srtt_us + 0.125 * us;
+			}
+
+			// Zero means "no samples yet".
+			if (_srtt_us < 1.0) _srtt_us = 1.0;
+		}
+
+		std::chrono::microseconds rto(std::chrono::microseconds least,
+		                              std::chrono::microseconds most) const
+		{
+			if (0.0 == _srtt_us) return most;
+			std::chrono::microseconds rto(
+				(int64_t) (_srtt_us + 4.0 * _rttvar_us));
+			return std::min(most, std::max(rto, least));
+		}
+
+		double srtt_us(void) const { return _srtt_us; }
+		double rttvar_us(void) const { return _rttvar_us; }
+		void clear(void) { _srtt_us = 0.0; _rttvar_us = 0.0; }
+
+	private:
+		double _srtt_us;        // zero until the first sample
+		double _rttvar_us;
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_RTT_ESTIMATOR_H
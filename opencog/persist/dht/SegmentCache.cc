@@ -0,0 +1,395 @@
+/*
+ * SegmentCache.cc
+ * Local, persistent cache of DHT values.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include <opencog/util/exceptions.h>
+#include <opencog/util/Logger.h>
+
+#include "SegmentCache.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+// File layout. The file starts with a 16-byte header: the magic
+// string, and a version number. This is followed by records, each
+// of which is a 44-byte header, followed by the value data:
+//
+//    offset  size
+//      0      4    record magic
+//      4      4    length of the value data
+//      8      4    checksum of everything after this field
+//     12      2    value type
+//     14      2    value seq
+//     16      8    value id
+//     24     20    key
+//     44      -    value data
+//
+// Everything is in host byte order; the file is not meant to be
+// copied between machines.
+
+#define FILE_MAGIC "ASDHTSEG"
+#define FILE_VERSION 1
+#define FILE_HEADER 16
+#define REC_MAGIC 0x43455321
+#define REC_HEADER 44
+#define CHECKED_AT 12
+
+// Grow the file in chunks of at least this much.
+#define MIN_GROW (1024*1024)
+
+static uint32_t checksum(const char* p, size_t len)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (uint8_t) p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+SegmentCache::SegmentCache(const std::string& path) :
+	_path(path), _fd(-1), _map(nullptr), _mapped(0), _used(0),
+	_live(0), _hits(0), _misses(0)
+{
+	open_file();
+	scan();
+
+	// Compact, if more than half of the file is dead.
+	if (MIN_GROW < _used and 2 * _live < _used)
+	{
+		compact();
+		_index.clear();
+		_live = 0;
+		open_file();
+		scan();
+	}
+}
+
+SegmentCache::~SegmentCache()
+{
+	close_file();
+}
+
+/* ================================================================ */
+
+void SegmentCache::open_file(void)
+{
+	_fd = open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (_fd < 0)
+		throw IOException(TRACE_INFO, "Can't open cache file %s: %s",
+			_path.c_str(), strerror(errno));
+
+	if (flock(_fd, LOCK_EX | LOCK_NB))
+	{
+		close(_fd);
+		_fd = -1;
+		throw IOException(TRACE_INFO,
+			"Cache file %s is in use by another process", _path.c_str());
+	}
+
+	struct stat st;
+	fstat(_fd, &st);
+	size_t fsize = st.st_size;
+
+	if (0 == fsize)
+	{
+		char hdr[FILE_HEADER];
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, FILE_MAGIC, sizeof(FILE_MAGIC)-1);
+		uint32_t version = FILE_VERSION;
+		memcpy(hdr + 8, &version, sizeof(version));
+		if (FILE_HEADER != write(_fd, hdr, FILE_HEADER))
+		{
+			close(_fd);
+			_fd = -1;
+			throw IOException(TRACE_INFO, "Can't write cache file %s: %s",
+				_path.c_str(), strerror(errno));
+		}
+		fsize = FILE_HEADER;
+	}
+
+	map_file(std::max(fsize, (size_t) MIN_GROW));
+
+	uint32_t version;
+	memcpy(&version, _map + 8, sizeof(version));
+	if (memcmp(_map, FILE_MAGIC, sizeof(FILE_MAGIC)-1) or
+	    FILE_VERSION != version)
+	{
+		close_file();
+		throw IOException(TRACE_INFO,
+			"%s is not a cache file, or is the wrong version", _path.c_str());
+	}
+}
+
+/// Unmap, and trim the file back down to the records that are in it.
+void SegmentCache::close_file(void)
+{
+	if (_fd < 0) return;
+	if (_map)
+	{
+		msync(_map, _mapped, MS_SYNC);
+		munmap(_map, _mapped);
+		_map = nullptr;
+	}
+	// Shrinking leaves no holes; ftruncate is fine here.
+	if (FILE_HEADER <= _used)
+		if (ftruncate(_fd, _used))
+			logger().warn("Can't trim cache file %s: %s",
+				_path.c_str(), strerror(errno));
+	close(_fd);
+	_fd = -1;
+	_mapped = 0;
+}
+
+/// (Re-)map the file, growing it to `size` bytes, if needed.
+/// The blocks are allocated up front: a sparse file that can't be
+/// filled in, when the disk is full, raises SIGBUS on the write to
+/// the map. If this throws, the old map is still in place.
+/// Caller must hold the lock exclusively.
+void SegmentCache::map_file(size_t size)
+{
+	int rc = posix_fallocate(_fd, 0, size);
+	if (rc)
+		throw IOException(TRACE_INFO, "Can't grow cache file %s: %s",
+			_path.c_str(), strerror(rc));
+
+	void* m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (MAP_FAILED == m)
+		throw IOException(TRACE_INFO, "Can't map cache file %s: %s",
+			_path.c_str(), strerror(errno));
+
+	if (_map) munmap(_map, _mapped);
+	_map = (char*) m;
+	_mapped = size;
+}
+
+/// Build the index, stopping at the first record that is not intact.
+void SegmentCache::scan(void)
+{
+	size_t pos = FILE_HEADER;
+	while (pos + REC_HEADER <= _mapped)
+	{
+		const char* rec = _map + pos;
+		uint32_t magic, len, check;
+		memcpy(&magic, rec, 4);
+		memcpy(&len, rec + 4, 4);
+		memcpy(&check, rec + 8, 4);
+		if (REC_MAGIC != magic) break;
+		if (_mapped < pos + REC_HEADER + len) break;
+		if (check != checksum(rec + CHECKED_AT, REC_HEADER - CHECKED_AT + len))
+			break;
+
+		Entry ent;
+		memcpy(&ent.type, rec + 12, 2);
+		memcpy(&ent.id, rec + 16, 8);
+		ent.offset = pos;
+		ent.len = REC_HEADER + len;
+
+		dht::InfoHash key;
+		memcpy(key.data(), rec + 24, dht::HASH_LEN);
+
+		std::vector<Entry>& ents = _index[key];
+		auto it = std::find_if(ents.begin(), ents.end(),
+			[&ent](const Entry& e)
+			{ return e.type == ent.type and e.id == ent.id; });
+		if (ents.end() != it)
+		{
+			_live -= it->len;
+			*it = ent;
+		}
+		else
+			ents.push_back(ent);
+		_live += ent.len;
+
+		pos += ent.len;
+	}
+
+	// Anything past the last good record is dead; zero it, so that a
+	// later scan does not mistake leftovers for records.
+	if (pos < _mapped)
+		memset(_map + pos, 0, _mapped - pos);
+	_used = pos;
+
+	if (FILE_HEADER < pos)
+		logger().info("Cache file %s: %zu keys, %zu bytes, %zu live",
+			_path.c_str(), _index.size(), pos, _live);
+}
+
+/// Write the live records to a new file, and replace the old file
+/// with it. The old file is closed; the caller must re-open.
+void SegmentCache::compact(void)
+{
+	std::string tmp = _path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		logger().warn("Can't compact cache file %s: %s",
+			_path.c_str(), strerror(errno));
+		return;
+	}
+
+	bool ok = (FILE_HEADER == write(fd, _map, FILE_HEADER));
+	for (const auto& kv : _index)
+		for (const Entry& ent : kv.second)
+			ok = ok and ((ssize_t) ent.len ==
+				write(fd, _map + ent.offset, ent.len));
+	ok = ok and (0 == fsync(fd));
+	close(fd);
+
+	if (ok) ok = (0 == rename(tmp.c_str(), _path.c_str()));
+	if (not ok)
+	{
+		logger().warn("Can't compact cache file %s: %s",
+			_path.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+	}
+
+	// The old file may have been renamed over; don't trim it.
+	if (ok) _used = 0;
+	close_file();
+}
+
+/* ================================================================ */
+
+bool SegmentCache::get(const dht::InfoHash& key, ValueVec& vals)
+{
+	std::shared_lock<std::shared_mutex> lck(_mtx);
+	const auto& it = _index.find(key);
+	if (_index.end() == it)
+	{
+		_misses++;
+		return false;
+	}
+
+	for (const Entry& ent : it->second)
+	{
+		const char* rec = _map + ent.offset;
+		uint16_t seq;
+		memcpy(&seq, rec + 14, 2);
+		dht::Blob data(rec + REC_HEADER, rec + ent.len);
+		auto val = std::make_shared<dht::Value>(ent.type, data, ent.id);
+		val->seq = seq;
+		vals.emplace_back(val);
+	}
+	_hits++;
+	return true;
+}
+
+void SegmentCache::put(const dht::InfoHash& key, const dht::Value& val)
+{
+	std::unique_lock<std::shared_mutex> lck(_mtx);
+
+	// Don't grow the file with copies of what's already there.
+	// This happens every time something is fetched again.
+	const auto& it = _index.find(key);
+	if (_index.end() != it)
+	{
+		for (const Entry& ent : it->second)
+		{
+			if (ent.type != val.type or ent.id != val.id) continue;
+			const char* rec = _map + ent.offset;
+			uint16_t seq;
+			memcpy(&seq, rec + 14, 2);
+			if (seq == val.seq and ent.len == REC_HEADER + val.data.size() and
+			    0 == memcmp(rec + REC_HEADER, val.data.data(), val.data.size()))
+				return;
+		}
+	}
+
+	append(key, val.type, val.id, val.seq, val.data);
+}
+
+/// Append a record. Caller must hold the lock exclusively.
+void SegmentCache::append(const dht::InfoHash& key, uint16_t type,
+                          dht::Value::Id id, uint16_t seq,
+                          const dht::Blob& data)
+{
+	size_t len = REC_HEADER + data.size();
+	if (_mapped < _used + len)
+	{
+		// A full disk is not fatal; the record just doesn't get
+		// cached. It can still be had from the network.
+		try
+		{
+			map_file(std::max(2 * _mapped, _used + len + MIN_GROW));
+		}
+		catch (const IOException& ex)
+		{
+			logger().warn("%s", ex.get_message());
+			return;
+		}
+	}
+
+	char* rec = _map + _used;
+	uint32_t magic = REC_MAGIC;
+	uint32_t dlen = data.size();
+	memcpy(rec, &magic, 4);
+	memcpy(rec + 4, &dlen, 4);
+	memcpy(rec + 12, &type, 2);
+	memcpy(rec + 14, &seq, 2);
+	memcpy(rec + 16, &id, 8);
+	memcpy(rec + 24, key.data(), dht::HASH_LEN);
+	memcpy(rec + REC_HEADER, data.data(), data.size());
+
+	// The checksum goes in last, so that a record torn by a crash
+	// is (almost surely) rejected by scan().
+	uint32_t check = checksum(rec + CHECKED_AT, len - CHECKED_AT);
+	memcpy(rec + 8, &check, 4);
+
+	Entry ent{type, id, _used, len};
+	std::vector<Entry>& ents = _index[key];
+	auto it = std::find_if(ents.begin(), ents.end(),
+		[&ent](const Entry& e)
+		{ return e.type == ent.type and e.id == ent.id; });
+	if (ents.end() != it)
+	{
+		_live -= it->len;
+		*it = ent;
+	}
+	else
+		ents.push_back(ent);
+	_live += len;
+	_used += len;
+}
+
+/* ================================================================ */
+
+size_t SegmentCache::size(void)
+{
+	std::shared_lock<std::shared_mutex> lck(_mtx);
+	size_t n = 0;
+	for (const auto& kv : _index) n += kv.second.size();
+	return n;
+}
+
+size_t SegmentCache::live_bytes(void)
+{
+	std::shared_lock<std::shared_mutex> lck(_mtx);
+	return _live;
+}
+
+size_t SegmentCache::file_bytes(void)
+{
+	std::shared_lock<std::shared_mutex> lck(_mtx);
+	return _used;
+}
+
+/* ============================= END OF FILE ================= */
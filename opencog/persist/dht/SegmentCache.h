@@ -0,0 +1,101 @@
+/*
+ * FILE:
+ * opencog/persist/dht/SegmentCache.h
+
+ * FUNCTION:
+ * Local, persistent cache of DHT values, in a memory-mapped,
+ * append-only segment file.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_SEGMENT_CACHE_H
+#define _OPENCOG_SEGMENT_CACHE_H
+
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <opendht.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A local cache of DHT values, kept in a file, so that it survives
+/// restarts. It holds the same thing the DHT does: a set of values
+/// on each key, where a value is identified by its type and its id.
+/// A put of a value with the same key, type and id replaces the
+/// earlier one; the earlier one stays in the file, but is no longer
+/// indexed. The file is compacted when it is opened, if more than
+/// half of it is dead.
+///
+/// Each record carries a checksum; a record torn by a crash, and
+/// everything after it, is discarded when the file is next opened.
+///
+/// Only one process at a time may have the file open; it is locked.
+class SegmentCache
+{
+	public:
+		typedef std::vector<std::shared_ptr<dht::Value>> ValueVec;
+
+		SegmentCache(const std::string& path);
+		~SegmentCache();
+
+		/// Append the values found on the key. Return false if
+		/// there are none.
+		bool get(const dht::InfoHash&, ValueVec&);
+
+		/// Add or replace the value on the key.
+		void put(const dht::InfoHash&, const dht::Value&);
+
+		const std::string& path(void) const { return _path; }
+		size_t size(void);          // number of live records
+		size_t live_bytes(void);
+		size_t file_bytes(void);
+		size_t hits(void) const { return _hits; }
+		size_t misses(void) const { return _misses; }
+
+	private:
+		struct Entry
+		{
+			uint16_t type;
+			dht::Value::Id id;
+			size_t offset;  // of the record header
+			size_t len;     // of the whole record
+		};
+
+		std::string _path;
+		int _fd;
+		char* _map;
+		size_t _mapped;   // size of the mapping, and of the file
+		size_t _used;     // end of the last good record
+
+		std::shared_mutex _mtx;
+		std::unordered_map<dht::InfoHash, std::vector<Entry>> _index;
+		size_t _live;     // bytes in live records
+
+		std::atomic<size_t> _hits;
+		std::atomic<size_t> _misses;
+
+		void open_file(void);
+		void close_file(void);
+		void map_file(size_t);
+		void scan(void);
+		void compact(void);
+		void append(const dht::InfoHash&, uint16_t, dht::Value::Id,
+		            uint16_t, const dht::Blob&);
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_SEGMENT_CACHE_H
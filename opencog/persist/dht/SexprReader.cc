@@ -0,0 +1,285 @@
+/*
+ * SexprReader.cc
+ * Single-pass decoding of Atomese s-expressions.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <charconv>
+#include <unordered_map>
+
+#include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/base/Link.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/atom_types/NameServer.h>
+#include <opencog/atoms/value/FloatValue.h>
+#include <opencog/atoms/value/LinkValue.h>
+#include <opencog/atoms/value/StringValue.h>
+#include <opencog/atoms/truthvalue/CountTruthValue.h>
+#include <opencog/atoms/truthvalue/SimpleTruthValue.h>
+#include <opencog/atoms/truthvalue/TruthValue.h>
+
+#include "SexprReader.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+SexprReader::SexprReader(std::string_view s, size_t pos) :
+	_s(s), _pos(pos), _nodes(0), _links(0)
+{
+}
+
+void SexprReader::fail(const char* what) const
+{
+	size_t len = std::min(_s.size() - std::min(_pos, _s.size()), (size_t) 60);
+	std::string near(_s.substr(std::min(_pos, _s.size()), len));
+	throw SyntaxException(TRACE_INFO, "Bad %s at %zu: %s",
+		what, _pos, near.c_str());
+}
+
+void SexprReader::skip_ws(void)
+{
+	while (_pos < _s.size())
+	{
+		char c = _s[_pos];
+		if (' ' != c and '\t' != c and '\n' != c and '\r' != c) return;
+		_pos++;
+	}
+}
+
+void SexprReader::expect(char c)
+{
+	skip_ws();
+	if (_s.size() <= _pos or c != _s[_pos]) fail("s-expression");
+	_pos++;
+}
+
+/// A symbol runs until whitespace or a paren.
+std::string_view SexprReader::read_symbol(void)
+{
+	skip_ws();
+	size_t start = _pos;
+	while (_pos < _s.size())
+	{
+		char c = _s[_pos];
+		if (' ' == c or '\t' == c or '\n' == c or '\r' == c or
+		    '(' == c or ')' == c) break;
+		_pos++;
+	}
+	return _s.substr(start, _pos - start);
+}
+
+/// Read a double-quoted string, honoring backslash escapes.
+/// Strings without escapes are copied out in one go.
+std::string SexprReader::read_quoted(void)
+{
+	expect('"');
+	size_t start = _pos;
+	bool escaped = false;
+	while (_pos < _s.size() and '"' != _s[_pos])
+	{
+		if ('\\' == _s[_pos])
+		{
+			escaped = true;
+			_pos++;
+		}
+		_pos++;
+	}
+	if (_s.size() <= _pos) fail("string");
+
+	std::string_view raw(_s.substr(start, _pos - start));
+	_pos++; // skip closing quote
+	if (not escaped) return std::string(raw);
+
+	std::string str;
+	str.reserve(raw.size());
+	for (size_t i = 0; i < raw.size(); i++)
+	{
+		if ('\\' == raw[i] and i+1 < raw.size()) i++;
+		str.push_back(raw[i]);
+	}
+	return str;
+}
+
+double SexprReader::read_number(void)
+{
+	skip_ws();
+	const char* start = _s.data() + _pos;
+	const char* end = _s.data() + _s.size();
+	if (start < end and '+' == *start) start++;
+
+	double d = 0.0;
+	auto res = std::from_chars(start, end, d);
+	if (std::errc() != res.ec) fail("number");
+	_pos = res.ptr - _s.data();
+	return d;
+}
+
+/// The type names are looked up in a table built once, keyed by
+/// views of the names held by the nameserver, so that no string
+/// needs to be made for the lookup. Types created after the table
+/// was built fall back to the nameserver.
+Type SexprReader::read_type(void)
+{
+	static const std::unordered_map<std::string_view, Type> types = []()
+	{
+		std::unordered_map<std::string_view, Type> tmap;
+		Type ntypes = nameserver().getNumberOfClasses();
+		for (Type t = 0; t < ntypes; t++)
+			tmap.emplace(nameserver().getTypeName(t), t);
+
+		// Short-hand used by SimpleTruthValue::to_string()
+		tmap.emplace("stv", SIMPLE_TRUTH_VALUE);
+		return tmap;
+	}();
+
+	std::string_view sym(read_symbol());
+	const auto& it = types.find(sym);
+	if (types.end() != it) return it->second;
+
+	Type t = nameserver().getType(std::string(sym));
+	if (NOTYPE == t) fail("type");
+	return t;
+}
+
+/* ================================================================ */
+
+/// Convert a scheme expression into a C++ Atom.
+/// For example: `(Concept "foobar")`  or
+/// `(Evaluation (Predicate "blort") (List (Concept "foo") (Concept "bar")))`
+/// will return the corresponding atoms.
+Handle SexprReader::read_atom(void)
+{
+	expect('(');
+	return read_atom_body(read_type());
+}
+
+/// Read what follows the type, up to and including the closing paren.
+Handle SexprReader::read_atom_body(Type t)
+{
+	if (nameserver().isNode(t))
+	{
+		std::string name(read_quoted());
+		expect(')');
+		_nodes++;
+		return createNode(t, std::move(name));
+	}
+
+	if (not nameserver().isLink(t)) fail("Atom type");
+
+	HandleSeq oset;
+	skip_ws();
+	while (_pos < _s.size() and ')' != _s[_pos])
+	{
+		oset.emplace_back(read_atom());
+		skip_ws();
+	}
+	expect(')');
+	_links++;
+	return createLink(std::move(oset), t);
+}
+
+/**
+ * Return a Value corresponding to the input string.
+ * For example, `(FloatValue 1 2 3 4)` or
+ * `(LinkValue (FloatValue 1 2) (StringValue "a" "b"))`.
+ * Atoms are Values too, and are decoded as such. The subtypes of
+ * FloatValue, StringValue and LinkValue, other than the TruthValues,
+ * are decoded as the plain base type.
+ */
+ValuePtr SexprReader::read_value(void)
+{
+	expect('(');
+	Type t = read_type();
+
+	if (nameserver().isA(t, ATOM))
+		return read_atom_body(t);
+
+	if (nameserver().isA(t, FLOAT_VALUE))
+	{
+		std::vector<double> fv;
+		skip_ws();
+		while (_pos < _s.size() and ')' != _s[_pos])
+		{
+			fv.push_back(read_number());
+			skip_ws();
+		}
+		expect(')');
+
+		if (SIMPLE_TRUTH_VALUE == t)
+		{
+			if (2 != fv.size()) fail("SimpleTruthValue");
+			return ValueCast(createSimpleTruthValue(fv[0], fv[1]));
+		}
+		if (COUNT_TRUTH_VALUE == t)
+		{
+			if (3 != fv.size()) fail("CountTruthValue");
+			return ValueCast(createCountTruthValue(fv[0], fv[1], fv[2]));
+		}
+		if (nameserver().isA(t, TRUTH_VALUE))
+			return ValueCast(TruthValue::factory(t, fv));
+
+		// The other subtypes (e.g. the streams) can't be rebuilt from
+		// their numbers; they come back as plain FloatValues.
+		return createFloatValue(fv);
+	}
+
+	if (nameserver().isA(t, STRING_VALUE))
+	{
+		std::vector<std::string> sv;
+		skip_ws();
+		while (_pos < _s.size() and ')' != _s[_pos])
+		{
+			sv.emplace_back(read_quoted());
+			skip_ws();
+		}
+		expect(')');
+		return createStringValue(sv);
+	}
+
+	if (nameserver().isA(t, LINK_VALUE))
+	{
+		std::vector<ValuePtr> vv;
+		skip_ws();
+		while (_pos < _s.size() and ')' != _s[_pos])
+		{
+			vv.emplace_back(read_value());
+			skip_ws();
+		}
+		expect(')');
+		return createLinkValue(vv);
+	}
+
+	fail("Value type");
+}
+
+/**
+ * Decode a Valuation association list.
+ * This list has the format
+ * ((KEY . VALUE)(KEY2 . VALUE2)...)
+ * Store the results as values on the atom.
+ * An empty string is an empty list.
+ */
+void SexprReader::read_alist(const Handle& atom)
+{
+	skip_ws();
+	if (_s.size() <= _pos) return;
+
+	expect('(');
+	skip_ws();
+	while (_pos < _s.size() and ')' != _s[_pos])
+	{
+		expect('(');
+		Handle key(read_atom());
+		expect('.');
+		ValuePtr val(read_value());
+		expect(')');
+		atom->setValue(key, val);
+		skip_ws();
+	}
+	expect(')');
+}
+
+/* ============================= END OF FILE ================= */
@@ -0,0 +1,73 @@
+/*
+ * FILE:
+ * opencog/persist/dht/SexprReader.h
+
+ * FUNCTION:
+ * Single-pass decoder for the Atomese s-expressions that the
+ * DHT text records hold.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_SEXPR_READER_H
+#define _OPENCOG_SEXPR_READER_H
+
+#include <string>
+#include <string_view>
+
+#include <opencog/atoms/base/Handle.h>
+#include <opencog/atoms/value/Value.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// Decode Atoms and Values from their s-expression form, for example
+/// `(ConceptNode "foo")` or `(FloatValue 1 2 3)`, or an association
+/// list of the form `((KEY . VALUE)(KEY2 . VALUE2))`.
+///
+/// The input is scanned exactly once, left to right; it is never
+/// modified, and no substrings are made of it. The only allocations
+/// are those needed to create the resulting Atoms and Values.
+class SexprReader
+{
+	private:
+		std::string_view _s;
+		size_t _pos;
+		size_t _nodes;
+		size_t _links;
+
+		void skip_ws(void);
+		void expect(char);
+		std::string_view read_symbol(void);
+		std::string read_quoted(void);
+		double read_number(void);
+		Type read_type(void);
+		Handle read_atom_body(Type);
+		[[noreturn]] void fail(const char*) const;
+
+	public:
+		SexprReader(std::string_view s, size_t pos = 0);
+
+		Handle read_atom(void);
+		ValuePtr read_value(void);
+		void read_alist(const Handle&);
+
+		/// Position just past whatever was read last.
+		size_t pos(void) const { return _pos; }
+
+		/// Number of Nodes and Links created so far.
+		size_t nodes(void) const { return _nodes; }
+		size_t links(void) const { return _links; }
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_SEXPR_READER_H
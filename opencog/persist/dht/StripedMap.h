@@ -0,0 +1,354 @@
+/*
+ * FILE:
+ * opencog/persist/dht/StripedMap.h
+
+ * FUNCTION:
+ * Lock-striped concurrent hash map, with CLOCK eviction,
+ * for the driver caches.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_STRIPED_MAP_H
+#define _OPENCOG_STRIPED_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/// A hash map split into independently-locked stripes. Threads
+/// touching different keys will (almost always) take different
+/// locks, and so do not contend. The key hash is computed once,
+/// before any lock is taken; it picks the stripe.
+///
+/// The map may be given a memory budget; when it is over budget,
+/// entries are evicted with the CLOCK algorithm (each stripe has its
+/// own clock). Only the memory of the map itself is accounted for;
+/// whatever the keys and values point at is not. Thus, this is
+/// intended for caches, where an evicted entry is recomputed or
+/// refetched on the next miss.
+///
+/// Values are returned by copy, never by reference, as a reference
+/// would outlive the lock.
+template<typename K, typename V,
+         typename Hash = std::hash<K>, size_t NSTRIPES = 64>
+class StripedMap
+{
+	private:
+		struct Entry
+		{
+			V val;
+			size_t slot;    // position in the clock ring
+			bool ref;       // the CLOCK reference bit
+			bool pinned;    // never evicted
+		};
+		typedef std::unordered_map<K, Entry, Hash> Map;
+		typedef typename Map::value_type Node;
+
+		// Pad the stripes, so that the locks do not share cache lines.
+		// The ring holds pointers to the map nodes; these stay put
+		// even when the map is rehashed.
+		struct alignas(64) Stripe
+		{
+			std::mutex mtx;
+			Map map;
+			std::vector<Node*> ring;
+			size_t hand = 0;
+
+			size_t hits = 0;
+			size_t misses = 0;
+			size_t evictions = 0;
+		};
+		Stripe _stripes[NSTRIPES];
+
+		// Maximum entries per stripe; zero means unbounded.
+		std::atomic<size_t> _max_entries;
+
+		// Fibonacci hashing, to mix all of the bits of the key hash
+		// into the ones that pick the stripe.
+		Stripe& stripe(const K& key)
+		{
+			uint64_t h = Hash()(key) * 0x9E3779B97F4A7C15ULL;
+			return _stripes[(h >> 32) % NSTRIPES];
+		}
+
+		// Add a new entry. Caller must hold the stripe lock.
+		// New entries start out unreferenced; they are the first to
+		// go, unless they get used again before the hand comes by.
+		// This keeps a scan over many cold keys from flushing out
+		// the hot ones.
+		typename Map::iterator add(Stripe& s, const K& key, const V& val)
+		{
+			auto it = s.map.emplace(key,
+				Entry{val, s.ring.size(), false, false}).first;
+			s.ring.push_back(&*it);
+			return it;
+		}
+
+		// Remove an entry. Caller must hold the stripe lock. The last
+		// entry in the ring is moved into the hole; this shuffles the
+		// clock order a little, which doesn't matter.
+		typename Map::iterator drop(Stripe& s, typename Map::iterator it)
+		{
+			size_t slot = it->second.slot;
+			Node* last = s.ring.back();
+			s.ring[slot] = last;
+			last->second.slot = slot;
+			s.ring.pop_back();
+			return s.map.erase(it);
+		}
+
+		// Evict until the stripe is within budget. Caller must hold
+		// the stripe lock. Pinned entries are passed over; if there
+		// is nothing else, the stripe stays over budget. Two sweeps
+		// are enough to find out: the first clears the reference bits.
+		void evict(Stripe& s)
+		{
+			size_t max = _max_entries.load(std::memory_order_relaxed);
+			if (0 == max) return;
+			size_t passed = 0;
+			while (max < s.map.size())
+			{
+				if (2 * s.ring.size() < passed) return;
+				if (s.ring.size() <= s.hand) s.hand = 0;
+				Node* n = s.ring[s.hand];
+				if (n->second.pinned or n->second.ref)
+				{
+					n->second.ref = false;
+					s.hand++;
+					passed++;
+					continue;
+				}
+				drop(s, s.map.find(n->first));
+				s.evictions++;
+				passed = 0;
+			}
+		}
+
+	public:
+		/// Approximate memory used by one entry: the map node, the
+		/// hash bucket, and the clock ring slot.
+		static constexpr size_t ENTRY_BYTES =
+			sizeof(Node) + 2 * sizeof(void*) + sizeof(size_t) + sizeof(Node*);
+
+		StripedMap(void) : _max_entries(0) {}
+
+		/// Limit the memory used by the map. Zero means unbounded.
+		/// Every stripe gets an equal share of the budget.
+		void set_budget(size_t bytes)
+		{
+			size_t max = 0;
+			if (0 < bytes)
+				max = std::max((size_t) 1, bytes / (ENTRY_BYTES * NSTRIPES));
+			_max_entries = max;
+
+			for (Stripe& s : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(s.mtx);
+				evict(s);
+			}
+		}
+
+		size_t get_budget(void) const
+		{
+			return _max_entries * ENTRY_BYTES * NSTRIPES;
+		}
+
+		/// Look up the key; return true, and the value, if found.
+		bool get(const K& key, V& val)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			const auto& it = s.map.find(key);
+			if (s.map.end() == it) { s.misses++; return false; }
+			s.hits++;
+			it->second.ref = true;
+			val = it->second.val;
+			return true;
+		}
+
+		bool contains(const K& key)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			const auto& it = s.map.find(key);
+			if (s.map.end() == it) { s.misses++; return false; }
+			s.hits++;
+			it->second.ref = true;
+			return true;
+		}
+
+		/// Insert, if not already present. Return the value that is
+		/// in the map afterwards: either the given one, or the one
+		/// that some other thread got in first with.
+		V insert(const K& key, const V& val)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			const auto& it = s.map.find(key);
+			if (s.map.end() != it) return it->second.val;
+			add(s, key, val);
+			evict(s);
+			return val;
+		}
+
+		/// Insert, if not already present. Return true if inserted.
+		bool try_insert(const K& key, const V& val)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			if (s.map.end() != s.map.find(key)) return false;
+			add(s, key, val);
+			evict(s);
+			return true;
+		}
+
+		/// Insert, or overwrite.
+		void set(const K& key, const V& val)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			const auto& it = s.map.find(key);
+			if (s.map.end() != it)
+			{
+				it->second.val = val;
+				it->second.ref = true;
+				return;
+			}
+			add(s, key, val);
+			evict(s);
+		}
+
+		/// Insert, or overwrite, and keep the entry from ever being
+		/// evicted. It stays until it is erased.
+		void pin(const K& key, const V& val)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			auto it = s.map.find(key);
+			if (s.map.end() == it) it = add(s, key, val);
+			else it->second.val = val;
+			it->second.pinned = true;
+			evict(s);
+		}
+
+		/// If the key is present, call `fn` on the value, with the
+		/// stripe locked. Return true if the key was present.
+		template<typename F>
+		bool update(const K& key, F&& fn)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			const auto& it = s.map.find(key);
+			if (s.map.end() == it) return false;
+			it->second.ref = true;
+			fn(it->second.val);
+			return true;
+		}
+
+		bool erase(const K& key)
+		{
+			Stripe& s = stripe(key);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			const auto& it = s.map.find(key);
+			if (s.map.end() == it) return false;
+			drop(s, it);
+			return true;
+		}
+
+		/// Remove everything for which `pred(key, value)` is true.
+		/// The stripes are locked one at a time.
+		template<typename P>
+		void erase_if(P&& pred)
+		{
+			for (Stripe& s : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(s.mtx);
+				for (auto it = s.map.begin(); it != s.map.end(); )
+				{
+					if (pred(it->first, it->second.val))
+						it = drop(s, it);
+					else
+						it++;
+				}
+			}
+		}
+
+		/// Approximate size; the stripes are counted one at a time.
+		size_t size(void)
+		{
+			size_t sz = 0;
+			for (Stripe& s : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(s.mtx);
+				sz += s.map.size();
+			}
+			return sz;
+		}
+
+		void clear(void)
+		{
+			for (Stripe& s : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(s.mtx);
+				s.map.clear();
+				s.ring.clear();
+				s.hand = 0;
+			}
+		}
+
+		/// Usage statistics, summed over all stripes.
+		struct Stats
+		{
+			size_t entries = 0;
+			size_t bytes = 0;
+			size_t hits = 0;
+			size_t misses = 0;
+			size_t evictions = 0;
+		};
+
+		Stats stats(void)
+		{
+			Stats st;
+			for (Stripe& s : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(s.mtx);
+				st.entries += s.map.size();
+				st.hits += s.hits;
+				st.misses += s.misses;
+				st.evictions += s.evictions;
+			}
+			st.bytes = st.entries * ENTRY_BYTES;
+			return st;
+		}
+
+		void clear_stats(void)
+		{
+			for (Stripe& s : _stripes)
+			{
+				std::lock_guard<std::mutex> lck(s.mtx);
+				s.hits = 0;
+				s.misses = 0;
+				s.evictions = 0;
+			}
+		}
+};
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_STRIPED_MAP_H
@@ -0,0 +1,168 @@
+/*
+ * FILE:
+ * opencog/persist/dht/ValuesMerge.h
+
+ * FUNCTION:
+ * Merging of Values records, for the "merge" values policy.
+ *
+ * HISTORY:
+ * Copyright (c) 2019 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#ifndef _OPENCOG_DHT_VALUES_MERGE_H
+#define _OPENCOG_DHT_VALUES_MERGE_H
+
+#include <algorithm>
+
+#include <opencog/persist/dht/DHTRecords.h>
+
+namespace opencog
+{
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+// These are run by every DHT node that stores a Values record, when
+// a new record arrives for a key that already has one; they are also
+// run by readers, on the records that come back from several nodes.
+// Thus, the counts must not depend on the order in which records are
+// merged, nor on how often the same record is merged.
+//
+// The counts of CountTruthValues are state-based CRDT counters: every
+// writer has its own share of the count, and says what its share is
+// now (not how much it changed). Shares are merged by keeping the
+// most recent one from each writer. This is idempotent, so that
+// retried puts don't count twice, and commutative, so that writers
+// need not read the count before changing it. Everything else is
+// last-writer-wins, as before.
+
+/// Merge the shares in `from` into `into`.
+inline void merge_counts(std::vector<CountRecord>& into,
+                         const std::vector<CountRecord>& from)
+{
+	for (const CountRecord& cr : from)
+	{
+		auto it = std::find_if(into.begin(), into.end(),
+			[&cr](const CountRecord& o) { return o.w == cr.w; });
+		if (into.end() == it)
+			into.push_back(cr);
+		else if (it->q < cr.q)
+			*it = cr;
+	}
+}
+
+/// The count is the sum of the shares.
+inline double count_total(const std::vector<CountRecord>& shares)
+{
+	double total = 0.0;
+	for (const CountRecord& cr : shares) total += cr.n;
+	return total;
+}
+
+/// Writer zero is anonymous: it holds whatever part of the count was
+/// written without shares.
+#define ANON_WRITER 0
+
+/// Update the key-value `into` with `from`, for the same key.
+inline void merge_key_value(KeyValueRecord& into, const KeyValueRecord& from)
+{
+	// A count written without shares (by a writer that does not merge)
+	// sets the total. The other writers keep their shares; the
+	// anonymous share is whatever is left over. Dropping the shares
+	// would count them twice, the next time that they are merged.
+	if (0 == from.c.size())
+	{
+		std::vector<CountRecord> shares(std::move(into.c));
+		into = from;
+		if (0 == shares.size() or 3 != from.val.f.size()) return;
+
+		uint64_t seq = 0;
+		for (const CountRecord& cr : shares)
+			if (ANON_WRITER == cr.w) seq = cr.q;
+		shares.erase(std::remove_if(shares.begin(), shares.end(),
+			[](const CountRecord& cr) { return ANON_WRITER == cr.w; }),
+			shares.end());
+		shares.push_back(CountRecord{ANON_WRITER, seq + 1,
+			from.val.f[2] - count_total(shares)});
+		into.c = std::move(shares);
+		return;
+	}
+
+	// A count without shares becomes the share of the anonymous
+	// writer, so that it is kept.
+	std::vector<CountRecord> shares(std::move(into.c));
+	if (0 == shares.size() and 3 == into.val.f.size())
+		shares.push_back(CountRecord{ANON_WRITER, 0, into.val.f[2]});
+
+	merge_counts(shares, from.c);
+	into = from;
+	into.c = std::move(shares);
+	if (3 == into.val.f.size())
+		into.val.f[2] = count_total(into.c);
+}
+
+inline KeyValueRecord* find_key_value(ValuesRecord& rec,
+                                      const dht::InfoHash& key)
+{
+	for (KeyValueRecord& kv : rec.kvs)
+		if (kv.k == key) return &kv;
+	return nullptr;
+}
+
+/// True if the record has to be sent as DHT_MERGE_VERSION.
+inline bool uses_merge(const ValuesRecord& rec)
+{
+	if (rec.d or 0 < rec.x.size()) return true;
+	for (const KeyValueRecord& kv : rec.kvs)
+		if (0 < kv.c.size()) return true;
+	return false;
+}
+
+/// Merge the record `from` into `into`. If `from` is a delta, then
+/// the keys that it does not mention are kept; else, it has all of
+/// the keys, and the ones that it does not have are gone. Either way,
+/// the counts are merged, so that no one's share is lost.
+inline void merge_values_record(ValuesRecord& into, const ValuesRecord& from)
+{
+	if (from.d)
+	{
+		for (const dht::InfoHash& gone : from.x)
+			into.kvs.erase(std::remove_if(into.kvs.begin(), into.kvs.end(),
+				[&gone](const KeyValueRecord& kv) { return kv.k == gone; }),
+				into.kvs.end());
+
+		for (const KeyValueRecord& kv : from.kvs)
+		{
+			KeyValueRecord* old = find_key_value(into, kv.k);
+			if (old)
+				merge_key_value(*old, kv);
+			else
+				into.kvs.push_back(kv);
+		}
+	}
+	else
+	{
+		ValuesRecord rec(from);
+		for (KeyValueRecord& kv : rec.kvs)
+		{
+			KeyValueRecord* old = find_key_value(into, kv.k);
+			if (nullptr == old) continue;
+			if (0 == kv.c.size() and 0 == old->c.size()) continue;
+			KeyValueRecord merged(*old);
+			merge_key_value(merged, kv);
+			kv = std::move(merged);
+		}
+		into = std::move(rec);
+	}
+
+	into.x.clear();
+	into.v = uses_merge(into) ? DHT_MERGE_VERSION : DHT_WIRE_VERSION;
+}
+
+/** @}*/
+} // namespace opencog
+
+#endif // _OPENCOG_DHT_VALUES_MERGE_H
@@ -0,0 +1,79 @@
+/*
+ * seeder.cc
+ * Keep an AtomSpace alive in the DHT, from a local disk copy.
+ *
+ * Copyright (c) 2019 Linas Vepstas <linas@linas.org>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * Example usage:
+ *    seeder -b dht://bootstrap.example.com:4343/ \
+ *       "dht://:4343/atomspace-name?cache=/var/lib/atomspace&lifetime=30"
+ *
+ * The `lifetime` (minutes) should be the same as what the clients use.
+ * The `refresh`, `hot` and `refresh_rate` URI parameters control what
+ * is re-put, and how often. See DHTSeeder.cc for how this works.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <opencog/persist/dht/DHTAtomStorage.h>
+
+using namespace opencog;
+
+static std::atomic<bool> stop(false);
+
+static void on_signal(int)
+{
+	stop = true;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-b dht://host:port/] uri\n"
+		"   -b  bootstrap from this peer; may be given more than once.\n"
+		"   uri the AtomSpace to seed; it must have a cache= parameter.\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> peers;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "b:")))
+	{
+		switch (opt)
+		{
+			case 'b': peers.push_back(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc) usage(argv[0]);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	try
+	{
+		DHTAtomStorage store(argv[optind]);
+		for (const std::string& peer : peers)
+			store.dht_bootstrap(peer);
+
+		store.run_seeder(stop);
+	}
+	catch (const std::exception& ex)
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], ex.what());
+		return 1;
+	}
+	return 0;
+}
@@ -11,10 +11,19 @@
 	(string-append opencog-ext-path-persist-dht "libpersist-dht")
 	"opencog_persist_dht_init")
 
+(define (dht-metrics)
+	(call-with-input-string (dht-metrics-string) read))
+
+(define* (dht-fetch-neighborhood ATOM #:optional (DEPTH 1) (TYPE ""))
+	(dht-fetch-neighborhood-typename ATOM DEPTH
+		(if (symbol? TYPE) (symbol->string TYPE) TYPE)))
+
 (export dht-bootstrap dht-clear-stats dht-close dht-open dht-stats
 	dht-examine dht-atomspace-hash dht-immutable-hash dht-atom-hash
 	dht-node-info dht-storage-log dht-routing-tables-log dht-searches-log
-	dht-load-atomspace)
+	dht-load-atomspace dht-fetch-neighborhood dht-store-atoms dht-set-lifetime
+	dht-listen-atomspace dht-listen-values dht-listen-incoming dht-unlisten
+	dht-metrics dht-prometheus)
 
 ; --------------------------------------------------------------
 
@@ -62,6 +71,30 @@
     be accumulated.
 ")
 
+(set-procedure-property! dht-metrics 'documentation
+"
+ dht-metrics - Return the performance metrics, as an association list.
+    This holds the get and put latencies, in milliseconds, for each
+    kind of DHT value (atom, space, values, incoming), the depths of
+    the lookup and store queues, the size and depth of the routing
+    table, and the timeout and failure counts.
+    Gets that found nothing are counted as `miss`.
+
+    Example: The 99th percentile of the get latency for Values:
+       (assoc-ref (assoc-ref (assoc-ref (dht-metrics) 'gets) 'values)
+          'p99-ms)
+")
+
+(set-procedure-property! dht-prometheus 'documentation
+"
+ dht-prometheus - Return the performance metrics, as Prometheus text.
+    The latencies are histograms, in seconds, with a `policy` label.
+
+    Example: Write them where the node exporter will find them:
+       (with-output-to-file \"/var/lib/node_exporter/atomspace.prom\"
+          (lambda () (display (dht-prometheus))))
+")
+
 (set-procedure-property! dht-close 'documentation
 "
  dht-close - close the currently open DHT backend.
@@ -122,6 +155,21 @@
      (dht-open \"dht://localhost:5001/atomspace-test\")
 ")
 
+(set-procedure-property! dht-set-lifetime 'documentation
+"
+ dht-set-lifetime POLICY MINUTES - Set how long the DHT keeps data.
+    POLICY is one of \"atom\", \"space\", \"values\" or \"incoming\".
+    Data put from now on expires after MINUTES, unless it is put again.
+    Data that is in use is put again before it expires; see the
+    `refresh` and `hot` URI parameters. This only changes the local
+    DHT node; the other nodes keep what they were configured with.
+    The initial lifetimes can also be given in the URI, e.g.
+       (dht-open \"dht:///atomspace-test?values_lifetime=120\")
+
+    Example: Have Values expire after two hours:
+       (dht-set-lifetime \"values\" 120)
+")
+
 (set-procedure-property! dht-stats 'documentation
 "
  dht-stats - report performance statistics.
@@ -145,6 +193,77 @@
  dht-searches-log - Return string w/the DHT Node searches log.
 ")
 
+(set-procedure-property! dht-listen-atomspace 'documentation
+"
+ dht-listen-atomspace - Follow changes to the open AtomSpace.
+    Atoms added to the AtomSpace by other DHT users are added here,
+    together with their Values; Atoms that they delete are deleted
+    here. The Atoms already in the DHT are delivered first, so this
+    can be used instead of `dht-load-atomspace`.
+
+    Returns a subscription id, for `dht-unlisten`.
+
+    Example:
+       (define sub (dht-listen-atomspace))
+       ...
+       (dht-unlisten sub)
+")
+
+(set-procedure-property! dht-listen-values 'documentation
+"
+ dht-listen-values ATOM - Follow changes to the Values on ATOM.
+    The Values on ATOM are updated whenever another DHT user stores
+    them. Returns a subscription id, for `dht-unlisten`.
+
+    Example:
+       (dht-listen-values (Concept \"foo\"))
+")
+
+(set-procedure-property! dht-listen-incoming 'documentation
+"
+ dht-listen-incoming ATOM - Follow changes to the IncomingSet of ATOM.
+    Links holding ATOM, that are created by other DHT users, are
+    added here, together with their Values; those that are deleted
+    are deleted here. Returns a subscription id, for `dht-unlisten`.
+")
+
+(set-procedure-property! dht-unlisten 'documentation
+"
+ dht-unlisten ID - Cancel the subscription ID.
+    The ID is what `dht-listen-atomspace`, `dht-listen-values` or
+    `dht-listen-incoming` returned. All subscriptions are cancelled
+    by `dht-close`.
+")
+
+(set-procedure-property! dht-fetch-neighborhood 'documentation
+"
+ dht-fetch-neighborhood ATOM [DEPTH] [TYPE] - Fetch the neighborhood
+    of ATOM, out to DEPTH hops (one, by default), into the AtomSpace.
+    One hop goes from an Atom to a Link holding it, and across, to
+    the other Atoms in that Link. The Values on all of them are
+    fetched too. If TYPE is given, only holders of that type are
+    followed. Everything is asked for at once, so this is much faster
+    than walking the graph with `fetch-incoming-set`. Returns the
+    number of Atoms fetched.
+
+    Example:
+       (dht-fetch-neighborhood (Concept \"foo\") 2 'ListLink)
+")
+
+(set-procedure-property! dht-store-atoms 'documentation
+"
+ dht-store-atoms ATOM-LIST - Store all of the Atoms in ATOM-LIST, with
+    their Values, and everything that they hold. This does the same as
+    calling `store-atom` on each of them, but in one pass: an Atom held
+    by many of them is stored just once, and the incoming-set records
+    that go on the same Atom are sent together. Much faster than
+    `store-atom` for many Links sharing a few hub Atoms.
+
+    Example:
+       (dht-store-atoms (list (List (Word \"the\") (Word \"cat\"))
+                              (List (Word \"the\") (Word \"dog\"))))
+")
+
 (set-procedure-property! dht-load-atomspace 'documentation
 "
  dht-load-atomspace PATH - Load all Atoms from the PATH into the AtomSpace.